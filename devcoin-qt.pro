@@ -58,6 +58,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/json/json_spirit_utils.h \
     src/json/json_spirit_stream_reader.h \
     src/json/json_spirit_reader_template.h \
+    src/json/json_spirit_fast_reader.h \
     src/json/json_spirit_reader.h \
     src/json/json_spirit_error_position.h \
     src/json/json_spirit.h \
@@ -31,34 +31,48 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID)
 
     // Check that the chain merkle root is in the coinbase
     uint256 nRootHash = CBlock::CheckMerkleBranch(hashAuxBlock, vChainMerkleBranch, nChainIndex);
-    vector<unsigned char> vchRootHash(nRootHash.begin(), nRootHash.end());
-    std::reverse(vchRootHash.begin(), vchRootHash.end()); // correct endian
+    unsigned char pchRootHash[32];
+    std::reverse_copy(nRootHash.begin(), nRootHash.end(), pchRootHash); // correct endian
 
-    // Check that we are in the parent block merkle tree
-    if (CBlock::CheckMerkleBranch(GetHash(), vMerkleBranch, nIndex) != parentBlock.hashMerkleRoot)
-        return error("Aux POW merkle root incorrect");
-
-    const CScript script = vin[0].scriptSig;
+    const CScript& script = vin[0].scriptSig;
 
     // Check that the same work is not submitted twice to our chain.
     //
 
-    CScript::const_iterator pcHead =
-        std::search(script.begin(), script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
-
-    CScript::const_iterator pc =
-        std::search(script.begin(), script.end(), vchRootHash.begin(), vchRootHash.end());
+    // Find the first merged mining header, whether there is a second one and
+    // the first chain merkle root in one pass over the coinbase
+    const unsigned char* pbegin = script.empty() ? NULL : &script[0];
+    const unsigned char* pend = pbegin + script.size();
+    const unsigned char* pHead = NULL;
+    const unsigned char* pRoot = NULL;
+    bool fMultipleHeads = false;
+    for (const unsigned char* p = pbegin; p < pend; p++)
+    {
+        if (*p == pchMergedMiningHeader[0] && pend - p >= (int)sizeof(pchMergedMiningHeader) &&
+            memcmp(p, pchMergedMiningHeader, sizeof(pchMergedMiningHeader)) == 0)
+        {
+            if (pHead)
+                fMultipleHeads = true;
+            else
+                pHead = p;
+        }
+        if (!pRoot && *p == pchRootHash[0] && pend - p >= (int)sizeof(pchRootHash) &&
+            memcmp(p, pchRootHash, sizeof(pchRootHash)) == 0)
+            pRoot = p;
+        if (pRoot && fMultipleHeads)
+            break;
+    }
 
-    if (pc == script.end())
+    if (!pRoot)
         return error("Aux POW missing chain merkle root in parent coinbase");
 
-    if (pcHead != script.end())
+    if (pHead)
     {
         // Enforce only one chain merkle root by checking that a single instance of the merged
         // mining header exists just before.
-        if (script.end() != std::search(pcHead + 1, script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader)))
+        if (fMultipleHeads)
             return error("Multiple merged mining headers in coinbase");
-        if (pcHead + sizeof(pchMergedMiningHeader) != pc)
+        if (pHead + sizeof(pchMergedMiningHeader) != pRoot)
             return error("Merged mining header is not just before chain merkle root");
     }
     else
@@ -66,15 +80,15 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID)
         // For backward compatibility.
         // Enforce only one chain merkle root by checking that it starts early in the coinbase.
         // 8-12 bytes are enough to encode extraNonce and nBits.
-        if (pc - script.begin() > 20)
+        if (pRoot - pbegin > 20)
             return error("Aux POW chain merkle root must start in the first 20 bytes of the parent coinbase");
     }
 
 
     // Ensure we are at a deterministic point in the merkle leaves by hashing
     // a nonce and our chain ID and comparing to the index.
-    pc += vchRootHash.size();
-    if (script.end() - pc < 8)
+    const unsigned char* pc = pRoot + sizeof(pchRootHash);
+    if (pend - pc < 8)
         return error("Aux POW missing chain merkle tree size and nonce in parent coinbase");
 
     int nSize;
@@ -99,6 +113,11 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID)
     if (nChainIndex != (rand % nSize))
         return error("Aux POW wrong index");
 
+    // Check that we are in the parent block merkle tree, last as hashing the
+    // coinbase and its branch is the costliest step
+    if (CBlock::CheckMerkleBranch(GetHash(), vMerkleBranch, nIndex) != parentBlock.hashMerkleRoot)
+        return error("Aux POW merkle root incorrect");
+
     return true;
 }
 
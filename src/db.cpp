@@ -46,7 +46,7 @@ public:
 instance_of_cdbinit;
 
 
-CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
+CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL), fJournal(false), pcursorJournal(NULL)
 {
     int ret;
     if (pszFile == NULL)
@@ -91,6 +91,7 @@ CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
         }
 
         strFile = pszFile;
+        fJournal = (pwalletJournal && pwalletJournal->strFile == strFile);
         ++mapFileUseCount[strFile];
         pdb = mapDb[strFile];
         if (pdb == NULL)
@@ -134,6 +135,10 @@ void CDB::Close()
     if (!vTxn.empty())
         vTxn.front()->abort();
     vTxn.clear();
+    vJournalBatch.clear();
+    vJournalMark.clear();
+    pcursorJournal = NULL;
+    mapCursorPending.clear();
     pdb = NULL;
 
     // Flush database activity from memory pool to disk log
@@ -150,6 +155,124 @@ void CDB::Close()
         --mapFileUseCount[strFile];
 }
 
+bool CDB::CompactJournal()
+{
+    if (!pdb || !fJournal)
+        return false;
+    return pwalletJournal->Compact(pdb);
+}
+
+int CDB::JournalLookup(const CDataStream& ssKey, string& strValueRet)
+{
+    // 1 if the journal has a value for the key, -1 if it erased it, 0 if
+    // the database file has the current value.  Writes made in the open
+    // transaction are checked first.
+    string strKey(ssKey.begin(), ssKey.end());
+    for (vector<CJournalRecord>::reverse_iterator it = vJournalBatch.rbegin(); it != vJournalBatch.rend(); ++it)
+    {
+        if ((*it).strKey != strKey)
+            continue;
+        if ((*it).fErase)
+            return -1;
+        strValueRet = (*it).strValue;
+        return 1;
+    }
+    return pwalletJournal->Lookup(strKey, strValueRet);
+}
+
+bool CDB::JournalWrite(const CDataStream& ssKey, const CDataStream* pssValue)
+{
+    CJournalRecord record;
+    record.fErase = (pssValue == NULL);
+    record.strKey.assign(ssKey.begin(), ssKey.end());
+    if (pssValue)
+        record.strValue.assign(pssValue->begin(), pssValue->end());
+    if (!vTxn.empty())
+    {
+        vJournalBatch.push_back(record);
+        return true;
+    }
+    return pwalletJournal->Append(vector<CJournalRecord>(1, record));
+}
+
+void CDB::StartJournalCursor(Dbc* pcursor)
+{
+    // Compacting gives up rather than wait for a lock another transaction
+    // holds, and inside our own transaction it can't be done at all
+    if (vTxn.empty())
+        CompactJournal();
+
+    // Walk a copy of whatever is still pending with the writes of the open
+    // transaction on top, so the records read are the ones Read would return
+    pwalletJournal->GetPending(mapCursorPending);
+    BOOST_FOREACH(const CJournalRecord& record, vJournalBatch)
+        mapCursorPending[record.strKey] = make_pair(record.fErase, record.fErase ? string() : record.strValue);
+    if (mapCursorPending.empty())
+        return;
+    pcursorJournal = pcursor;
+    itCursorPending = mapCursorPending.begin();
+    fCursorDbNext = true;
+    nCursorDbRet = DB_NOTFOUND;
+}
+
+int CDB::ReadAtJournalCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    // Only the walks CWalletDB makes: DB_NEXT, and DB_SET_RANGE to start
+    if (fFlags == DB_SET_RANGE)
+    {
+        string strKey(ssKey.begin(), ssKey.end());
+        itCursorPending = mapCursorPending.lower_bound(strKey);
+        ssCursorDbKey = ssKey;
+        nCursorDbRet = ReadAtDbCursor(pcursor, ssCursorDbKey, ssCursorDbValue, DB_SET_RANGE);
+        fCursorDbNext = false;
+    }
+    else if (fFlags != DB_NEXT)
+        return EINVAL;
+
+    loop
+    {
+        if (fCursorDbNext)
+        {
+            nCursorDbRet = ReadAtDbCursor(pcursor, ssCursorDbKey, ssCursorDbValue, DB_NEXT);
+            fCursorDbNext = false;
+        }
+        if (nCursorDbRet != 0 && nCursorDbRet != DB_NOTFOUND)
+            return nCursorDbRet;
+
+        // Take the lower key of the two, the journal's if they're the same
+        bool fDb = (nCursorDbRet == 0);
+        bool fPending = (itCursorPending != mapCursorPending.end());
+        if (!fDb && !fPending)
+            return DB_NOTFOUND;
+        int nCompare = 1;
+        if (fDb && fPending)
+        {
+            string strDbKey(ssCursorDbKey.begin(), ssCursorDbKey.end());
+            nCompare = (*itCursorPending).first.compare(strDbKey);
+        }
+        if (fDb && (!fPending || nCompare > 0))
+        {
+            ssKey = ssCursorDbKey;
+            ssValue = ssCursorDbValue;
+            fCursorDbNext = true;
+            return 0;
+        }
+        if (nCompare == 0)
+            fCursorDbNext = true;
+        const pair<bool, string>& value = (*itCursorPending).second;
+        const string& strKey = (*itCursorPending++).first;
+        if (value.first)
+            continue;
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write(strKey.data(), strKey.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(value.second.data(), value.second.size());
+        return 0;
+    }
+}
+
 void static CloseDb(const string& strFile)
 {
     CRITICAL_BLOCK(cs_db)
@@ -387,6 +510,8 @@ bool CTxDB::LoadBlockIndex()
         return false;
 
     // Load mapBlockIndex
+    vector<CBlockIndex*> vUpgradeAuxPow;
+    int64 nUpgradeBytes = 0;
     unsigned int fFlags = DB_SET_RANGE;
     loop
     {
@@ -408,6 +533,7 @@ bool CTxDB::LoadBlockIndex()
         if (strType == "blockindex")
         {
             CDiskBlockIndex diskindex;
+            unsigned int nRecordBytes = ssValue.size();
             ssValue >> diskindex;
 
             // Construct block index object
@@ -422,7 +548,13 @@ bool CTxDB::LoadBlockIndex()
             pindexNew->nTime          = diskindex.nTime;
             pindexNew->nBits          = diskindex.nBits;
             pindexNew->nNonce         = diskindex.nNonce;
-            pindexNew->auxpow         = diskindex.auxpow;
+            pindexNew->hashParentBlock = diskindex.hashParentBlock;
+            if (diskindex.auxpow.get() != NULL)
+            {
+                pindexNew->hashParentBlock = diskindex.auxpow->GetParentBlockHash();
+                vUpgradeAuxPow.push_back(pindexNew);
+                nUpgradeBytes += nRecordBytes;
+            }
 
             // Watch for genesis block
             if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
@@ -438,6 +570,32 @@ bool CTxDB::LoadBlockIndex()
     }
     pcursor->close();
 
+    // Rewrite records that still carry a whole auxpow, it is in the block
+    // file already
+    if (!vUpgradeAuxPow.empty())
+    {
+        printf("LoadBlockIndex() : moving %d auxpows out of the block index\n", (int)vUpgradeAuxPow.size());
+        int64 nStart = GetTimeMillis();
+        int64 nCompactBytes = 0;
+        CTxDB txdb;
+        for (int i = 0; i < vUpgradeAuxPow.size(); i += 1000)
+        {
+            txdb.TxnBegin();
+            for (int j = i; j < vUpgradeAuxPow.size() && j < i + 1000; j++)
+            {
+                CDiskBlockIndex diskindex(vUpgradeAuxPow[j]);
+                nCompactBytes += ::GetSerializeSize(diskindex, SER_DISK);
+                txdb.WriteBlockIndex(diskindex);
+            }
+            if (!txdb.TxnCommit())
+                return error("LoadBlockIndex() : failed to rewrite block index");
+        }
+        // Berkeley DB reuses the freed pages rather than give them back, so
+        // blkindex.dat itself doesn't shrink, it just stops growing for a while
+        printf("LoadBlockIndex() : rewrote %d records from %"PRI64d" to %"PRI64d" bytes in %"PRI64d"ms\n",
+               (int)vUpgradeAuxPow.size(), nUpgradeBytes, nCompactBytes, GetTimeMillis() - nStart);
+    }
+
     // Calculate bnChainWork
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
@@ -466,6 +624,7 @@ bool CTxDB::LoadBlockIndex()
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexBest->bnChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
+    PublishChainSnapshot(pindexBest);
 
     // Load bnBestInvalidWork, OK if it doesn't exist
     ReadBestInvalidWork(bnBestInvalidWork);
@@ -610,9 +769,10 @@ bool CWalletDB::WriteAccount(const string& strAccount, const CAccount& account)
     return Write(make_pair(string("acc"), strAccount), account);
 }
 
-bool CWalletDB::WriteAccountingEntry(const CAccountingEntry& acentry)
+bool CWalletDB::WriteAccountingEntry(CAccountingEntry& acentry)
 {
-    return Write(make_tuple(string("acentry"), acentry.strAccount, ++nAccountingEntryNumber), acentry);
+    acentry.nEntryNo = ++nAccountingEntryNumber;
+    return Write(make_tuple(string("acentry"), acentry.strAccount, acentry.nEntryNo), acentry);
 }
 
 int64 CWalletDB::GetAccountCreditDebit(const string& strAccount)
@@ -672,11 +832,81 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 }
 
 
+//
+// A "tx" record read off the wallet cursor, deserialized by one of the
+// load threads into its (already created) mapWallet entry
+//
+class CWalletTxRecord
+{
+public:
+    uint256 hash;
+    CWalletTx* pwtx;
+    CDataStream ssValue;
+    bool fHashMismatch;
+    int nOldVersion;
+    bool fUpgraded;
+    bool fRepaired;
+    string strError;
+
+    CWalletTxRecord()
+    {
+        hash = 0;
+        pwtx = NULL;
+        fHashMismatch = false;
+        nOldVersion = 0;
+        fUpgraded = false;
+        fRepaired = false;
+    }
+};
+
+void static LoadWalletTx(deque<CWalletTxRecord>* pvTxRecord, CWallet* pwallet, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvTxRecord->size(); i += nThreads)
+    {
+        CWalletTxRecord& record = (*pvTxRecord)[i];
+        try
+        {
+            CWalletTx& wtx = *record.pwtx;
+            record.ssValue >> wtx;
+            wtx.pwallet = pwallet;
+
+            if (wtx.GetHash() != record.hash)
+                record.fHashMismatch = true;
+
+            // Undo serialize changes in 31600
+            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+            {
+                record.nOldVersion = wtx.fTimeReceivedIsTxTime;
+                if (!record.ssValue.empty())
+                {
+                    char fTmp;
+                    char fUnused;
+                    record.ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+                    wtx.fTimeReceivedIsTxTime = fTmp;
+                    record.fUpgraded = true;
+                }
+                else
+                {
+                    wtx.fTimeReceivedIsTxTime = 0;
+                    record.fRepaired = true;
+                }
+            }
+        }
+        catch (std::exception& e)
+        {
+            record.strError = e.what();
+        }
+        record.ssValue.clear();
+    }
+}
+
 bool CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey.clear();
     int nFileVersion = 0;
     vector<uint256> vWalletUpgrade;
+    deque<CWalletTxRecord> vTxRecord;
+    int64 nStart = GetTimeMillis();
 
     // Modify defaults
 #ifndef __WXMSW__
@@ -718,41 +948,15 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
             }
             else if (strType == "tx")
             {
+                // Deserialized below, several at a time
                 uint256 hash;
                 ssKey >> hash;
                 CWalletTx& wtx = pwallet->mapWallet[hash];
-                ssValue >> wtx;
-                wtx.pwallet = pwallet;
-
-                if (wtx.GetHash() != hash)
-                    printf("Error in wallet.dat, hash mismatch\n");
-
-                // Undo serialize changes in 31600
-                if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-                {
-                    if (!ssValue.empty())
-                    {
-                        char fTmp;
-                        char fUnused;
-                        ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                        printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = fTmp;
-                    }
-                    else
-                    {
-                        printf("LoadWallet() repairing tx ver=%d %s\n", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                        wtx.fTimeReceivedIsTxTime = 0;
-                    }
-                    vWalletUpgrade.push_back(hash);
-                }
-
-                //// debug print
-                //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-                //printf(" %12I64d  %s  %s  %s\n",
-                //    wtx.vout[0].nValue,
-                //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-                //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-                //    wtx.mapValue["message"].c_str());
+                vTxRecord.push_back(CWalletTxRecord());
+                CWalletTxRecord& record = vTxRecord.back();
+                record.hash = hash;
+                record.pwtx = &wtx;
+                record.ssValue.swap(ssValue);
             }
             else if (strType == "acentry")
             {
@@ -762,6 +966,12 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
                 ssKey >> nNumber;
                 if (nNumber > nAccountingEntryNumber)
                     nAccountingEntryNumber = nNumber;
+
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                acentry.strAccount = strAccount;
+                acentry.nEntryNo = nNumber;
+                pwallet->IndexAccountingEntry(acentry);
             }
             else if (strType == "key" || strType == "wkey")
             {
@@ -813,6 +1023,38 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
             }
         }
         pcursor->close();
+        int64 nReadTime = GetTimeMillis() - nStart;
+
+        // Deserialize and hash the transactions on several threads
+        nStart = GetTimeMillis();
+        int nThreads = 1;
+        if (vTxRecord.size() >= 1000)
+            nThreads = max(1, min(8, (int)boost::thread::hardware_concurrency()));
+        if (nThreads == 1)
+            LoadWalletTx(&vTxRecord, pwallet, 0, 1);
+        else
+        {
+            boost::thread_group threads;
+            for (int i = 0; i < nThreads; i++)
+                threads.create_thread(boost::bind(&LoadWalletTx, &vTxRecord, pwallet, i, nThreads));
+            threads.join_all();
+        }
+
+        BOOST_FOREACH(const CWalletTxRecord& record, vTxRecord)
+        {
+            if (record.strError != "")
+                throw runtime_error(strprintf("CWalletDB::LoadWallet() : tx %s : %s", record.hash.ToString().c_str(), record.strError.c_str()));
+            if (record.fHashMismatch)
+                printf("Error in wallet.dat, hash mismatch\n");
+            if (record.fUpgraded)
+                printf("LoadWallet() upgrading tx ver=%d %d '%s' %s\n", record.nOldVersion, record.pwtx->fTimeReceivedIsTxTime, record.pwtx->strFromAccount.c_str(), record.hash.ToString().c_str());
+            if (record.fRepaired)
+                printf("LoadWallet() repairing tx ver=%d %s\n", record.nOldVersion, record.hash.ToString().c_str());
+            if (record.fUpgraded || record.fRepaired)
+                vWalletUpgrade.push_back(record.hash);
+        }
+        printf("LoadWallet() : read records in %"PRI64d"ms, loaded %d transactions on %d threads in %"PRI64d"ms\n",
+               nReadTime, vTxRecord.size(), nThreads, GetTimeMillis() - nStart);
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)
@@ -844,6 +1086,279 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
     return true;
 }
 
+//
+// CWalletJournal
+//
+
+CWalletJournal* pwalletJournal = NULL;
+
+static const unsigned int JOURNAL_MAGIC = 0x6c6e726a;
+
+string static GetJournalPath(const string& strFile)
+{
+    return GetDataDir() + "/" + strFile + ".journal";
+}
+
+void static CommitFile(FILE* fileout)
+{
+    fflush(fileout);
+#ifdef __WXMSW__
+    _commit(_fileno(fileout));
+#else
+    fsync(fileno(fileout));
+#endif
+}
+
+void CWalletJournal::ApplyPending(const vector<CJournalRecord>& vRecord)
+{
+    BOOST_FOREACH(const CJournalRecord& record, vRecord)
+        mapPending[record.strKey] = make_pair(record.fErase, record.fErase ? string() : record.strValue);
+}
+
+bool CWalletJournal::Open(const string& strFileIn)
+{
+    CRITICAL_BLOCK(cs_journal)
+    {
+        Close();
+        strFile = strFileIn;
+        string strPath = GetJournalPath(strFile);
+
+        vector<char> vchJournal;
+        FILE* filein = fopen(strPath.c_str(), "rb");
+        if (filein)
+        {
+            char pchBuf[65536];
+            size_t nRead;
+            while ((nRead = fread(pchBuf, 1, sizeof(pchBuf), filein)) > 0)
+                vchJournal.insert(vchJournal.end(), pchBuf, pchBuf + nRead);
+            fclose(filein);
+        }
+
+        // Each batch is magic, payload size, payload, first 4 bytes of the
+        // payload hash.  Replay up to the first batch that doesn't check
+        // out, which is a write cut short by a crash.
+        unsigned int nPos = 0;
+        int nBatches = 0;
+        while (vchJournal.size() - nPos >= 12)
+        {
+            unsigned int nMagic, nPayload, nChecksum;
+            memcpy(&nMagic, &vchJournal[nPos], 4);
+            memcpy(&nPayload, &vchJournal[nPos + 4], 4);
+            if (nMagic != JOURNAL_MAGIC || nPayload > vchJournal.size() - nPos - 12)
+                break;
+            const char* pbegin = &vchJournal[nPos + 8];
+            uint256 hash = Hash(pbegin, pbegin + nPayload);
+            memcpy(&nChecksum, pbegin + nPayload, 4);
+            if (memcmp(&hash, &nChecksum, 4) != 0)
+                break;
+
+            vector<CJournalRecord> vRecord;
+            try
+            {
+                CDataStream ssBatch(pbegin, pbegin + nPayload, SER_DISK);
+                ssBatch >> vRecord;
+            }
+            catch (std::exception& e)
+            {
+                break;
+            }
+            ApplyPending(vRecord);
+            nPos += 12 + nPayload;
+            nBatches++;
+        }
+
+        if (nPos < vchJournal.size())
+        {
+            // Cut the bad tail off so new batches don't land behind it
+            printf("CWalletJournal::Open() : discarding %d bytes of incomplete journal data\n", vchJournal.size() - nPos);
+            string strTmp = strPath + ".tmp";
+            FILE* fileout = fopen(strTmp.c_str(), "wb");
+            if (!fileout)
+                return error("CWalletJournal::Open() : can't create %s", strTmp.c_str());
+            if (nPos > 0 && fwrite(&vchJournal[0], 1, nPos, fileout) != nPos)
+            {
+                fclose(fileout);
+                return error("CWalletJournal::Open() : write to %s failed", strTmp.c_str());
+            }
+            CommitFile(fileout);
+            fclose(fileout);
+            filesystem::remove(strPath);
+            filesystem::rename(strTmp, strPath);
+        }
+        if (!vchJournal.empty())
+            memset(&vchJournal[0], 0, vchJournal.size());
+
+        file = fopen(strPath.c_str(), "ab");
+        if (!file)
+            return error("CWalletJournal::Open() : can't open %s", strPath.c_str());
+        nSize = nPos;
+        printf("CWalletJournal::Open() : replayed %d batches, %d keys pending\n", nBatches, mapPending.size());
+    }
+    return true;
+}
+
+void CWalletJournal::Close()
+{
+    CRITICAL_BLOCK(cs_journal)
+    {
+        if (file)
+            fclose(file);
+        file = NULL;
+        nSize = 0;
+        mapPending.clear();
+    }
+}
+
+bool CWalletJournal::Append(const vector<CJournalRecord>& vRecord)
+{
+    CRITICAL_BLOCK(cs_journal)
+    {
+        if (!file)
+            return false;
+
+        CDataStream ssPayload(SER_DISK);
+        ssPayload << vRecord;
+        unsigned int nMagic = JOURNAL_MAGIC;
+        unsigned int nPayload = ssPayload.size();
+        uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+
+        CDataStream ssBatch(SER_DISK);
+        ssBatch.reserve(12 + nPayload);
+        ssBatch << nMagic << nPayload;
+        ssBatch.write(&ssPayload[0], nPayload);
+        ssBatch.write((char*)&hash, 4);
+
+        // One write and sync per batch, so a crash leaves at most one torn
+        // batch at the end
+        if (fwrite(&ssBatch[0], 1, ssBatch.size(), file) != ssBatch.size())
+            return error("CWalletJournal::Append() : write failed");
+        CommitFile(file);
+        nSize += ssBatch.size();
+        ApplyPending(vRecord);
+    }
+    return true;
+}
+
+int CWalletJournal::Lookup(const string& strKey, string& strValueRet)
+{
+    CRITICAL_BLOCK(cs_journal)
+    {
+        map<string, pair<bool, string> >::const_iterator mi = mapPending.find(strKey);
+        if (mi == mapPending.end())
+            return 0;
+        if ((*mi).second.first)
+            return -1;
+        strValueRet = (*mi).second.second;
+        return 1;
+    }
+    return 0;
+}
+
+void CWalletJournal::GetPending(map<string, pair<bool, string> >& mapPendingRet)
+{
+    CRITICAL_BLOCK(cs_journal)
+        mapPendingRet = mapPending;
+}
+
+bool CWalletJournal::Compact(Db* pdb)
+{
+    CRITICAL_BLOCK(cs_journal)
+    {
+        if (!file)
+            return false;
+        if (mapPending.empty() && nSize == 0)
+            return true;
+        int64 nStart = GetTimeMillis();
+
+        // Apply the latest value of every key in one synced transaction.
+        // Writers wait on cs_journal, possibly inside a transaction of their
+        // own, so give up rather than wait for a database lock.
+        DbTxn* ptxn = NULL;
+        if (dbenv.txn_begin(NULL, &ptxn, DB_TXN_NOWAIT) != 0 || !ptxn)
+            return error("CWalletJournal::Compact() : txn_begin failed");
+        for (map<string, pair<bool, string> >::iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+        {
+            const string& strKey = (*it).first;
+            Dbt datKey((void*)strKey.data(), strKey.size());
+            int ret;
+            if ((*it).second.first)
+            {
+                ret = pdb->del(ptxn, &datKey, 0);
+                if (ret == DB_NOTFOUND)
+                    ret = 0;
+            }
+            else
+            {
+                const string& strValue = (*it).second.second;
+                Dbt datValue((void*)strValue.data(), strValue.size());
+                ret = pdb->put(ptxn, &datKey, &datValue, 0);
+            }
+            if (ret != 0)
+            {
+                ptxn->abort();
+                return error("CWalletJournal::Compact() : database write failed %d", ret);
+            }
+        }
+        if (ptxn->commit(0) != 0)
+            return error("CWalletJournal::Compact() : txn commit failed");
+
+        // The database file has everything now, so start an empty journal.
+        // Replaying the old one after a crash here is harmless.
+        string strPath = GetJournalPath(strFile);
+        fclose(file);
+        file = fopen(strPath.c_str(), "wb");
+        if (!file)
+            return error("CWalletJournal::Compact() : can't truncate %s", strPath.c_str());
+        CommitFile(file);
+        printf("CWalletJournal::Compact() : applied %d keys from %"PRI64d" bytes in %"PRI64d"ms\n", mapPending.size(), nSize, GetTimeMillis() - nStart);
+        mapPending.clear();
+        nSize = 0;
+    }
+    return true;
+}
+
+bool OpenWalletJournal(const string& strFile, bool fEnable)
+{
+    // A journal left from an earlier run is replayed even with the journal
+    // turned off, so no wallet writes are lost
+    string strPath = GetJournalPath(strFile);
+    if (!fEnable && !filesystem::exists(strPath))
+        return true;
+    pwalletJournal = new CWalletJournal();
+    if (!pwalletJournal->Open(strFile))
+    {
+        delete pwalletJournal;
+        pwalletJournal = NULL;
+        return false;
+    }
+    if (fEnable)
+        return true;
+
+    // Fold it into the wallet and go back to writing the wallet directly
+    bool fCompacted;
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        fCompacted = walletdb.CompactJournal();
+    }
+    if (!fCompacted)
+    {
+        printf("OpenWalletJournal() : compaction failed, keeping %s\n", strPath.c_str());
+        return true;
+    }
+    delete pwalletJournal;
+    pwalletJournal = NULL;
+    filesystem::remove(strPath);
+    return true;
+}
+
+void CompactWalletJournal()
+{
+    if (!pwalletJournal || pwalletJournal->GetSize() == 0)
+        return;
+    CWalletDB walletdb(pwalletJournal->strFile);
+    walletdb.CompactJournal();
+}
+
 void ThreadFlushWalletDB(void* parg)
 {
     const string& strFile = ((const string*)parg)[0];
@@ -857,10 +1372,14 @@ void ThreadFlushWalletDB(void* parg)
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64 nLastWalletUpdate = GetTime();
+    int64 nJournalMaxSize = GetArg("-walletjournalsize", 1000) * 1000;
     while (!fShutdown)
     {
         Sleep(500);
 
+        if (pwalletJournal && pwalletJournal->GetSize() >= nJournalMaxSize)
+            CompactWalletJournal();
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
@@ -908,6 +1427,7 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    CompactWalletJournal();
     while (!fShutdown)
     {
         CRITICAL_BLOCK(cs_db)
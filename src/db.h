@@ -31,6 +31,76 @@ extern DbEnv dbenv;
 extern void DBFlush(bool fShutdown);
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
+bool OpenWalletJournal(const std::string& strFile, bool fEnable);
+void CompactWalletJournal();
+
+
+
+class CJournalRecord
+{
+public:
+    bool fErase;
+    std::string strKey;
+    std::string strValue;
+
+    CJournalRecord()
+    {
+        fErase = false;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(fErase);
+        READWRITE(strKey);
+        READWRITE(strValue);
+    )
+};
+
+//
+// Optional append-only journal in front of wallet.dat.  Writes to the
+// wallet file are appended to <file>.journal in checksummed batches, one
+// per write or database transaction, and kept in memory until compaction
+// applies them to the database file in a single transaction.
+//
+class CWalletJournal
+{
+private:
+    CCriticalSection cs_journal;
+    FILE* file;
+    int64 nSize;
+    // Latest value of each key written since the last compaction
+    std::map<std::string, std::pair<bool, std::string> > mapPending; // key -> (erased, value)
+
+    void ApplyPending(const std::vector<CJournalRecord>& vRecord);
+
+public:
+    std::string strFile;
+
+    CWalletJournal()
+    {
+        file = NULL;
+        nSize = 0;
+    }
+    ~CWalletJournal()
+    {
+        Close();
+    }
+
+    bool Open(const std::string& strFileIn);
+    void Close();
+    bool Append(const std::vector<CJournalRecord>& vRecord);
+    int Lookup(const std::string& strKey, std::string& strValueRet);
+    void GetPending(std::map<std::string, std::pair<bool, std::string> >& mapPendingRet);
+    bool Compact(Db* pdb);
+
+    int64 GetSize()
+    {
+        CRITICAL_BLOCK(cs_journal)
+            return nSize;
+    }
+};
+
+extern CWalletJournal* pwalletJournal;
 
 
 
@@ -42,15 +112,31 @@ protected:
     std::string strFile;
     std::vector<DbTxn*> vTxn;
     bool fReadOnly;
+    bool fJournal;
+    std::vector<CJournalRecord> vJournalBatch;
+    std::vector<unsigned int> vJournalMark;
+
+    // Cursor walk merged with the journal records pending when it started
+    Dbc* pcursorJournal;
+    std::map<std::string, std::pair<bool, std::string> > mapCursorPending;
+    std::map<std::string, std::pair<bool, std::string> >::const_iterator itCursorPending;
+    bool fCursorDbNext;
+    int nCursorDbRet;
+    CDataStream ssCursorDbKey;
+    CDataStream ssCursorDbValue;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
 public:
     void Close();
+    bool CompactJournal();
 private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    int JournalLookup(const CDataStream& ssKey, std::string& strValueRet);
+    bool JournalWrite(const CDataStream& ssKey, const CDataStream* pssValue);
+
 protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
@@ -62,6 +148,21 @@ protected:
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
+
+        // Pending journal entries come first
+        if (fJournal)
+        {
+            std::string strValue;
+            int nFound = JournalLookup(ssKey, strValue);
+            if (nFound != 0)
+            {
+                if (nFound < 0)
+                    return false;
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
+                ssValue >> value;
+                return true;
+            }
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -103,7 +204,11 @@ protected:
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
-        int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        int ret;
+        if (fJournal)
+            ret = (!fOverwrite && Exists(key) ? DB_KEYEXIST : (JournalWrite(ssKey, &ssValue) ? 0 : -1));
+        else
+            ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
 
         // Clear memory in case it was a private key
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -126,7 +231,11 @@ protected:
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
-        int ret = pdb->del(GetTxn(), &datKey, 0);
+        int ret;
+        if (fJournal)
+            ret = (JournalWrite(ssKey, NULL) ? 0 : -1);
+        else
+            ret = pdb->del(GetTxn(), &datKey, 0);
 
         // Clear memory
         memset(datKey.get_data(), 0, datKey.get_size());
@@ -143,6 +252,13 @@ protected:
         CDataStream ssKey(SER_DISK);
         ssKey.reserve(1000);
         ssKey << key;
+        if (fJournal)
+        {
+            std::string strValue;
+            int nFound = JournalLookup(ssKey, strValue);
+            if (nFound != 0)
+                return (nFound > 0);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -161,10 +277,27 @@ protected:
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
+        // Cursors only see the database file, so fold the journal in first,
+        // or if that can't be done right now, have ReadAtCursor merge the
+        // pending records into the walk
+        pcursorJournal = NULL;
+        if (fJournal)
+            StartJournalCursor(pcursor);
         return pcursor;
     }
 
     int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    {
+        if (pcursor == pcursorJournal)
+            return ReadAtJournalCursor(pcursor, ssKey, ssValue, fFlags);
+        return ReadAtDbCursor(pcursor, ssKey, ssValue, fFlags);
+    }
+
+private:
+    void StartJournalCursor(Dbc* pcursor);
+    int ReadAtJournalCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
+    int ReadAtDbCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
     {
         // Read at cursor
         Dbt datKey;
@@ -203,6 +336,7 @@ protected:
         return 0;
     }
 
+protected:
     DbTxn* GetTxn()
     {
         if (!vTxn.empty())
@@ -221,6 +355,7 @@ public:
         if (!ptxn || ret != 0)
             return false;
         vTxn.push_back(ptxn);
+        vJournalMark.push_back(vJournalBatch.size());
         return true;
     }
 
@@ -230,6 +365,19 @@ public:
             return false;
         if (vTxn.empty())
             return false;
+        vJournalMark.pop_back();
+        if (fJournal && vTxn.size() == 1 && !vJournalBatch.empty())
+        {
+            // The whole transaction goes to the journal as one batch
+            bool fOk = pwalletJournal->Append(vJournalBatch);
+            vJournalBatch.clear();
+            if (!fOk)
+            {
+                vTxn.back()->abort();
+                vTxn.pop_back();
+                return false;
+            }
+        }
         int ret = vTxn.back()->commit(0);
         vTxn.pop_back();
         return (ret == 0);
@@ -241,6 +389,8 @@ public:
             return false;
         if (vTxn.empty())
             return false;
+        vJournalBatch.resize(vJournalMark.back());
+        vJournalMark.pop_back();
         int ret = vTxn.back()->abort();
         vTxn.pop_back();
         return (ret == 0);
@@ -446,7 +596,7 @@ public:
 
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
-    bool WriteAccountingEntry(const CAccountingEntry& acentry);
+    bool WriteAccountingEntry(CAccountingEntry& acentry);
     int64 GetAccountCreditDebit(const std::string& strAccount);
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 
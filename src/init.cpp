@@ -46,6 +46,7 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        CompactWalletJournal();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -198,7 +199,18 @@ bool AppInit2(int argc, char* argv[])
             "  -rpcport=<port>  \t\t  " + _("Listen for JSON-RPC connections on <port> (default: 52332)\n") +
             "  -rpcallowip=<ip> \t\t  " + _("Allow JSON-RPC connections from specified IP address\n") +
             "  -rpcconnect=<ip> \t  "   + _("Send commands to node running on <ip> (default: 127.0.0.1)\n") +
+            "  -rpcthreads=<n>  \t  "   + _("Serve JSON-RPC connections with <n> threads (default: 4)\n") +
+            "  -rpclongpolltimeout=<n> \t  " + _("Answer long polling requests after <n> seconds without new work (default: 60)\n") +
+            "  -auxchain=<user>:<pw>@<host>:<port> \t  " + _("Merged mine the aux chain served at <host>:<port> through getwork (can be repeated)\n") +
+            "  -auxmerklesize=<n> \t  " + _("Use an aux chain merkle tree of size <n> (default: smallest that fits the chains)\n") +
+            "  -auxchaintimeout=<n> \t  " + _("Give up on an aux chain that hasn't answered within <n> seconds (default: 10)\n") +
             "  -keypool=<n>     \t  "   + _("Set key pool size to <n> (default: 100)\n") +
+            "  -maxmempool=<n>  \t  "   + _("Keep the transaction memory pool below <n> megabytes (default: 300)\n") +
+            "  -walletjournal   \t  "   + _("Append wallet changes to a journal that is compacted into wallet.dat\n") +
+            "  -walletjournalsize=<n> \t  " + _("Compact the wallet journal once it reaches <n> kilobytes (default: 1000)\n") +
+            "  -sweep           \t  "   + _("Consolidate small wallet outputs in the background with free transactions\n") +
+            "  -sweepmaxvalue=<amt> \t  " + _("Only sweep outputs worth at most <amt> (default: any)\n") +
+            "  -sweeptransactions=<n> \t  " + _("Make at most <n> sweep transactions every ten minutes (default: 1)\n") +
             "  -rescan          \t  "   + _("Rescan the block chain for missing wallet transactions\n");
 
 #ifdef USE_SSL
@@ -385,6 +397,8 @@ bool AppInit2(int argc, char* argv[])
     printf("Loading wallet...\n");
     nStart = GetTimeMillis();
     bool fFirstRun;
+    if (!OpenWalletJournal("wallet.dat", GetBoolArg("-walletjournal")))
+        strErrors += _("Error opening wallet.dat.journal      \n");
     pwalletMain = new CWallet("wallet.dat");
     if (!pwalletMain->LoadWallet(fFirstRun))
         strErrors += _("Error loading wallet.dat      \n");
@@ -427,8 +441,9 @@ bool AppInit2(int argc, char* argv[])
         return false;
     }
 
-    // Add wallet transactions that aren't already in a block to mapTransactions
-    pwalletMain->ReacceptWalletTransactions();
+    // Add wallet transactions that aren't already in a block to the memory pool,
+    // in the background so RPC and the UI don't wait for it
+    CreateThread(ThreadReacceptWalletTransactions, pwalletMain);
 
     //
     // Parameters
@@ -508,6 +523,14 @@ bool AppInit2(int argc, char* argv[])
             wxMessageBox(_("Warning: -paytxfee is set very high.  This is the transaction fee you will pay if you send a transaction."), "Devcoin", wxOK | wxICON_EXCLAMATION);
     }
 
+    // CAuxPow::Check only accepts chain merkle trees whose size is a power of two
+    int64 nAuxMerkleSize = GetArg("-auxmerklesize", 0);
+    if (nAuxMerkleSize < 0 || nAuxMerkleSize > 65536 || (nAuxMerkleSize & (nAuxMerkleSize - 1)) != 0)
+    {
+        wxMessageBox(_("Invalid size for -auxmerklesize=<n>, it must be a power of two up to 65536"), "Devcoin");
+        return false;
+    }
+
     if (fHaveUPnP)
     {
 #if USE_UPNP
@@ -538,6 +561,10 @@ bool AppInit2(int argc, char* argv[])
     if (fServer)
         CreateThread(ThreadRPCServer, NULL);
 
+    if (GetBoolArg("-sweep"))
+        if (!CreateThread(ThreadSweepWallet, pwalletMain))
+            printf("Error: CreateThread(ThreadSweepWallet) failed\n");
+
 #if defined(__WXMSW__) && defined(GUI)
     if (fFirstRun)
         SetStartOnSystemStartup(true);
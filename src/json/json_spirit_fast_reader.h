@@ -0,0 +1,529 @@
+#ifndef JSON_SPIRIT_FAST_READER
+#define JSON_SPIRIT_FAST_READER
+
+// Distributed under the MIT License, see accompanying file LICENSE.txt
+
+// Hand written recursive descent reader producing the same Value trees as
+// json_spirit_reader_template.h, without going through Boost.Spirit.  Values
+// are read in place and swapped into their parent container, so nested
+// objects and arrays are not copied on the way up.  It accepts what the
+// Spirit grammar accepts, including \xHH escapes, Spirit's odd handling of
+// short and overflowing ones, and trailing text after the top level value.
+// Reals go through strtod, so ones with large exponents can differ from
+// Spirit's in the last bit.
+
+#include "json_spirit_value.h"
+
+#include <cstdlib>
+#include <deque>
+#include <limits>
+
+namespace json_spirit
+{
+    template< class Value_type >
+    class Fast_reader
+    {
+    public:
+
+        typedef typename Value_type::String_type String_type;
+        typedef typename Value_type::Object Object_type;
+        typedef typename Value_type::Array Array_type;
+        typedef typename Object_type::value_type Pair_type;
+        typedef typename String_type::value_type Char_type;
+        typedef const Char_type* Iter_type;
+
+        Fast_reader( Iter_type begin, Iter_type end )
+        :   i_( begin )
+        ,   end_( end )
+        ,   depth_( 0 )
+        ,   is_error_( false )
+        {
+        }
+
+        bool read( Value_type& value )
+        {
+            skip_space();
+
+            if( i_ == end_ ) return false;
+
+            value = new_value();
+
+            return !is_error_ && read_value( value );
+        }
+
+    private:
+
+        enum { max_depth = 512 };
+
+        void skip_space()
+        {
+            while( i_ != end_ && ( *i_ == ' ' || *i_ == '\t' || *i_ == '\n' || *i_ == '\r' || *i_ == '\f' || *i_ == '\v' ) ) ++i_;
+        }
+
+        bool read_literal( const char* c_str )
+        {
+            for( ; *c_str != 0; ++c_str, ++i_ )
+            {
+                if( i_ == end_ || *i_ != *c_str ) return false;
+            }
+
+            return true;
+        }
+
+        static int hex_digit( Char_type c )
+        {
+            if( ( c >= '0' ) && ( c <= '9' ) ) return c - '0';
+            if( ( c >= 'a' ) && ( c <= 'f' ) ) return c - 'a' + 10;
+            if( ( c >= 'A' ) && ( c <= 'F' ) ) return c - 'A' + 10;
+            return 0;
+        }
+
+        static bool is_hex_digit( Char_type c )
+        {
+            return ( ( c >= '0' ) && ( c <= '9' ) ) || ( ( c >= 'a' ) && ( c <= 'f' ) ) || ( ( c >= 'A' ) && ( c <= 'F' ) );
+        }
+
+        // Whether the escape starting at i, just past its backslash, gets
+        // through Spirit's lex_escape_ch_p: \x needs a hex digit, and the
+        // digits its uint_parser takes must not overflow a Char_type
+
+        bool is_spirit_escape( Iter_type i ) const
+        {
+            if( *i != 'x' && *i != 'X' ) return true;
+
+            if( ++i == end_ || !is_hex_digit( *i ) ) return false;
+
+            const boost::uint64_t max_char = ( std::numeric_limits< Char_type >::max )();
+            const int max_digits = std::numeric_limits< Char_type >::digits / 4 + 1;
+
+            boost::uint64_t n = 0;
+
+            for( int j = 0; j < max_digits && i != end_ && is_hex_digit( *i ); ++j, ++i )
+            {
+                n = ( n << 4 ) + hex_digit( *i );
+
+                if( n > max_char ) return false;
+            }
+
+            return true;
+        }
+
+        Char_type read_hex( int n_digits )
+        {
+            int n = 0;
+
+            for( int j = 0; j < n_digits; ++j ) n = ( n << 4 ) + hex_digit( *++i_ );
+
+            return static_cast< Char_type >( n );
+        }
+
+        bool read_string( String_type& s )
+        {
+            if( i_ == end_ || *i_ != '"' ) return false;
+
+            Iter_type start = ++i_;
+
+            // Unescaped strings, by far the most common, are copied in one go
+
+            while( i_ != end_ && *i_ != '"' && *i_ != '\\' ) ++i_;
+
+            if( i_ == end_ ) return false;
+
+            s.assign( start, i_ );
+
+            if( *i_ == '"' )
+            {
+                ++i_;
+
+                return true;
+            }
+
+            // The string ends at the first unescaped quote, and as in Spirit's
+            // substitute_esc_chars a \x or \u too short to fit before it is
+            // dropped instead of reading past the quote, and a backslash left
+            // just before it by a \x that took the next one's escape is kept
+
+            Iter_type close = i_;
+
+            while( close != end_ && *close != '"' )
+            {
+                if( *close == '\\' )
+                {
+                    if( ++close == end_ ) break;
+
+                    if( !is_spirit_escape( close ) ) return false;
+                }
+
+                ++close;
+            }
+
+            if( close == end_ ) return false;
+
+            while( i_ != close )
+            {
+                if( *i_ == '\\' && close - i_ >= 2 )
+                {
+                    ++i_;
+
+                    switch( *i_ )
+                    {
+                        case 't':  s += '\t'; break;
+                        case 'b':  s += '\b'; break;
+                        case 'f':  s += '\f'; break;
+                        case 'n':  s += '\n'; break;
+                        case 'r':  s += '\r'; break;
+                        case '\\': s += '\\'; break;
+                        case '/':  s += '/';  break;
+                        case '"':  s += '"';  break;
+                        case 'x':  if( close - i_ >= 3 ) s += read_hex( 2 ); break;
+                        case 'u':  if( close - i_ >= 5 ) s += read_hex( 4 ); break;
+                    }
+                    ++i_;
+                }
+                else
+                {
+                    start = i_++;
+
+                    while( i_ != close && *i_ != '\\' ) ++i_;
+
+                    s.append( start, i_ );
+                }
+            }
+
+            ++i_;
+
+            return true;
+        }
+
+        Value_type read_number()
+        {
+            const Iter_type start = i_;
+
+            bool is_negative = false;
+
+            if( *i_ == '-' || *i_ == '+' ) is_negative = ( *i_++ == '-' );
+
+            const Iter_type digits = i_;
+
+            boost::uint64_t n = 0;
+            bool is_overflow = false;
+
+            for( ; i_ != end_ && *i_ >= '0' && *i_ <= '9'; ++i_ )
+            {
+                const boost::uint64_t d = *i_ - '0';
+
+                if( n > ( ~boost::uint64_t( 0 ) - d ) / 10 ) is_overflow = true;
+
+                n = n * 10 + d;
+            }
+
+            const bool has_int_digits = ( i_ != digits );
+
+            bool is_real = false;
+
+            if( i_ != end_ && *i_ == '.' )
+            {
+                is_real = true;
+
+                for( ++i_; i_ != end_ && *i_ >= '0' && *i_ <= '9'; ++i_ );
+            }
+
+            if( ( has_int_digits || is_real ) && i_ != end_ && ( *i_ == 'e' || *i_ == 'E' ) )
+            {
+                // An exponent without digits isn't part of the number
+
+                const Iter_type exponent = i_;
+
+                ++i_;
+
+                if( i_ != end_ && ( *i_ == '-' || *i_ == '+' ) ) ++i_;
+
+                const Iter_type exponent_digits = i_;
+
+                for( ; i_ != end_ && *i_ >= '0' && *i_ <= '9'; ++i_ );
+
+                if( i_ == exponent_digits ) i_ = exponent;
+                else is_real = true;
+            }
+
+            if( is_real )
+            {
+                // strtod needs a terminated string; numbers are short enough
+                // to copy to the stack
+
+                char buf[64];
+                std::string str;
+                const char* c_str = buf;
+
+                if( i_ - start < static_cast< std::ptrdiff_t >( sizeof( buf ) ) )
+                {
+                    std::copy( start, i_, buf );
+                    buf[i_ - start] = 0;
+                }
+                else
+                {
+                    str.assign( start, i_ );
+                    c_str = str.c_str();
+                }
+
+                char* str_end = 0;
+
+                const double d = strtod( c_str, &str_end );
+
+                if( str_end == c_str ) is_error_ = true;
+
+                return Value_type( d );
+            }
+
+            if( !has_int_digits || is_overflow )
+            {
+                is_error_ = true;
+                return Value_type();
+            }
+
+            const boost::uint64_t max_int64 = ~boost::uint64_t( 0 ) >> 1;
+
+            if( is_negative )
+            {
+                if( n > max_int64 + 1 ) is_error_ = true;
+
+                return Value_type( static_cast< boost::int64_t >( 0 - n ) );
+            }
+
+            if( n > max_int64 ) return Value_type( n );
+
+            return Value_type( static_cast< boost::int64_t >( n ) );
+        }
+
+        // An element of the type of value, empty if it is a container or a
+        // string, so swapping value into it exchanges the contents rather than
+        // copying them
+
+        static Value_type new_value_like( const Value_type& value )
+        {
+            switch( value.type() )
+            {
+                case obj_type:   return Value_type( Object_type() );
+                case array_type: return Value_type( Array_type() );
+                case str_type:   return Value_type( String_type() );
+                default:         return value;
+            }
+        }
+
+        // Makes the element to add to the parent container for the value at
+        // i_.  Numbers and literals are read here and containers are given
+        // their type, which costs far less than assigning to the element once
+        // it is in place.  Strings are swapped in by read_value.
+
+        Value_type new_value()
+        {
+            switch( *i_ )
+            {
+                case '{': return Value_type( Object_type() );
+                case '[': return Value_type( Array_type() );
+                case '"': return Value_type( String_type() );
+                case 't': is_error_ = !read_literal( "true" );  return Value_type( true );
+                case 'f': is_error_ = !read_literal( "false" ); return Value_type( false );
+                case 'n': is_error_ = !read_literal( "null" );  return Value_type();
+            }
+
+            return read_number();
+        }
+
+        // The container being read at this depth collects its elements here
+        // until it knows how many there are.  A deque does not move what it
+        // holds as it grows, so each element is read in place and swapped
+        // into the container once, where growing the container itself would
+        // deep copy everything read so far on each reallocation.  The deques
+        // are kept for the next container read at the same depth.
+
+        template< class T >
+        std::deque< T >& scratch( std::deque< std::deque< T > >& by_depth )
+        {
+            if( by_depth.size() < static_cast< std::size_t >( depth_ ) ) by_depth.resize( depth_ );
+
+            std::deque< T >& elements = by_depth[ depth_ - 1 ];
+
+            elements.clear();
+
+            return elements;
+        }
+
+        bool read_object( Value_type& value )
+        {
+            ++i_;
+
+            skip_space();
+
+            if( i_ != end_ && *i_ == '}' )
+            {
+                ++i_;
+                return true;
+            }
+
+            std::deque< Pair_type >& members = scratch( members_ );
+
+            String_type name;
+
+            while( true )
+            {
+                if( !read_string( name ) ) return false;
+
+                skip_space();
+
+                if( i_ == end_ || *i_ != ':' ) return false;
+
+                ++i_;
+
+                skip_space();
+
+                if( i_ == end_ ) return false;
+
+                members.push_back( Pair_type( String_type(), new_value() ) );
+
+                Pair_type& pair = members.back();
+
+                pair.name_.swap( name );
+
+                if( is_error_ || !read_value( pair.value_ ) ) return false;
+
+                skip_space();
+
+                if( i_ == end_ ) return false;
+
+                if( *i_ == '}' ) break;
+
+                if( *i_ != ',' ) return false;
+
+                ++i_;
+
+                skip_space();
+            }
+
+            ++i_;
+
+            Object_type& obj = value.get_obj();
+
+            obj.reserve( members.size() );
+
+            for( typename std::deque< Pair_type >::iterator it = members.begin(); it != members.end(); ++it )
+            {
+                obj.push_back( Pair_type( String_type(), new_value_like( it->value_ ) ) );
+
+                obj.back().name_.swap( it->name_ );
+                obj.back().value_.swap( it->value_ );
+            }
+
+            members.clear();
+
+            return true;
+        }
+
+        bool read_array( Value_type& value )
+        {
+            ++i_;
+
+            skip_space();
+
+            if( i_ != end_ && *i_ == ']' )
+            {
+                ++i_;
+                return true;
+            }
+
+            std::deque< Value_type >& elements = scratch( elements_ );
+
+            while( true )
+            {
+                if( i_ == end_ ) return false;
+
+                elements.push_back( new_value() );
+
+                if( is_error_ || !read_value( elements.back() ) ) return false;
+
+                skip_space();
+
+                if( i_ == end_ ) return false;
+
+                if( *i_ == ']' ) break;
+
+                if( *i_ != ',' ) return false;
+
+                ++i_;
+
+                skip_space();
+            }
+
+            ++i_;
+
+            Array_type& arr = value.get_array();
+
+            arr.reserve( elements.size() );
+
+            for( typename std::deque< Value_type >::iterator it = elements.begin(); it != elements.end(); ++it )
+            {
+                arr.push_back( new_value_like( *it ) );
+
+                arr.back().swap( *it );
+            }
+
+            elements.clear();
+
+            return true;
+        }
+
+        // Fills in the element made by new_value
+
+        bool read_value( Value_type& value )
+        {
+            switch( value.type() )
+            {
+                case obj_type:
+                case array_type:
+                {
+                    if( ++depth_ > max_depth ) return false;
+
+                    const bool result = ( value.type() == obj_type ? read_object( value ) : read_array( value ) );
+
+                    --depth_;
+
+                    return result;
+                }
+                case str_type:
+                {
+                    String_type s;
+
+                    if( !read_string( s ) ) return false;
+
+                    value = Value_type( s );
+
+                    return true;
+                }
+                default:
+                    return true;
+            }
+        }
+
+        Iter_type i_;
+        Iter_type end_;
+        int depth_;
+        bool is_error_;
+        std::deque< std::deque< Value_type > > elements_;
+        std::deque< std::deque< Pair_type > > members_;
+    };
+
+    // Returns false, leaving value in an unspecified state, if s does not
+    // start with a JSON value
+
+    template< class String_type, class Value_type >
+    bool read_string_fast( const String_type& s, Value_type& value )
+    {
+        const typename String_type::value_type* begin = s.data();
+
+        Fast_reader< Value_type > reader( begin, begin + s.size() );
+
+        return reader.read( value );
+    }
+}
+
+#endif
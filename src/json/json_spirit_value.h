@@ -55,6 +55,8 @@ namespace json_spirit
 
         Value_impl& operator=( const Value_impl& lhs );
 
+        void swap( Value_impl& other );  // copies nothing when both hold the same type
+
         Value_type type() const;
 
         bool is_uint64() const;
@@ -300,13 +302,19 @@ namespace json_spirit
     {
         Value_impl tmp( lhs );
 
-        std::swap( type_, tmp.type_ );
-        std::swap( v_, tmp.v_ );
-        std::swap( is_uint64_, tmp.is_uint64_ );
+        swap( tmp );
 
         return *this;
     }
 
+    template< class Config >
+    void Value_impl< Config >::swap( Value_impl& other )
+    {
+        std::swap( type_, other.type_ );
+        v_.swap( other.v_ );  // std::swap would copy the variant three times
+        std::swap( is_uint64_, other.is_uint64_ );
+    }
+
     template< class Config >
     bool Value_impl< Config >::operator==( const Value_impl& lhs ) const
     {
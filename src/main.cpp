@@ -31,14 +31,15 @@ CCriticalSection cs_main;
 CCriticalSection cs_mapPubKeys;
 map<uint160, vector<unsigned char> > mapPubKeys;
 
-map<uint256, CTransaction> mapTransactions;
-CCriticalSection cs_mapTransactions;
+CTxMemPool mempool;
+const uint64 nTxHashSalt = GetRand(std::numeric_limits<uint64>::max());
 unsigned int nTransactionsUpdated = 0;
-map<COutPoint, CInPoint> mapNextTx;
+unsigned int nReorganizeCount = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock("0x0000000062558fec003bcbf29e915cddfc34fa257dc87573f28e4520d1c7c11e");
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
+uint256 hashProofOfWorkLimit(~uint256(0) >> 32);
 const int nTotalBlocksEstimate = 21044; // Conservative estimate of total nr of blocks on main chain
 const int nInitialBlockThreshold = 21044; // Regard blocks up until N-threshold as "initial download"
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -49,11 +50,19 @@ uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+map<uint256, COrphanBlock> mapOrphanBlocks;
+multimap<uint256, uint256> mapOrphanBlocksByPrev;
+set<pair<int64, uint256> > setOrphanBlocksByTime;
+uint64 nOrphanBlocksBytes = 0;
+uint64 nOrphanBlocksMemory = 0;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+CCriticalSection cs_mapOrphanTransactions;
+map<uint256, COrphanTx> mapOrphanTransactions;
+map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+set<pair<int64, uint256> > setOrphanTransactionsByTime;
+uint64 nOrphanTransactionsBytes = 0;
+uint64 nOrphanTxResolved = 0;
+uint64 nOrphanTxEvicted = 0;
 
 
 double dHashesPerSec;
@@ -135,6 +144,12 @@ void static UpdatedTransaction(const uint256& hashTx)
         pwallet->UpdatedTransaction(hashTx);
 }
 
+void static UpdatedBlocks(const vector<uint256>& vhashBlock)
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->UpdatedBlocks(vhashBlock);
+}
+
 void static PrintWallets(const CBlock& block)
 {
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
@@ -164,38 +179,110 @@ void static ResendWalletTransactions()
 // mapOrphanTransactions
 //
 
-void static AddOrphanTx(const CDataStream& vMsg)
+bool static EraseOrphanTx(uint256 hash)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return;
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.find(hash);
+        if (mi == mapOrphanTransactions.end())
+            return false;
+        const COrphanTx& orphan = (*mi).second;
+        BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+        {
+            map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+            if (itPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            (*itPrev).second.erase(hash);
+            if ((*itPrev).second.empty())
+                mapOrphanTransactionsByPrev.erase(itPrev);
+        }
+        setOrphanTransactionsByTime.erase(make_pair(orphan.nTimeExpire, hash));
+        nOrphanTransactionsBytes -= orphan.nSize;
+        mapOrphanTransactions.erase(mi);
+    }
+    return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+void static LimitOrphanTxSize(unsigned int nAddBytes)
 {
-    if (!mapOrphanTransactions.count(hash))
-        return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
-             mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
+        // Drop expired orphans, then the oldest until the new one fits
+        int64 nNow = GetTime();
+        while (!setOrphanTransactionsByTime.empty())
         {
-            if ((*mi).second == pvMsg)
-                mapOrphanTransactionsByPrev.erase(mi++);
+            pair<int64, uint256> oldest = *setOrphanTransactionsByTime.begin();
+            if (oldest.first > nNow &&
+                mapOrphanTransactions.size() < MAX_ORPHAN_TRANSACTIONS &&
+                nOrphanTransactionsBytes + nAddBytes <= MAX_ORPHAN_TRANSACTIONS_BYTES)
+                break;
+            if (EraseOrphanTx(oldest.second))
+                nOrphanTxEvicted++;
             else
-                mi++;
+                setOrphanTransactionsByTime.erase(setOrphanTransactionsByTime.begin());
         }
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
+}
+
+void static AddOrphanTx(const CTransaction& tx, CNode* pfrom)
+{
+    uint256 hash = tx.GetHash();
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK);
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        if (mapOrphanTransactions.count(hash))
+            return;
+        if (nSize > MAX_ORPHAN_TRANSACTIONS_BYTES / 10)
+        {
+            printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+            return;
+        }
+        LimitOrphanTxSize(nSize);
+
+        COrphanTx& orphan = mapOrphanTransactions[hash];
+        orphan.tx = tx;
+        orphan.nNodeFrom = pfrom->nId;
+        orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+        orphan.nSize = nSize;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        setOrphanTransactionsByTime.insert(make_pair(orphan.nTimeExpire, hash));
+        nOrphanTransactionsBytes += nSize;
+    }
+}
+
+void static GetOrphanTxByPrev(const uint256& hashPrev, vector<CTransaction>& vOrphanRet)
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(hashPrev);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            return;
+        BOOST_FOREACH(const uint256& hash, (*itPrev).second)
+            vOrphanRet.push_back(mapOrphanTransactions[hash].tx);
+    }
+}
+
+void EraseOrphansFor(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        int nErased = 0;
+        map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin();
+        while (mi != mapOrphanTransactions.end())
+        {
+            // EraseOrphanTx invalidates mi, so step past it first
+            map<uint256, COrphanTx>::iterator miErase = mi++;
+            if ((*miErase).second.nNodeFrom == pnode->nId)
+            {
+                EraseOrphanTx((*miErase).first);
+                nErased++;
+            }
+        }
+        nOrphanTxEvicted += nErased;
+        if (nErased > 0)
+            printf("erased %d orphan tx from peer %s\n", nErased, pnode->addr.ToString().c_str());
+    }
 }
 
 
@@ -366,19 +453,19 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
 
     // Do we already have it?
     uint256 hash = GetHash();
-    CRITICAL_BLOCK(cs_mapTransactions)
-        if (mapTransactions.count(hash))
-            return false;
+    if (mempool.Exists(hash))
+        return false;
     if (fCheckInputs)
         if (txdb.ContainsTx(hash))
             return false;
 
     // Check for conflicts with in-memory transactions
     CTransaction* ptxOld = NULL;
+    CRITICAL_BLOCK(mempool.cs)
     for (int i = 0; i < vin.size(); i++)
     {
         COutPoint outpoint = vin[i].prevout;
-        if (mapNextTx.count(outpoint))
+        if (mempool.mapNextTx.count(outpoint))
         {
             // Disable replacement feature for now
             return false;
@@ -386,7 +473,7 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
             // Allow replacing with a newer version of the same transaction
             if (i != 0)
                 return false;
-            ptxOld = mapNextTx[outpoint].ptx;
+            ptxOld = mempool.mapNextTx[outpoint].ptx;
             if (ptxOld->IsFinal())
                 return false;
             if (!IsNewerThan(*ptxOld))
@@ -394,18 +481,18 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
             for (int i = 0; i < vin.size(); i++)
             {
                 COutPoint outpoint = vin[i].prevout;
-                if (!mapNextTx.count(outpoint) || mapNextTx[outpoint].ptx != ptxOld)
+                if (!mempool.mapNextTx.count(outpoint) || mempool.mapNextTx[outpoint].ptx != ptxOld)
                     return false;
             }
             break;
         }
     }
 
+    int64 nFees = 0;
     if (fCheckInputs)
     {
         // Check against previous transactions
         map<uint256, CTxIndex> mapUnused;
-        int64 nFees = 0;
         if (!ConnectInputs(txdb, mapUnused, CDiskTxPos(1,1,1), pindexBest, nFees, false, false))
         {
             if (pfMissingInputs)
@@ -443,15 +530,24 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
         }
     }
 
+    // Transactions added unchecked still need their fee to be ordered by it
+    if (!fCheckInputs)
+        GetUncheckedFee(txdb, nFees);
+
     // Store transaction in memory
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         if (ptxOld)
         {
             printf("AcceptToMemoryPool() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             ptxOld->RemoveFromMemoryPool();
         }
-        AddToMemoryPoolUnchecked();
+        mempool.AddUnchecked(*this, nFees);
+
+        // Stay under -maxmempool, dropping the lowest fee rate transactions
+        mempool.TrimToSize(CTxMemPool::GetMaxUsage());
+        if (!mempool.Exists(hash))
+            return error("AcceptToMemoryPool() : mempool full, %s not accepted", hash.ToString().substr(0,10).c_str());
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -463,41 +559,145 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return true;
 }
 
+bool CTransaction::GetUncheckedFee(CTxDB& txdb, int64& nFeeRet) const
+{
+    // Fee of a transaction whose inputs weren't checked, from the previous
+    // transactions in the memory pool or the tx index.  Leaves nFeeRet
+    // alone if any of them can't be found.
+    if (fClient)
+        return false;
+    int64 nValueIn = 0;
+    BOOST_FOREACH(const CTxIn& txin, vin)
+    {
+        CTransaction txPrev;
+        if (!mempool.Lookup(txin.prevout.hash, txPrev) && !txdb.ReadDiskTx(txin.prevout.hash, txPrev))
+            return false;
+        if (txin.prevout.n >= txPrev.vout.size())
+            return false;
+        nValueIn += txPrev.vout[txin.prevout.n].nValue;
+        if (!MoneyRange(txPrev.vout[txin.prevout.n].nValue) || !MoneyRange(nValueIn))
+            return false;
+    }
+    int64 nValueOut = GetValueOut();
+    if (nValueIn < nValueOut)
+        return false;
+    nFeeRet = nValueIn - nValueOut;
+    return true;
+}
+
 bool CTransaction::AcceptToMemoryPool(bool fCheckInputs, bool* pfMissingInputs)
 {
     CTxDB txdb("r");
     return AcceptToMemoryPool(txdb, fCheckInputs, pfMissingInputs);
 }
 
-bool CTransaction::AddToMemoryPoolUnchecked()
+bool CTransaction::RemoveFromMemoryPool()
+{
+    // Remove transaction from memory pool
+    return mempool.Remove(*this);
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CTxMemPool
+//
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn) : tx(txIn)
+{
+    nFee = nFeeIn;
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
+    nTime = GetTime();
+
+    // Rough heap footprint: the transaction's vectors and scripts, its node
+    // in mapTx and setFeeRate, and one mapNextTx node per input.  Unordered
+    // map nodes carry a next pointer and the cached hash on top of the value.
+    nUsage = sizeof(CTxMemPoolEntry) + sizeof(uint256) + 2 * sizeof(void*);
+    nUsage += sizeof(std::pair<int64, uint256>) + 4 * sizeof(void*);
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity() + sizeof(COutPoint) + sizeof(CInPoint) + 2 * sizeof(void*);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+}
+
+bool CTxMemPool::AddUnchecked(const CTransaction& tx, int64 nFee)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call AcceptToMemoryPool to properly check the transaction first.
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(cs)
     {
-        uint256 hash = GetHash();
-        mapTransactions[hash] = *this;
-        for (int i = 0; i < vin.size(); i++)
-            mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+        uint256 hash = tx.GetHash();
+        if (mapTx.count(hash))
+            return false;
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry = CTxMemPoolEntry(tx, nFee);
+        for (int i = 0; i < entry.tx.vin.size(); i++)
+            mapNextTx[entry.tx.vin[i].prevout] = CInPoint(&entry.tx, i);
+        setFeeRate.insert(make_pair(entry.GetFeeRate(), hash));
+        nTotalTxSize += entry.nTxSize;
+        nDynamicUsage += entry.nUsage;
         nTransactionsUpdated++;
     }
     return true;
 }
 
-
-bool CTransaction::RemoveFromMemoryPool()
+bool CTxMemPool::Remove(const CTransaction& tx, bool fRecursive)
 {
-    // Remove transaction from memory pool
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(cs)
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
+        uint256 hash = tx.GetHash();
+        if (fRecursive)
+        {
+            // Remove in-pool spenders first, they can't be mined without us
+            for (int i = 0; i < tx.vout.size(); i++)
+            {
+                nexttxmap_t::iterator it = mapNextTx.find(COutPoint(hash, i));
+                if (it != mapNextTx.end())
+                    Remove(*(*it).second.ptx, true);
+            }
+        }
+
+        txmap_t::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            return true;
+        const CTxMemPoolEntry& entry = (*mi).second;
+        BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
             mapNextTx.erase(txin.prevout);
-        mapTransactions.erase(GetHash());
+        setFeeRate.erase(make_pair(entry.GetFeeRate(), hash));
+        nTotalTxSize -= entry.nTxSize;
+        nDynamicUsage -= entry.nUsage;
+        mapTx.erase(mi);
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::TrimToSize(uint64 nMaxUsage)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        while (nDynamicUsage > nMaxUsage && !setFeeRate.empty())
+        {
+            uint256 hash = (*setFeeRate.begin()).second;
+            txmap_t::iterator mi = mapTx.find(hash);
+            if (mi == mapTx.end())
+            {
+                setFeeRate.erase(setFeeRate.begin());
+                continue;
+            }
+            unsigned int nSizeBefore = mapTx.size();
+            CTransaction tx = (*mi).second.tx;
+            Remove(tx, true);
+            nEvicted++;
+            nEvictedSpenders += nSizeBefore - mapTx.size() - 1;
+            printf("CTxMemPool::TrimToSize() : evicted %s, usage %"PRI64u" of %"PRI64u"\n", hash.ToString().substr(0,10).c_str(), nDynamicUsage, nMaxUsage);
+        }
+    }
+}
+
 
 
 
@@ -508,6 +708,13 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
     if (hashBlock == 0 || nIndex == -1)
         return 0;
 
+    // A block found in the main chain stays there until a reorganize
+    if (pindexCached && nReorganizeCached == nReorganizeCount && *pindexCached->phashBlock == hashBlock)
+    {
+        nHeightRet = pindexCached->nHeight;
+        return pindexBest->nHeight - pindexCached->nHeight + 1;
+    }
+
     // Find the block it claims to be in
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
@@ -524,6 +731,8 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
         fMerkleVerified = true;
     }
 
+    pindexCached = pindex;
+    nReorganizeCached = nReorganizeCount;
     nHeightRet = pindex->nHeight;
     return pindexBest->nHeight - pindex->nHeight + 1;
 }
@@ -561,7 +770,7 @@ bool CMerkleTx::AcceptToMemoryPool()
 
 bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
 {
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         // Add previous supporting transactions first
         BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
@@ -569,7 +778,7 @@ bool CWalletTx::AcceptWalletTransaction(CTxDB& txdb, bool fCheckInputs)
             if (!tx.IsCoinBase())
             {
                 uint256 hash = tx.GetHash();
-                if (!mapTransactions.count(hash) && !txdb.ContainsTx(hash))
+                if (!mempool.Exists(hash) && !txdb.ContainsTx(hash))
                     tx.AcceptToMemoryPool(txdb, fCheckInputs);
             }
         }
@@ -628,6 +837,73 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
+// Auxpows read back for GetBlockHeader.  A getheaders answer can be 2000
+// merged mined headers, each otherwise a block file open and read under
+// cs_main, and peers syncing mostly ask for the same recent ranges.
+static const unsigned int AUXPOW_CACHE_SIZE = 4000;
+static CCriticalSection cs_mapAuxPowCache;
+static map<uint256, boost::shared_ptr<CAuxPow> > mapAuxPowCache;
+static deque<uint256> queueAuxPowCache;
+
+CBlock CBlockIndex::GetBlockHeader() const
+{
+    CBlock block;
+    block.nVersion       = nVersion;
+    if (pprev)
+        block.hashPrevBlock = pprev->GetBlockHash();
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.nTime          = nTime;
+    block.nBits          = nBits;
+    block.nNonce         = nNonce;
+
+    // The auxpow isn't kept in memory, read it from the block file.  The
+    // block was checked when it was accepted, so only the header is read.
+    if (nVersion & BLOCK_VERSION_AUXPOW)
+    {
+        uint256 hash = GetBlockHash();
+        CRITICAL_BLOCK(cs_mapAuxPowCache)
+        {
+            map<uint256, boost::shared_ptr<CAuxPow> >::iterator mi = mapAuxPowCache.find(hash);
+            if (mi != mapAuxPowCache.end())
+                block.auxpow = (*mi).second;
+        }
+        if (block.auxpow)
+            return block;
+
+        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
+        if (filein)
+        {
+            CBlock blockDisk;
+            filein.nType |= SER_BLOCKHEADERONLY;
+            try {
+                filein >> blockDisk;
+                if (blockDisk.GetHash() == hash)
+                    block.auxpow = blockDisk.auxpow;
+            }
+            catch (std::exception& e) {
+            }
+        }
+        if (!block.auxpow)
+        {
+            printf("ERROR: CBlockIndex::GetBlockHeader() : auxpow of %s not found on disk\n", hash.ToString().substr(0,20).c_str());
+            return block;
+        }
+
+        // Oldest out first
+        CRITICAL_BLOCK(cs_mapAuxPowCache)
+        {
+            if (mapAuxPowCache.insert(make_pair(hash, block.auxpow)).second)
+                queueAuxPowCache.push_back(hash);
+            while (queueAuxPowCache.size() > AUXPOW_CACHE_SIZE)
+            {
+                mapAuxPowCache.erase(queueAuxPowCache.front());
+                queueAuxPowCache.pop_front();
+            }
+        }
+    }
+    return block;
+}
+
 void CBlock::SetAuxPow(CAuxPow* pow)
 {
     if (pow != NULL)
@@ -637,12 +913,150 @@ void CBlock::SetAuxPow(CAuxPow* pow)
     auxpow.reset(pow);
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+//////////////////////////////////////////////////////////////////////////////
+//
+// mapOrphanBlocks
+//
+
+string static GetOrphanBlockFile(const uint256& hash)
+{
+    return strprintf("%s/orphans/%s.dat", GetDataDir().c_str(), hash.GetHex().c_str());
+}
+
+uint256 static GetOrphanRoot(const uint256& hash)
+{
+    // Each orphan remembers the root it had when it arrived.  That goes stale
+    // when an older orphan arrives after its descendants, so follow roots
+    // until reaching one whose parent isn't an orphan, then compress the path.
+    uint256 hashRoot = hash;
+    loop
+    {
+        map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hashRoot);
+        if (mi == mapOrphanBlocks.end())
+            break;
+        COrphanBlock& orphan = (*mi).second;
+        if (orphan.hashRoot != hashRoot && mapOrphanBlocks.count(orphan.hashRoot))
+            hashRoot = orphan.hashRoot;
+        else if (mapOrphanBlocks.count(orphan.hashPrev))
+            hashRoot = orphan.hashPrev;
+        else
+            break;
+    }
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hash);
+    if (mi != mapOrphanBlocks.end())
+        (*mi).second.hashRoot = hashRoot;
+    return hashRoot;
+}
+
+bool static ReadOrphanBlock(const COrphanBlock& orphan, CBlock& blockRet)
+{
+    if (orphan.pblock)
+    {
+        blockRet = *orphan.pblock;
+        return true;
+    }
+    try
+    {
+        CAutoFile filein = fopen(GetOrphanBlockFile(orphan.hashBlock).c_str(), "rb");
+        if (!filein)
+            return error("ReadOrphanBlock() : open failed");
+        filein >> blockRet;
+    }
+    catch (std::exception &e)
+    {
+        return error("ReadOrphanBlock() : deserialize or I/O error");
+    }
+    if (blockRet.GetHash() != orphan.hashBlock)
+        return error("ReadOrphanBlock() : hash doesn't match");
+    return true;
+}
+
+void static EraseOrphanBlock(const uint256& hash)
+{
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(hash);
+    if (mi == mapOrphanBlocks.end())
+        return;
+    COrphanBlock& orphan = (*mi).second;
+    for (multimap<uint256, uint256>::iterator it = mapOrphanBlocksByPrev.lower_bound(orphan.hashPrev);
+         it != mapOrphanBlocksByPrev.upper_bound(orphan.hashPrev);)
+    {
+        if ((*it).second == hash)
+            mapOrphanBlocksByPrev.erase(it++);
+        else
+            it++;
+    }
+    setOrphanBlocksByTime.erase(make_pair(orphan.nTimeReceived, hash));
+    nOrphanBlocksBytes -= orphan.nSize;
+    if (orphan.pblock)
+    {
+        nOrphanBlocksMemory -= orphan.nSize;
+        delete orphan.pblock;
+    }
+    else
+        unlink(GetOrphanBlockFile(hash).c_str());
+    mapOrphanBlocks.erase(mi);
+}
+
+void static LimitOrphanBlocks(unsigned int nAddBytes)
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    // Drop the oldest orphans until the new one fits
+    while (!setOrphanBlocksByTime.empty() &&
+           (mapOrphanBlocks.size() >= MAX_ORPHAN_BLOCKS ||
+            nOrphanBlocksBytes + nAddBytes > MAX_ORPHAN_BLOCKS_BYTES))
+    {
+        uint256 hash = (*setOrphanBlocksByTime.begin()).second;
+        printf("LimitOrphanBlocks() : evicting orphan block %s\n", hash.ToString().substr(0,20).c_str());
+        if (mapOrphanBlocks.count(hash))
+            EraseOrphanBlock(hash);
+        else
+            setOrphanBlocksByTime.erase(setOrphanBlocksByTime.begin());
+    }
+}
+
+void static AddOrphanBlock(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    unsigned int nSize = ::GetSerializeSize(block, SER_DISK);
+    LimitOrphanBlocks(nSize);
+
+    COrphanBlock& orphan = mapOrphanBlocks[hash];
+    orphan.hashBlock = hash;
+    orphan.hashPrev = block.hashPrevBlock;
+    orphan.nSize = nSize;
+    orphan.nTimeReceived = GetTimeMillis();
+
+    // Root of the chain this orphan extends, or the orphan itself
+    map<uint256, COrphanBlock>::iterator mi = mapOrphanBlocks.find(block.hashPrevBlock);
+    orphan.hashRoot = (mi != mapOrphanBlocks.end() ? (*mi).second.hashRoot : hash);
+
+    // Large orphans, or any once the in-memory budget is used up, go to disk
+    bool fSpilled = false;
+    if (nSize >= ORPHAN_BLOCK_SPILL_SIZE || nOrphanBlocksMemory + nSize > MAX_ORPHAN_BLOCKS_MEMORY)
+    {
+        try
+        {
+            filesystem::create_directories(strprintf("%s/orphans", GetDataDir().c_str()));
+            CAutoFile fileout = fopen(GetOrphanBlockFile(hash).c_str(), "wb");
+            if (fileout)
+            {
+                fileout << block;
+                fSpilled = true;
+            }
+        }
+        catch (std::exception &e)
+        {
+            error("AddOrphanBlock() : %s", e.what());
+        }
+    }
+    if (!fSpilled)
+    {
+        orphan.pblock = new CBlock(block);
+        nOrphanBlocksMemory += nSize;
+    }
+    nOrphanBlocksBytes += nSize;
+
+    mapOrphanBlocksByPrev.insert(make_pair(orphan.hashPrev, hash));
+    setOrphanBlocksByTime.insert(make_pair(orphan.nTimeReceived, hash));
 }
 
 int64 static GetBlockValue(int nHeight, int64 nFees)
@@ -744,15 +1158,19 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast)
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    // Runs for every header, so the target is expanded on uint256 rather
+    // than CBigNum, which allocates
+    bool fNegative;
+    bool fOverflow;
+    uint256 hashTarget;
+    hashTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || hashTarget == 0 || hashTarget > hashProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > hashTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -868,12 +1286,8 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
             if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
             {
                 // Get prev tx from single transactions in memory
-                CRITICAL_BLOCK(cs_mapTransactions)
-                {
-                    if (!mapTransactions.count(prevout.hash))
-                        return error("ConnectInputs() : %s mapTransactions prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                    txPrev = mapTransactions[prevout.hash];
-                }
+                if (!mempool.Lookup(prevout.hash, txPrev))
+                    return error("ConnectInputs() : %s mempool prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
                 if (!fFound)
                     txindex.vSpent.resize(txPrev.vout.size());
             }
@@ -957,16 +1371,17 @@ bool CTransaction::ClientConnectInputs()
         return false;
 
     // Take over previous transactions' spent pointers
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         int64 nValueIn = 0;
         for (int i = 0; i < vin.size(); i++)
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mapTransactions.count(prevout.hash))
+            CTxMemPool::txmap_t::iterator mi = mempool.mapTx.find(prevout.hash);
+            if (mi == mempool.mapTx.end())
                 return false;
-            CTransaction& txPrev = mapTransactions[prevout.hash];
+            CTransaction& txPrev = (*mi).second.tx;
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1175,6 +1590,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+    if (!vDisconnect.empty())
+        nReorganizeCount++;
 
     // Connect longer branch
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
@@ -1193,9 +1610,102 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 }
 
 
+double GetDifficulty(const CBlockIndex* pindex)
+{
+    // Floating point number that is a multiple of the minimum difficulty,
+    // minimum difficulty = 1.0.
+
+    if (pindex == NULL)
+        return 1.0;
+    int nShift = (pindex->nBits >> 24) & 0xff;
+
+    double dDiff =
+        (double)0x0000ffff / (double)(pindex->nBits & 0x00ffffff);
+
+    while (nShift < 29)
+    {
+        dDiff *= 256.0;
+        nShift++;
+    }
+    while (nShift > 29)
+    {
+        dDiff /= 256.0;
+        nShift--;
+    }
+
+    return dDiff;
+}
+
+static CCriticalSection cs_pchainSnapshot;
+static CChainSnapshotRef pchainSnapshot(new CChainSnapshot());
+static boost::mutex mutexNewBestChain;
+static boost::condition_variable condNewBestChain;
+
+CChainSnapshotRef GetChainSnapshot()
+{
+    // The lock only covers copying the pointer, never any chain work
+    CChainSnapshotRef psnapshot;
+    CRITICAL_BLOCK(cs_pchainSnapshot)
+        psnapshot = pchainSnapshot;
+    return psnapshot;
+}
+
+// requires cs_main
+void PublishChainSnapshot(const CBlockIndex* pindex)
+{
+    CChainSnapshot* psnapshot = new CChainSnapshot();
+    psnapshot->hashBestChain = pindex->GetBlockHash();
+    psnapshot->nHeight = pindex->nHeight;
+    psnapshot->nBits = pindex->nBits;
+    psnapshot->dDifficulty = GetDifficulty(pindex);
+    psnapshot->bnChainWork = pindex->bnChainWork;
+    psnapshot->nTime = pindex->GetBlockTime();
+    psnapshot->nMedianTimePast = pindex->GetMedianTimePast();
+
+    CRITICAL_BLOCK(cs_pchainSnapshot)
+    {
+        psnapshot->nConnections = pchainSnapshot->nConnections;
+        pchainSnapshot.reset(psnapshot);
+    }
+
+    // Taking the mutex means a waiter is either past its check of the old
+    // snapshot and waiting, or hasn't looked yet and will see the new one
+    {
+        boost::lock_guard<boost::mutex> lock(mutexNewBestChain);
+    }
+    condNewBestChain.notify_all();
+}
+
+void PublishConnectionCount(int nConnections)
+{
+    CRITICAL_BLOCK(cs_pchainSnapshot)
+    {
+        CChainSnapshot* psnapshot = new CChainSnapshot(*pchainSnapshot);
+        psnapshot->nConnections = nConnections;
+        pchainSnapshot.reset(psnapshot);
+    }
+}
+
+// Waits until the best chain is no longer hashBestChainPrev, for at most
+// nMilliseconds, and returns the snapshot current at that point
+CChainSnapshotRef WaitForChainSnapshot(const uint256& hashBestChainPrev, int64 nMilliseconds)
+{
+    boost::system_time timeEnd = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+    boost::unique_lock<boost::mutex> lock(mutexNewBestChain);
+    loop
+    {
+        CChainSnapshotRef psnapshot = GetChainSnapshot();
+        if (psnapshot->hashBestChain != hashBestChainPrev || fShutdown)
+            return psnapshot;
+        if (!condNewBestChain.timed_wait(lock, timeEnd))
+            return GetChainSnapshot();
+    }
+}
+
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
+    CBlockIndex* pindexOldBest = pindexBest;
 
     txdb.TxnBegin();
     if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
@@ -1249,6 +1759,18 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     bnBestChainWork = pindexNew->bnChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+
+    // Wallets index transactions by the height they confirmed at, tell them
+    // which blocks just joined or left the main chain
+    vector<uint256> vhashChanged;
+    CBlockIndex* pfork = pindexOldBest;
+    for (; pfork && !pfork->IsInMainChain(); pfork = pfork->pprev)
+        vhashChanged.push_back(pfork->GetBlockHash());
+    for (CBlockIndex* pindex = pindexNew; pindex && pindex != pfork; pindex = pindex->pprev)
+        vhashChanged.push_back(pindex->GetBlockHash());
+    UpdatedBlocks(vhashChanged);
+    PublishChainSnapshot(pindexNew);
+
     printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
 
     return true;
@@ -1266,6 +1788,8 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
+    if (auxpow.get() != NULL)
+        pindexNew->hashParentBlock = auxpow->GetParentBlockHash();
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
@@ -1318,6 +1842,22 @@ int GetOurChainID()
     return 0x0004;
 }
  
+void static PrintAuxPowCheckTime(int64 nMicros)
+{
+    // Running average over the auxpows checked since startup, so a sync or
+    // a run of submitted blocks gives the cost per merged mined block
+    static CCriticalSection cs_auxpowtime;
+    static int nChecks;
+    static int64 nTotalMicros;
+    CRITICAL_BLOCK(cs_auxpowtime)
+    {
+        nChecks++;
+        nTotalMicros += nMicros;
+        if (nChecks % 1000 == 0)
+            printf("CAuxPow::Check() : %d auxpows checked, %.1fus each\n", nChecks, (double)nTotalMicros / nChecks);
+    }
+}
+
 bool CBlock::CheckProofOfWork(int nHeight) const
 {
     if (nHeight >= GetAuxPowStartBlock())
@@ -1331,8 +1871,11 @@ bool CBlock::CheckProofOfWork(int nHeight) const
 
         if (auxpow.get() != NULL)
         {
+            int64 nStart = GetTimeMicros();
             if (!auxpow->Check(GetHash(), GetChainID()))
                 return error("CheckProofOfWork() : AUX POW is not valid");
+            if (fDebug && GetBoolArg("-printauxpow"))
+                PrintAuxPowCheckTime(GetTimeMicros() - nStart);
             // Check proof of work matches claimed amount
             if (!::CheckProofOfWork(auxpow->GetParentBlockHash(), nBits))
                 return error("CheckProofOfWork() : AUX proof of work failed");
@@ -1484,13 +2027,11 @@ bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        AddOrphanBlock(*pblock);
 
         // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+        if (pfrom && mapOrphanBlocks.count(hash))
+            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(hash));
         return true;
     }
 
@@ -1504,17 +2045,18 @@ bool static ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+        vector<uint256> vOrphan;
+        for (multimap<uint256, uint256>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vOrphan.push_back((*mi).second);
+        BOOST_FOREACH(const uint256& hashOrphan, vOrphan)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            delete pblockOrphan;
+            CBlock blockOrphan;
+            if (ReadOrphanBlock(mapOrphanBlocks[hashOrphan], blockOrphan) && blockOrphan.AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
+            EraseOrphanBlock(hashOrphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -1634,12 +2176,23 @@ bool LoadBlockIndex(bool fAllowNew)
     {
         hashGenesisBlock = uint256("0x0000000087a230b3a9d612d73dba267cb70135b76a923cae2c74852c2e5d7639");
         bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
+        hashProofOfWorkLimit = ~uint256(0) >> 28;
         pchMessageStart[0] = 'd';
         pchMessageStart[1] = 'e';
         pchMessageStart[2] = 'v';
         pchMessageStart[3] = '-';
     }
 
+    // Orphan blocks spilled by a previous run, nothing refers to them now
+    try
+    {
+        filesystem::remove_all(strprintf("%s/orphans", GetDataDir().c_str()));
+    }
+    catch (std::exception &e)
+    {
+        error("LoadBlockIndex() : clearing orphans : %s", e.what());
+    }
+
     //
     // Load block index
     //
@@ -1938,7 +2491,13 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 {
     switch (inv.type)
     {
-    case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
+    case MSG_TX:
+        {
+            bool fHaveOrphan = false;
+            CRITICAL_BLOCK(cs_mapOrphanTransactions)
+                fHaveOrphan = mapOrphanTransactions.count(inv.hash);
+            return mempool.Exists(inv.hash) || fHaveOrphan || txdb.ContainsTx(inv.hash);
+        }
     case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
@@ -2148,7 +2707,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(inv.hash));
 
             // Track requests for our stuff
             Inventory(inv.hash);
@@ -2197,9 +2756,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // Send stream from relay memory
                 CRITICAL_BLOCK(cs_mapRelay)
                 {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                    {
+                        const CSharedMessage& pmsg = (*mi).second;
+                        if (pfrom->vSend.GetVersion() >= 209)
+                        {
+                            // Queue the shared framed message by reference
+                            pfrom->PushSharedMessage(pmsg);
+                            nRelayBytesShared += pmsg->size() - sizeof(CMessageHeader);
+                        }
+                        else
+                        {
+                            // Pre-checksum peers need their own framing
+                            CDataStream ssPayload(pmsg->begin() + sizeof(CMessageHeader), pmsg->end(), SER_NETWORK);
+                            pfrom->PushMessage(inv.GetCommand(), ssPayload);
+                            nRelayBytesCopied += 2 * ssPayload.size();
+                        }
+                    }
                 }
             }
 
@@ -2300,34 +2874,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             // Recursively process any orphan transactions that depended on this one
             for (int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
-                     mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
-                     ++mi)
+                vector<CTransaction> vOrphan;
+                GetOrphanTxByPrev(vWorkQueue[i], vOrphan);
+                BOOST_FOREACH(CTransaction& tx, vOrphan)
                 {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
                     CInv inv(MSG_TX, tx.GetHash());
 
                     if (tx.AcceptToMemoryPool(true))
                     {
                         printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                         SyncWithWallets(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
+                        RelayMessage(inv, tx);
                         mapAlreadyAskedFor.erase(inv);
                         vWorkQueue.push_back(inv.hash);
                     }
                 }
             }
 
-            BOOST_FOREACH(uint256 hash, vWorkQueue)
-                EraseOrphanTx(hash);
+            CRITICAL_BLOCK(cs_mapOrphanTransactions)
+                BOOST_FOREACH(uint256 hash, vWorkQueue)
+                    if (EraseOrphanTx(hash))
+                        nOrphanTxResolved++;
         }
         else if (fMissingInputs)
         {
             printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+            AddOrphanTx(tx, pfrom);
         }
     }
 
@@ -2583,12 +3155,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             return true;
 
         // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->GetSendSize() == 0)
             pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
 
+        // Expire orphan transactions even while no new ones arrive
+        static int64 nLastOrphanExpire;
+        if (GetTime() - nLastOrphanExpire > 60)
+        {
+            nLastOrphanExpire = GetTime();
+            LimitOrphanTxSize(0);
+        }
+
         // Address refresh broadcast
         static int64 nLastRebroadcast;
         if (GetTime() - nLastRebroadcast > 24 * 60 * 60)
@@ -2912,20 +3492,23 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         minerValue -= sharePerAddress;
     }
 
+    // Add our coinbase tx as first transaction
+    pblock->vtx.push_back(txNew);
 
     // Collect memory pool transactions into the block
     CRITICAL_BLOCK(cs_main)
-    CRITICAL_BLOCK(cs_mapTransactions)
+    CRITICAL_BLOCK(mempool.cs)
     {
         CTxDB txdb("r");
+        int64 nStart = GetTimeMillis();
 
         // Priority order to process transactions
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
         multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        for (CTxMemPool::txmap_t::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
         {
-            CTransaction& tx = (*mi).second;
+            CTransaction& tx = (*mi).second.tx;
             if (tx.IsCoinBase() || !tx.IsFinal())
                 continue;
 
@@ -2966,7 +3549,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             if (porphan)
                 porphan->dPriority = dPriority;
             else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
+                mapPriority.insert(make_pair(-dPriority, &(*mi).second.tx));
 
             if (fDebug && GetBoolArg("-printpriority"))
             {
@@ -3002,10 +3585,14 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
+            CTestPoolUndo undo(mapTestPool, tx);
+            int64 nFeesPrev = nFees;
+            if (!tx.ConnectInputs(txdb, mapTestPool, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
+            {
+                undo.Rollback();
+                nFees = nFeesPrev;
                 continue;
-            swap(mapTestPool, mapTestPoolTmp);
+            }
 
             // Added
             pblock->vtx.push_back(tx);
@@ -3027,6 +3614,9 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
                 }
             }
         }
+
+        if (fDebug && GetBoolArg("-printpriority"))
+            printf("CreateNewBlock() : selected %d of %d transactions in %"PRI64d"ms\n", pblock->vtx.size(), mempool.mapTx.size(), GetTimeMillis() - nStart);
     }
     pblock->vtx[0].vout[0].nValue = minerValue + nFees;
 
@@ -3104,7 +3694,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     CAuxPow *auxpow = pblock->auxpow.get();
 
@@ -3232,7 +3822,7 @@ void static BitcoinMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         uint256 hashbuf[2];
         uint256& hash = *alignup<16>(hashbuf);
         loop
@@ -3372,7 +3962,7 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 bool CBlockIndex::CheckIndex() const
 {
     if (nVersion & BLOCK_VERSION_AUXPOW)
-        return CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
+        return CheckProofOfWork(hashParentBlock, nBits);
     else
         return CheckProofOfWork(GetBlockHash(), nBits);
 }
@@ -3383,7 +3973,7 @@ std::string CBlockIndex::ToString() const
             pprev, pnext, nFile, nBlockPos, nHeight,
             hashMerkleRoot.ToString().substr(0,10).c_str(),
             GetBlockHash().ToString().substr(0,20).c_str(),
-            (auxpow.get() != NULL) ? auxpow->GetParentBlockHash().ToString().substr(0,20).c_str() : "-"
+            (nVersion & BLOCK_VERSION_AUXPOW) ? hashParentBlock.ToString().substr(0,20).c_str() : "-"
             );
 }
 
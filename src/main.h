@@ -12,6 +12,7 @@
 
 #include <list>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 class CBlock;
 class CBlockIndex;
@@ -39,6 +40,13 @@ static const int64 MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64 MAX_MONEY = (int64)21000000 * (int64)1000 * COIN;
 inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 static const int COINBASE_MATURITY = 100;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS = 1000;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS_BYTES = 5000000;
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+static const unsigned int MAX_ORPHAN_BLOCKS = 750;
+static const uint64 MAX_ORPHAN_BLOCKS_BYTES = 200000000;
+static const uint64 MAX_ORPHAN_BLOCKS_MEMORY = 20000000;
+static const unsigned int ORPHAN_BLOCK_SPILL_SIZE = 100000;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -54,6 +62,7 @@ extern CCriticalSection cs_main;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBigNum bnProofOfWorkLimit;
+extern uint256 hashProofOfWorkLimit;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern CBigNum bnBestChainWork;
@@ -61,6 +70,7 @@ extern CBigNum bnBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+extern unsigned int nReorganizeCount;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
@@ -104,6 +114,7 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 int GetTotalBlocksEstimate();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
+void EraseOrphansFor(CNode* pnode);
 
 
 
@@ -633,12 +644,10 @@ public:
     bool ConnectInputs(CTxDB& txdb, std::map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
                        CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
     bool ClientConnectInputs();
+    bool GetUncheckedFee(CTxDB& txdb, int64& nFeeRet) const;
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
     bool AcceptToMemoryPool(bool fCheckInputs=true, bool* pfMissingInputs=NULL);
-protected:
-    bool AddToMemoryPoolUnchecked();
-public:
     bool RemoveFromMemoryPool();
 };
 
@@ -658,6 +667,8 @@ public:
 
     // memory only
     mutable char fMerkleVerified;
+    mutable CBlockIndex* pindexCached;           // main chain block it was last found in
+    mutable unsigned int nReorganizeCached;
 
 
     CMerkleTx()
@@ -675,6 +686,8 @@ public:
         hashBlock = 0;
         nIndex = -1;
         fMerkleVerified = false;
+        pindexCached = NULL;
+        nReorganizeCached = 0;
     }
 
 
@@ -754,6 +767,47 @@ public:
     int GetDepthInMainChain() const;
 };
 
+//
+// Undo log for the miner's test pool.  Only the entries for a candidate's
+// prevouts and its own hash can be touched by ConnectInputs, so saving those
+// lets a rejected candidate be rolled back without copying the whole pool.
+//
+class CTestPoolUndo
+{
+protected:
+    std::map<uint256, CTxIndex>& mapTestPool;
+    std::vector<std::pair<uint256, CTxIndex> > vSaved;
+    std::vector<uint256> vAdded;
+    std::set<uint256> setSeen;
+
+    void Save(const uint256& hash)
+    {
+        if (!setSeen.insert(hash).second)
+            return;
+        std::map<uint256, CTxIndex>::iterator mi = mapTestPool.find(hash);
+        if (mi == mapTestPool.end())
+            vAdded.push_back(hash);
+        else
+            vSaved.push_back(*mi);
+    }
+
+public:
+    CTestPoolUndo(std::map<uint256, CTxIndex>& mapTestPoolIn, const CTransaction& tx) : mapTestPool(mapTestPoolIn)
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            Save(txin.prevout.hash);
+        Save(tx.GetHash());
+    }
+
+    void Rollback()
+    {
+        BOOST_FOREACH(const uint256& hash, vAdded)
+            mapTestPool.erase(hash);
+        for (std::vector<std::pair<uint256, CTxIndex> >::iterator it = vSaved.begin(); it != vSaved.end(); ++it)
+            mapTestPool[(*it).first] = (*it).second;
+    }
+};
+
 template <typename Stream>
 int ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionSerialize ser_action);
 
@@ -775,6 +829,10 @@ enum
     BLOCK_VERSION_CHAIN_START    = (1 << 16),
     BLOCK_VERSION_CHAIN_END      = (1 << 30),
 };
+
+// Block index records from this version on keep only the parent block hash
+// of a merged mined block, its auxpow is read from the block file
+static const int COMPACT_AUXPOW_INDEX_VERSION = 32301;
  
 
 //
@@ -905,14 +963,26 @@ public:
     {
         if (nIndex == -1)
             return 0;
+        // Each level hashes the pair laid out in one buffer, the double
+        // SHA-256 of the pair landing back in this node's half of it.  The
+        // context is used directly, OpenSSL 3's one-shot SHA256() looks the
+        // digest up again on every call.
+        unsigned char pchPair[64];
+        unsigned char pchHash1[32];
+        SHA256_CTX ctx;
+        memcpy(pchPair + ((nIndex & 1) ? 32 : 0), hash.begin(), 32);
         BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
         {
-            if (nIndex & 1)
-                hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
-            else
-                hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+            memcpy(pchPair + ((nIndex & 1) ? 0 : 32), &otherside, 32);
+            SHA256_Init(&ctx);
+            SHA256_Update(&ctx, pchPair, sizeof(pchPair));
+            SHA256_Final(pchHash1, &ctx);
             nIndex >>= 1;
+            SHA256_Init(&ctx);
+            SHA256_Update(&ctx, pchHash1, sizeof(pchHash1));
+            SHA256_Final(pchPair + ((nIndex & 1) ? 32 : 0), &ctx);
         }
+        memcpy(hash.begin(), pchPair + ((nIndex & 1) ? 32 : 0), 32);
         return hash;
     }
 
@@ -1034,8 +1104,8 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
-    // if this is an aux work block
-    boost::shared_ptr<CAuxPow> auxpow;
+    // if this is an aux work block, the hash of its parent block
+    uint256 hashParentBlock;
  
     CBlockIndex()
     {
@@ -1052,7 +1122,7 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
-        auxpow.reset();
+        hashParentBlock = 0;
     }
 
     CBlockIndex(unsigned int nFileIn, unsigned int nBlockPosIn, CBlock& block)
@@ -1070,22 +1140,10 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
-        auxpow         = block.auxpow;
+        hashParentBlock = 0;
     }
 
-    CBlock GetBlockHeader() const
-    {
-        CBlock block;
-        block.nVersion       = nVersion;
-        if (pprev)
-            block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        block.auxpow         = auxpow;
-        return block;
-    }
+    CBlock GetBlockHeader() const;
 
     uint256 GetBlockHash() const
     {
@@ -1168,6 +1226,46 @@ public:
 
 
 
+//
+// Immutable copy of the best chain's vital statistics.  A new one is
+// published on every tip change, so readers can take a reference to the
+// current one without holding cs_main.
+//
+class CChainSnapshot
+{
+public:
+    uint256 hashBestChain;
+    int nHeight;
+    unsigned int nBits;
+    double dDifficulty;
+    CBigNum bnChainWork;
+    int64 nTime;
+    int64 nMedianTimePast;
+    int nConnections;
+
+    CChainSnapshot()
+    {
+        hashBestChain = 0;
+        nHeight = -1;
+        nBits = 0;
+        dDifficulty = 1.0;
+        bnChainWork = 0;
+        nTime = 0;
+        nMedianTimePast = 0;
+        nConnections = 0;
+    }
+};
+
+typedef boost::shared_ptr<const CChainSnapshot> CChainSnapshotRef;
+
+double GetDifficulty(const CBlockIndex* pindex);
+CChainSnapshotRef GetChainSnapshot();
+void PublishChainSnapshot(const CBlockIndex* pindex);
+void PublishConnectionCount(int nConnections);
+CChainSnapshotRef WaitForChainSnapshot(const uint256& hashBestChainPrev, int64 nMilliseconds);
+
+
+
 //
 // Used to marshal pointers into hashes for db storage.
 //
@@ -1177,6 +1275,9 @@ public:
     uint256 hashPrev;
     uint256 hashNext;
 
+    // Only read from records older than COMPACT_AUXPOW_INDEX_VERSION
+    boost::shared_ptr<CAuxPow> auxpow;
+
     CDiskBlockIndex()
     {
         hashPrev = 0;
@@ -1206,7 +1307,13 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
-        ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
+        if (nVersion >= COMPACT_AUXPOW_INDEX_VERSION)
+        {
+            if (this->nVersion & BLOCK_VERSION_AUXPOW)
+                READWRITE(hashParentBlock);
+        }
+        else
+            ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
     )
 
     uint256 GetBlockHash() const
@@ -1586,7 +1693,199 @@ public:
 
 
 
-extern std::map<uint256, CTransaction> mapTransactions;
+//
+// Hash functors for unordered maps keyed by transaction hash.  Anyone can
+// grind txids that share their low bits, so the slice used is mixed with a
+// random salt chosen at startup to keep bucket collisions unpredictable.
+//
+extern const uint64 nTxHashSalt;
+
+inline uint64 SaltedTxHash(uint64 n)
+{
+    n ^= nTxHashSalt;
+    n ^= n >> 33;
+    n *= 0xff51afd7ed558ccdULL;
+    n ^= n >> 33;
+    n *= 0xc4ceb9fe1a85ec53ULL;
+    n ^= n >> 33;
+    return n;
+}
+
+struct CTxHashHasher
+{
+    size_t operator()(const uint256& hash) const
+    {
+        return (size_t)SaltedTxHash(hash.Get64());
+    }
+};
+
+struct COutPointHasher
+{
+    size_t operator()(const COutPoint& prevout) const
+    {
+        return (size_t)SaltedTxHash(prevout.hash.Get64() ^ ((uint64)prevout.n * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+
+
+
+//
+// A memory pool entry: the transaction plus what the pool needs to order
+// and account for it.  nFee is zero only when the inputs of a transaction
+// added without checks couldn't be found, it then sorts as lowest fee rate.
+//
+class CTxMemPoolEntry
+{
+public:
+    CTransaction tx;
+    int64 nFee;
+    unsigned int nTxSize;
+    unsigned int nUsage;
+    int64 nTime;
+
+    CTxMemPoolEntry()
+    {
+        nFee = 0;
+        nTxSize = 0;
+        nUsage = 0;
+        nTime = 0;
+    }
+
+    CTxMemPoolEntry(const CTransaction& txIn, int64 nFeeIn);
+
+    // Fee per 1000 bytes, the eviction ordering key
+    int64 GetFeeRate() const
+    {
+        return nFee * 1000 / std::max(nTxSize, 1u);
+    }
+};
+
+
+//
+// The memory pool of transactions that are valid but not yet in a block.
+// Lookups by txid and by spent outpoint are hashed, and the pool keeps an
+// index by fee rate and a running estimate of its heap usage so it can be
+// held under -maxmempool by evicting the cheapest transactions first.
+//
+class CTxMemPool
+{
+public:
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, CTxHashHasher> txmap_t;
+    typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> nexttxmap_t;
+
+    mutable CCriticalSection cs;
+    txmap_t mapTx;
+    nexttxmap_t mapNextTx;
+    std::set<std::pair<int64, uint256> > setFeeRate;
+    uint64 nTotalTxSize;
+    uint64 nDynamicUsage;
+    uint64 nEvicted;            // lowest fee rate transactions evicted
+    uint64 nEvictedSpenders;    // their in-pool spenders removed with them
+
+    CTxMemPool()
+    {
+        nTotalTxSize = 0;
+        nDynamicUsage = 0;
+        nEvicted = 0;
+        nEvictedSpenders = 0;
+    }
+
+    bool AddUnchecked(const CTransaction& tx, int64 nFee=0);
+    bool Remove(const CTransaction& tx, bool fRecursive=false);
+    void TrimToSize(uint64 nMaxUsage);
+
+    bool Exists(const uint256& hash) const
+    {
+        CRITICAL_BLOCK(cs)
+            return (mapTx.count(hash) != 0);
+        return false;
+    }
+
+    bool Lookup(const uint256& hash, CTransaction& txRet) const
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            txmap_t::const_iterator mi = mapTx.find(hash);
+            if (mi == mapTx.end())
+                return false;
+            txRet = (*mi).second.tx;
+            return true;
+        }
+        return false;
+    }
+
+    unsigned int Size() const
+    {
+        CRITICAL_BLOCK(cs)
+            return mapTx.size();
+        return 0;
+    }
+
+    static uint64 GetMaxUsage()
+    {
+        return (uint64)GetArg("-maxmempool", 300) * 1000000;
+    }
+};
+
+extern CTxMemPool mempool;
+
+
+
+
+//
+// A transaction waiting for its inputs to arrive, with the id of the peer
+// that sent it so the peer's orphans can be dropped when it disconnects.
+// The node itself may be deleted before the orphan is.
+//
+class COrphanTx
+{
+public:
+    CTransaction tx;
+    uint64 nNodeFrom;
+    int64 nTimeExpire;
+    unsigned int nSize;
+
+    COrphanTx()
+    {
+        nNodeFrom = 0;
+        nTimeExpire = 0;
+        nSize = 0;
+    }
+};
+
+//
+// A block whose parent we don't have yet.  Small orphans are held in
+// memory, larger ones are spilled to the orphans directory and read back
+// when the parent arrives (pblock is NULL then).  hashRoot caches the first
+// block of the orphan chain so getblocks requests don't walk the chain.
+//
+class COrphanBlock
+{
+public:
+    uint256 hashBlock;
+    uint256 hashPrev;
+    uint256 hashRoot;
+    CBlock* pblock;
+    unsigned int nSize;
+    int64 nTimeReceived;
+
+    COrphanBlock()
+    {
+        hashBlock = 0;
+        hashPrev = 0;
+        hashRoot = 0;
+        pblock = NULL;
+        nSize = 0;
+        nTimeReceived = 0;
+    }
+};
+
+extern CCriticalSection cs_mapOrphanTransactions;
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern uint64 nOrphanTransactionsBytes;
+extern uint64 nOrphanTxResolved;
+extern uint64 nOrphanTxEvicted;
 extern std::map<uint160, std::vector<unsigned char> > mapPubKeys;
 extern CCriticalSection cs_mapPubKeys;
 
@@ -47,11 +47,16 @@ SOCKET hListenSocket = INVALID_SOCKET;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+uint64 nLastNodeId = 0;
+CCriticalSection cs_nLastNodeId;
 map<vector<unsigned char>, CAddress> mapAddresses;
 CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+uint64 nRelayMessages = 0;
+uint64 nRelayBytesCopied = 0;
+uint64 nRelayBytesShared = 0;
 map<CInv, int64> mapAlreadyAskedFor;
 
 // Settings
@@ -671,7 +676,10 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
         else
             pnode->AddRef();
         CRITICAL_BLOCK(cs_vNodes)
+        {
             vNodes.push_back(pnode);
+            PublishConnectionCount(vNodes.size());
+        }
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -704,6 +712,9 @@ void CNode::Cleanup()
     for (unsigned int nChannel = 0; nChannel < vfSubscribe.size(); nChannel++)
         if (vfSubscribe[nChannel])
             CancelSubscribe(nChannel);
+
+    // Orphans only this node could have completed won't be resolved now
+    EraseOrphansFor(this);
 }
 
 
@@ -737,6 +748,65 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
+//
+// Send as much of a node's queued data as the socket will take.  Shared
+// messages and vSend are gathered into one sendmsg call so the shared
+// buffers never have to be copied.  Returns what the send call returned.
+//
+int static SendQueued(CNode* pnode)
+{
+#ifdef __WXMSW__
+    // No sendmsg, send the first buffer on its own
+    if (!pnode->vSendShared.empty())
+    {
+        const CDataStream& msg = *pnode->vSendShared.front();
+        return send(pnode->hSocket, &msg[pnode->nSendSharedOffset], msg.size() - pnode->nSendSharedOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    return send(pnode->hSocket, &pnode->vSend[0], pnode->vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[16];
+    int nIov = 0;
+    deque<CSharedMessage>::iterator it = pnode->vSendShared.begin();
+    for (; it != pnode->vSendShared.end() && nIov < 16; ++it, nIov++)
+    {
+        unsigned int nOffset = (nIov == 0 ? pnode->nSendSharedOffset : 0);
+        iov[nIov].iov_base = (void*)&(**it)[nOffset];
+        iov[nIov].iov_len = (**it).size() - nOffset;
+    }
+    if (it == pnode->vSendShared.end() && nIov < 16 && !pnode->vSend.empty())
+    {
+        iov[nIov].iov_base = &pnode->vSend[0];
+        iov[nIov].iov_len = pnode->vSend.size();
+        nIov++;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
+void static ConsumeSent(CNode* pnode, unsigned int nBytes)
+{
+    while (nBytes > 0 && !pnode->vSendShared.empty())
+    {
+        unsigned int nLeft = pnode->vSendShared.front()->size() - pnode->nSendSharedOffset;
+        unsigned int nUsed = min(nBytes, nLeft);
+        pnode->nSendSharedOffset += nUsed;
+        pnode->nSendSharedSize -= nUsed;
+        nBytes -= nUsed;
+        if (nUsed == nLeft)
+        {
+            pnode->vSendShared.pop_front();
+            pnode->nSendSharedOffset = 0;
+        }
+    }
+    if (nBytes > 0)
+        pnode->vSend.erase(pnode->vSend.begin(), pnode->vSend.begin() + nBytes);
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
@@ -755,10 +825,11 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->GetSendSize() == 0))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    PublishConnectionCount(vNodes.size());
 
                     // close socket and cleanup
                     pnode->CloseSocketDisconnect();
@@ -805,7 +876,7 @@ void ThreadSocketHandler2(void* parg)
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = 50000; // frequency to poll pnode->vSend and vSendShared
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -828,7 +899,7 @@ void ThreadSocketHandler2(void* parg)
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
+                    if (pnode->GetSendSize() > 0)
                         FD_SET(pnode->hSocket, &fdsetSend);
             }
         }
@@ -883,7 +954,10 @@ void ThreadSocketHandler2(void* parg)
                 CNode* pnode = new CNode(hSocket, addr, true);
                 pnode->AddRef();
                 CRITICAL_BLOCK(cs_vNodes)
+                {
                     vNodes.push_back(pnode);
+                    PublishConnectionCount(vNodes.size());
+                }
             }
         }
 
@@ -961,13 +1035,12 @@ void ThreadSocketHandler2(void* parg)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
+                    if (pnode->GetSendSize() > 0)
                     {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                        int nBytes = SendQueued(pnode);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+                            ConsumeSent(pnode, nBytes);
                             pnode->nLastSend = GetTime();
                         }
                         else if (nBytes < 0)
@@ -980,9 +1053,9 @@ void ThreadSocketHandler2(void* parg)
                                 pnode->CloseSocketDisconnect();
                             }
                         }
-                        if (vSend.size() > 1000*GetArg("-maxsendbuffer", 10*1000)) {
+                        if (pnode->GetSendSize() > 1000*GetArg("-maxsendbuffer", 10*1000)) {
                             if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
+                                printf("socket send flood control disconnect (%"PRI64u" bytes)\n", pnode->GetSendSize());
                             pnode->CloseSocketDisconnect();
                         }
                     }
@@ -992,7 +1065,7 @@ void ThreadSocketHandler2(void* parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->GetSendSize() == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1681,6 +1754,7 @@ bool StopNode()
     nTransactionsUpdated++;
     int64 nStart = GetTime();
     while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0
+        || vnThreadsRunning[6] > 0 || vnThreadsRunning[7] > 0
 #ifdef USE_UPNP
         || vnThreadsRunning[5] > 0
 #endif
@@ -1696,7 +1770,9 @@ bool StopNode()
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
     if (fHaveUPnP && vnThreadsRunning[5] > 0) printf("ThreadMapPort still running\n");
-    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
+    if (vnThreadsRunning[6] > 0) printf("ThreadReacceptWalletTransactions still running\n");
+    if (vnThreadsRunning[7] > 0) printf("ThreadSweepWallet still running\n");
+    while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0 || vnThreadsRunning[6] > 0 || vnThreadsRunning[7] > 0)
         Sleep(20);
     Sleep(50);
 
@@ -6,6 +6,7 @@
 
 #include <deque>
 #include <boost/array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
 #include <openssl/rand.h>
 
@@ -479,11 +480,20 @@ extern SOCKET hListenSocket;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
+extern uint64 nLastNodeId;
+extern CCriticalSection cs_nLastNodeId;
 extern std::map<std::vector<unsigned char>, CAddress> mapAddresses;
 extern CCriticalSection cs_mapAddresses;
-extern std::map<CInv, CDataStream> mapRelay;
+// A complete serialized message, header included, that is queued by
+// reference to every peer it is sent to instead of being copied into vSend.
+typedef boost::shared_ptr<const CDataStream> CSharedMessage;
+
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
+extern uint64 nRelayMessages;
+extern uint64 nRelayBytesCopied;
+extern uint64 nRelayBytesShared;
 extern std::map<CInv, int64> mapAlreadyAskedFor;
 
 // Settings
@@ -504,6 +514,9 @@ public:
     CDataStream vSend;
     CDataStream vRecv;
     CCriticalSection cs_vSend;
+    std::deque<CSharedMessage> vSendShared;
+    unsigned int nSendSharedOffset;
+    uint64 nSendSharedSize;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
     int64 nLastRecv;
@@ -512,6 +525,7 @@ public:
     unsigned int nHeaderStart;
     unsigned int nMessageStart;
     CAddress addr;
+    uint64 nId;
     int nVersion;
     std::string strSubVer;
     bool fClient;
@@ -554,6 +568,8 @@ public:
         vSend.SetVersion(0);
         vRecv.SetType(SER_NETWORK);
         vRecv.SetVersion(0);
+        nSendSharedOffset = 0;
+        nSendSharedSize = 0;
         // Version 0.2 obsoletes 20 Feb 2012
         if (GetTime() > 1329696000)
         {
@@ -567,6 +583,9 @@ public:
         nHeaderStart = -1;
         nMessageStart = -1;
         addr = addrIn;
+        // Unlike the address or the pointer, never reused by a later peer
+        CRITICAL_BLOCK(cs_nLastNodeId)
+            nId = ++nLastNodeId;
         nVersion = 0;
         strSubVer = "";
         fClient = false; // set by version message
@@ -622,6 +641,11 @@ public:
         nRefCount--;
     }
 
+    uint64 GetSendSize() const
+    {
+        return vSend.size() + nSendSharedSize;
+    }
+
 
 
     void AddAddressKnown(const CAddress& addr)
@@ -729,6 +753,24 @@ public:
         cs_vSend.Leave();
     }
 
+    void PushSharedMessage(const CSharedMessage& pmsg)
+    {
+        CRITICAL_BLOCK(cs_vSend)
+        {
+            // Whatever is already in vSend was pushed first and must go first
+            if (!vSend.empty())
+            {
+                boost::shared_ptr<CDataStream> ppending(new CDataStream(vSend.nType, vSend.nVersion));
+                ppending->swap(vSend);
+                nSendSharedSize += ppending->size();
+                vSendShared.push_back(ppending);
+            }
+            nSendSharedSize += pmsg->size();
+            vSendShared.push_back(pmsg);
+            printf("sending: shared message (%d bytes)\n", pmsg->size());
+        }
+    }
+
     void EndMessageAbortIfEmpty()
     {
         if (nHeaderStart == -1)
@@ -989,6 +1031,20 @@ void RelayMessage(const CInv& inv, const T& a)
     RelayMessage(inv, ss);
 }
 
+inline CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    // Frame the payload the way EndMessage does for version 209+ peers
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    boost::shared_ptr<CDataStream> pmsg(new CDataStream(SER_NETWORK, VERSION));
+    pmsg->reserve(sizeof(hdr) + ssPayload.size());
+    *pmsg << hdr;
+    *pmsg += ssPayload;
+    return pmsg;
+}
+
 template<>
 inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
 {
@@ -1001,9 +1057,12 @@ inline void RelayMessage<>(const CInv& inv, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay[inv] = ss;
+        // Save original serialized message so newer versions are preserved.
+        // It's framed once here and then shared by every peer that asks.
+        mapRelay[inv] = MakeSharedMessage(inv.GetCommand(), ss);
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        nRelayMessages++;
+        nRelayBytesCopied += ss.size();
     }
 
     RelayInventory(inv);
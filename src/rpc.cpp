@@ -13,6 +13,7 @@
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/algorithm/string.hpp>
+#include <fstream>
 #ifdef USE_SSL
 #include <boost/asio/ssl.hpp> 
 #include <boost/filesystem.hpp>
@@ -20,6 +21,7 @@
 typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> SSLStream;
 #endif
 #include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_fast_reader.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
 #define printf OutputDebugStringF
@@ -176,7 +178,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainSnapshot()->nHeight;
 }
 
 
@@ -187,7 +189,7 @@ Value getblocknumber(const Array& params, bool fHelp)
             "getblocknumber\n"
             "Returns the block number of the latest block in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainSnapshot()->nHeight;
 }
 
 Value BlockToValue(CBlock &block)
@@ -280,22 +282,29 @@ Value getblockbycount(const Array& params, bool fHelp)
             "getblockbycount height\n"
             "Dumps the block existing at specified height");
 
-    string blkname = strprintf("blk%d", height);
-
-    CBlockIndex* pindex;
-    bool found = false;
-
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin();
-         mi != mapBlockIndex.end(); ++mi)
+    // Walk the main chain from whichever end is nearer.  cs_main is only
+    // needed to find the index, so batched calls can read blocks in parallel.
+    CBlockIndex* pindex = NULL;
+    CRITICAL_BLOCK(cs_main)
     {
-    	pindex = (*mi).second;
-	if ((pindex->nHeight == height) && (pindex->IsInMainChain())) {
-		found = true;
-		break;
-	}
+        if (height >= 0 && height <= nBestHeight)
+        {
+            if (height < nBestHeight / 2)
+            {
+                pindex = pindexGenesisBlock;
+                while (pindex && pindex->nHeight < height)
+                    pindex = pindex->pnext;
+            }
+            else
+            {
+                pindex = pindexBest;
+                while (pindex && pindex->nHeight > height)
+                    pindex = pindex->pprev;
+            }
+        }
     }
 
-    if (!found)
+    if (pindex == NULL)
         throw runtime_error(
             "getblockbycount height\n"
             "Dumps the block existing at specified height");
@@ -318,12 +327,16 @@ Value getblockbyhash(const Array& params, bool fHelp)
     uint256 hash;
     hash.SetHex(params[0].get_str());
 
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi == mapBlockIndex.end())
+    CBlockIndex* pindex = NULL;
+    CRITICAL_BLOCK(cs_main)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end())
+            pindex = (*mi).second;
+    }
+    if (pindex == NULL)
         throw JSONRPCError(-18, "hash not found");
 
-    CBlockIndex* pindex = (*mi).second;
-
     CBlock block;
     block.ReadFromDisk(pindex);
     block.BuildMerkleTree();
@@ -338,34 +351,13 @@ Value getconnectioncount(const Array& params, bool fHelp)
             "getconnectioncount\n"
             "Returns the number of connections to other nodes.");
 
-    return (int)vNodes.size();
+    return GetChainSnapshot()->nConnections;
 }
 
 
 double GetDifficulty()
 {
-    // Floating point number that is a multiple of the minimum difficulty,
-    // minimum difficulty = 1.0.
-
-    if (pindexBest == NULL)
-        return 1.0;
-    int nShift = (pindexBest->nBits >> 24) & 0xff;
-
-    double dDiff =
-        (double)0x0000ffff / (double)(pindexBest->nBits & 0x00ffffff);
-
-    while (nShift < 29)
-    {
-        dDiff *= 256.0;
-        nShift++;
-    }
-    while (nShift > 29)
-    {
-        dDiff /= 256.0;
-        nShift--;
-    }
-
-    return dDiff;
+    return GetChainSnapshot()->dDifficulty;
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -438,15 +430,18 @@ Value getinfo(const Array& params, bool fHelp)
             "getinfo\n"
             "Returns an object containing various state info.");
 
+    // Chain figures come from one snapshot so they agree with each other
+    CChainSnapshotRef psnapshot = GetChainSnapshot();
+
     Object obj;
     obj.push_back(Pair("version",       (int)VERSION));
-    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
-    obj.push_back(Pair("connections",   (int)vNodes.size()));
+    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalanceNoWait())));
+    obj.push_back(Pair("blocks",        psnapshot->nHeight));
+    obj.push_back(Pair("connections",   psnapshot->nConnections));
     obj.push_back(Pair("proxy",         (fUseProxy ? addrProxy.ToStringIPPort() : string())));
     obj.push_back(Pair("generate",      (bool)fGenerateBitcoins));
     obj.push_back(Pair("genproclimit",  (int)(fLimitProcessors ? nLimitProcessors : -1)));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",    psnapshot->dDifficulty));
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
     obj.push_back(Pair("testnet",       fTestNet));
     obj.push_back(Pair("keypoololdest", (boost::int64_t)pwalletMain->GetOldestKeyPoolTime()));
@@ -456,6 +451,55 @@ Value getinfo(const Array& params, bool fHelp)
 }
 
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns an object containing memory pool state info.");
+
+    Object obj;
+    CRITICAL_BLOCK(mempool.cs)
+    {
+        obj.push_back(Pair("size",          (int)mempool.mapTx.size()));
+        obj.push_back(Pair("bytes",         (boost::int64_t)mempool.nTotalTxSize));
+        obj.push_back(Pair("usage",         (boost::int64_t)mempool.nDynamicUsage));
+        obj.push_back(Pair("maxmempool",    (boost::int64_t)CTxMemPool::GetMaxUsage()));
+        obj.push_back(Pair("minfeerate",    ValueFromAmount(mempool.setFeeRate.empty() ? 0 : (*mempool.setFeeRate.begin()).first)));
+        obj.push_back(Pair("evicted",       (boost::int64_t)mempool.nEvicted));
+        obj.push_back(Pair("evictedspenders", (boost::int64_t)mempool.nEvictedSpenders));
+    }
+    CRITICAL_BLOCK(cs_mapOrphanTransactions)
+    {
+        obj.push_back(Pair("orphans",       (int)mapOrphanTransactions.size()));
+        obj.push_back(Pair("orphanbytes",   (boost::int64_t)nOrphanTransactionsBytes));
+        obj.push_back(Pair("orphansresolved", (boost::int64_t)nOrphanTxResolved));
+        obj.push_back(Pair("orphansevicted", (boost::int64_t)nOrphanTxEvicted));
+    }
+    return obj;
+}
+
+
+Value getrelayinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrelayinfo\n"
+            "Returns an object containing relay memory statistics.");
+
+    Object obj;
+    CRITICAL_BLOCK(cs_mapRelay)
+    {
+        obj.push_back(Pair("entries",       (int)mapRelay.size()));
+        obj.push_back(Pair("messages",      (boost::int64_t)nRelayMessages));
+        obj.push_back(Pair("bytescopied",   (boost::int64_t)nRelayBytesCopied));
+        obj.push_back(Pair("bytesshared",   (boost::int64_t)nRelayBytesShared));
+        obj.push_back(Pair("copiedpermessage", nRelayMessages ? (double)nRelayBytesCopied / nRelayMessages : 0.0));
+    }
+    return obj;
+}
+
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -695,21 +739,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64 nAmount = 0;
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-                if (txout.scriptPubKey == scriptPubKey)
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
-        }
-    }
+    int64 nAmount = pwalletMain->GetReceivedByAddress(scriptPubKey.GetBitcoinAddressHash160(), nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -755,20 +785,8 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
-    {
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-                if (setPubKey.count(txout.scriptPubKey))
-                    if (wtx.GetDepthInMainChain() >= nMinDepth)
-                        nAmount += txout.nValue;
-        }
-    }
+    BOOST_FOREACH(const CScript& scriptPubKey, setPubKey)
+        nAmount += pwalletMain->GetReceivedByAddress(scriptPubKey.GetBitcoinAddressHash160(), nMinDepth);
 
     return (double)nAmount / (double)COIN;
 }
@@ -780,22 +798,10 @@ int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinD
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
         // Tally wallet transactions
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (!wtx.IsFinal())
-                continue;
-
-            int64 nGenerated, nReceived, nSent, nFee;
-            wtx.GetAccountAmounts(strAccount, nGenerated, nReceived, nSent, nFee);
-
-            if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
-                nBalance += nReceived;
-            nBalance += nGenerated - nSent - nFee;
-        }
+        nBalance += pwalletMain->GetAccountTxBalance(strAccount, nMinDepth);
 
         // Tally internal accounting entries
-        nBalance += walletdb.GetAccountCreditDebit(strAccount);
+        nBalance += pwalletMain->GetAccountCreditDebit(strAccount);
     }
 
     return nBalance;
@@ -901,7 +907,11 @@ Value movecmd(const Array& params, bool fHelp)
         credit.strComment = strComment;
         walletdb.WriteAccountingEntry(credit);
 
-        walletdb.TxnCommit();
+        if (walletdb.TxnCommit())
+        {
+            pwalletMain->IndexAccountingEntry(debit);
+            pwalletMain->IndexAccountingEntry(credit);
+        }
     }
     return true;
 }
@@ -945,6 +955,12 @@ Value sendfrom(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+void EnsureSpentCoinsChecked()
+{
+    if (!pwalletMain->fSpentChecked)
+        throw JSONRPCError(-4, "The wallet is still checking which of its coins are spent, try again shortly");
+}
+
 Value sendmany(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 4)
@@ -985,6 +1001,8 @@ Value sendmany(const Array& params, bool fHelp)
         vecSend.push_back(make_pair(scriptPubKey, nAmount));
     }
 
+    EnsureSpentCoinsChecked();
+
     CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
@@ -1011,6 +1029,247 @@ Value sendmany(const Array& params, bool fHelp)
 }
 
 
+void static AddPayout(const string& strAddress, int64 nAmount, set<string>& setAddress, vector<pair<CScript, int64> >& vecSend)
+{
+    if (setAddress.count(strAddress))
+        throw JSONRPCError(-8, string("Invalid parameter, duplicated address: ")+strAddress);
+    setAddress.insert(strAddress);
+
+    CScript scriptPubKey;
+    if (!scriptPubKey.SetBitcoinAddress(strAddress))
+        throw JSONRPCError(-5, string("Invalid devcoin address:")+strAddress);
+    if (nAmount <= 0 || !MoneyRange(nAmount))
+        throw JSONRPCError(-3, string("Invalid amount for ")+strAddress);
+    vecSend.push_back(make_pair(scriptPubKey, nAmount));
+}
+
+void static ReadPayoutFile(const string& strFile, set<string>& setAddress, vector<pair<CScript, int64> >& vecSend)
+{
+    // One "<address> <amount>" per line, space, tab or comma separated,
+    // blank lines and lines starting with # skipped
+    ifstream stream(strFile.c_str());
+    if (!stream)
+        throw JSONRPCError(-8, string("Can't open payout file ")+strFile);
+    string strLine;
+    int nLine = 0;
+    while (getline(stream, strLine))
+    {
+        nLine++;
+        trim(strLine);
+        if (strLine.empty() || strLine[0] == '#')
+            continue;
+        vector<string> vField;
+        split(vField, strLine, is_any_of(" \t,"), token_compress_on);
+        int64 nAmount;
+        if (vField.size() != 2 || !ParseMoney(vField[1], nAmount))
+            throw JSONRPCError(-8, strprintf("Invalid payout file line %d", nLine));
+        AddPayout(vField[0], nAmount, setAddress, vecSend);
+    }
+}
+
+Value sendpayouts(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            "sendpayouts <fromaccount> <payoutfile|{address:amount,...}> [minconf=1] [maxoutputs=500] [comment]\n"
+            "Pays every address in <payoutfile>, one \"<address> <amount>\" per line, or in the given object,\n"
+            "in as many transactions of at most [maxoutputs] payments as it takes.  A batch too large for a\n"
+            "standard transaction is split into smaller ones.\n"
+            "Returns the txid, size, fee and timings of each transaction.");
+
+    string strAccount = AccountFromValue(params[0]);
+    set<string> setAddress;
+    vector<pair<CScript, int64> > vecSend;
+    if (params[1].type() == obj_type)
+    {
+        BOOST_FOREACH(const Pair& s, params[1].get_obj())
+            AddPayout(s.name_, AmountFromValue(s.value_), setAddress, vecSend);
+    }
+    else
+        ReadPayoutFile(params[1].get_str(), setAddress, vecSend);
+    if (vecSend.empty())
+        throw JSONRPCError(-8, "No payouts given");
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    int nMaxOutputs = DEFAULT_PAYOUT_OUTPUTS;
+    if (params.size() > 3)
+        nMaxOutputs = params[3].get_int();
+    if (nMaxOutputs <= 0)
+        throw JSONRPCError(-8, "Invalid parameter");
+    string strComment;
+    if (params.size() > 4 && params[4].type() != null_type)
+        strComment = params[4].get_str();
+
+    int64 nTotal = 0;
+    BOOST_FOREACH(const PAIRTYPE(CScript, int64)& item, vecSend)
+        nTotal += item.second;
+
+    EnsureSpentCoinsChecked();
+
+    // Check funds for the whole payout up front
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+        if (nTotal > GetAccountBalance(strAccount, nMinDepth))
+            throw JSONRPCError(-6, "Account has insufficient funds");
+
+    // Each batch is committed before the next selects its coins, so they
+    // never share inputs.  A batch whose inputs would take it past the size
+    // limit pays only the payments that fit, and the rest go in the next.
+    // A failed batch stops the payout and the ones already sent are still
+    // reported.
+    Array vBatch;
+    int64 nPaid = 0;
+    int64 nFees = 0;
+    unsigned int nPos = 0;
+    string strError;
+    while (nPos < vecSend.size())
+    {
+        unsigned int nEnd = min(nPos + (unsigned int)nMaxOutputs, (unsigned int)vecSend.size());
+        vector<pair<CScript, int64> > vecBatch(vecSend.begin() + nPos, vecSend.begin() + nEnd);
+
+        CWalletTx wtx;
+        wtx.strFromAccount = strAccount;
+        if (!strComment.empty())
+            wtx.mapValue["comment"] = strComment;
+        CReserveKey keyChange(pwalletMain);
+        int64 nFeeRequired = 0;
+        unsigned int nPayments = 0;
+        int64 nCreateTime = 0;
+        int64 nCommitTime = 0;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+        {
+            int64 nStart = GetTimeMillis();
+            if (!pwalletMain->CreatePayoutTransaction(vecBatch, nPayments, wtx, keyChange, nFeeRequired))
+                strError = "Transaction creation failed";
+            nCreateTime = GetTimeMillis() - nStart;
+            if (strError.empty())
+            {
+                nStart = GetTimeMillis();
+                if (!pwalletMain->CommitTransaction(wtx, keyChange))
+                    strError = "Transaction commit failed";
+                nCommitTime = GetTimeMillis() - nStart;
+            }
+        }
+        if (!strError.empty())
+            break;
+        vecBatch.resize(nPayments);
+        nEnd = nPos + nPayments;
+
+        int64 nAmount = 0;
+        BOOST_FOREACH(const PAIRTYPE(CScript, int64)& item, vecBatch)
+            nAmount += item.second;
+        Object batch;
+        batch.push_back(Pair("txid",     wtx.GetHash().GetHex()));
+        batch.push_back(Pair("payments", (int)vecBatch.size()));
+        batch.push_back(Pair("inputs",   (int)wtx.vin.size()));
+        batch.push_back(Pair("bytes",    (int)::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK)));
+        batch.push_back(Pair("amount",   ValueFromAmount(nAmount)));
+        batch.push_back(Pair("fee",      ValueFromAmount(nFeeRequired)));
+        batch.push_back(Pair("createms", (boost::int64_t)nCreateTime));
+        batch.push_back(Pair("commitms", (boost::int64_t)nCommitTime));
+        vBatch.push_back(batch);
+        printf("sendpayouts : paid %d addresses in %s, fee %s, %"PRI64d"ms\n", vecBatch.size(), wtx.GetHash().ToString().substr(0,10).c_str(), FormatMoney(nFeeRequired).c_str(), nCreateTime + nCommitTime);
+
+        nPaid += nAmount;
+        nFees += nFeeRequired;
+        nPos = nEnd;
+    }
+
+    Object ret;
+    ret.push_back(Pair("transactions", vBatch));
+    ret.push_back(Pair("paid",         ValueFromAmount(nPaid)));
+    ret.push_back(Pair("fees",         ValueFromAmount(nFees)));
+    ret.push_back(Pair("unpaid",       (int)(vecSend.size() - nPos)));
+    if (!strError.empty())
+        ret.push_back(Pair("error",    strError));
+    return ret;
+}
+
+
+Value sweepwallet(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "sweepwallet [maxcoinvalue=0] [maxtransactions=1] [allowfee=false]\n"
+            "Consolidates confirmed outputs worth at most [maxcoinvalue] (0 for any) into new "
+            "outputs of this wallet, making at most [maxtransactions] transactions.  "
+            "Unless [allowfee] is true only transactions that qualify as free are made.");
+
+    int64 nMaxCoinValue = 0;
+    if (params.size() > 0 && params[0].get_real() != 0)
+        nMaxCoinValue = AmountFromValue(params[0]);
+    int nMaxTransactions = 1;
+    if (params.size() > 1)
+        nMaxTransactions = params[1].get_int();
+    bool fAllowFee = false;
+    if (params.size() > 2)
+        fAllowFee = params[2].get_bool();
+
+    EnsureSpentCoinsChecked();
+
+    vector<uint256> vhash;
+    pwalletMain->SweepWallet(nMaxCoinValue, nMaxTransactions, fAllowFee, vhash);
+
+    vector<pair<double, pair<const CWalletTx*,unsigned int> > > vCandidates;
+    pwalletMain->GetSweepCandidates(nMaxCoinValue, vCandidates);
+
+    Object ret;
+    Array txids;
+    int64 nInputs = 0;
+    int64 nValue = 0;
+    int64 nFees = 0;
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    {
+        BOOST_FOREACH(const uint256& hash, vhash)
+        {
+            const CWalletTx& wtx = pwalletMain->mapWallet[hash];
+            txids.push_back(hash.GetHex());
+            nInputs += wtx.vin.size();
+            nValue += wtx.GetDebit();
+            nFees += wtx.GetDebit() - wtx.GetValueOut();
+        }
+    }
+    ret.push_back(Pair("transactions",  txids));
+    ret.push_back(Pair("inputs",        (boost::int64_t)nInputs));
+    ret.push_back(Pair("amount",        ValueFromAmount(nValue)));
+    ret.push_back(Pair("fee",           ValueFromAmount(nFees)));
+    ret.push_back(Pair("remaining",     (int)vCandidates.size()));
+    return ret;
+}
+
+
+Value getsweepinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getsweepinfo [maxcoinvalue=0]\n"
+            "Returns sweep totals since startup and how many confirmed outputs worth at most "
+            "[maxcoinvalue] (0 for any) are left to consolidate.");
+
+    int64 nMaxCoinValue = 0;
+    if (params.size() > 0 && params[0].get_real() != 0)
+        nMaxCoinValue = AmountFromValue(params[0]);
+
+    vector<pair<double, pair<const CWalletTx*,unsigned int> > > vCandidates;
+    pwalletMain->GetSweepCandidates(nMaxCoinValue, vCandidates);
+
+    Object obj;
+    obj.push_back(Pair("background",    GetBoolArg("-sweep")));
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    {
+        obj.push_back(Pair("transactions",  pwalletMain->nSweepTransactions));
+        obj.push_back(Pair("inputs",        (boost::int64_t)pwalletMain->nSweepInputs));
+        obj.push_back(Pair("amount",        ValueFromAmount(pwalletMain->nSweepValue)));
+        obj.push_back(Pair("fee",           ValueFromAmount(pwalletMain->nSweepFees)));
+        obj.push_back(Pair("lastsweep",     (boost::int64_t)pwalletMain->nSweepTime));
+    }
+    obj.push_back(Pair("remaining",     (int)vCandidates.size()));
+    return obj;
+}
+
+
 struct tallyitem
 {
     int64 nAmount;
@@ -1036,30 +1295,17 @@ Value ListReceived(const Array& params, bool fByAccounts)
 
     // Tally
     map<uint160, tallyitem> mapTally;
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+    map<uint160, pair<int64, int> > mapReceived;
+    pwalletMain->GetReceivedByAddresses(nMinDepth, mapReceived);
+    for (map<uint160, pair<int64, int> >::iterator it = mapReceived.begin(); it != mapReceived.end(); ++it)
     {
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            const CWalletTx& wtx = (*it).second;
-            if (wtx.IsCoinBase() || !wtx.IsFinal())
-                continue;
-
-            int nDepth = wtx.GetDepthInMainChain();
-            if (nDepth < nMinDepth)
-                continue;
+        // Only counting our own devcoin addresses and not ip addresses
+        if ((*it).first == 0 || !mapPubKeys.count((*it).first)) // IsMine
+            continue;
 
-            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            {
-                // Only counting our own devcoin addresses and not ip addresses
-                uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
-                if (hash160 == 0 || !mapPubKeys.count(hash160)) // IsMine
-                    continue;
-
-                tallyitem& item = mapTally[hash160];
-                item.nAmount += txout.nValue;
-                item.nConf = min(item.nConf, nDepth);
-            }
-        }
+        tallyitem& item = mapTally[(*it).first];
+        item.nAmount = (*it).second.first;
+        item.nConf = (*it).second.second;
     }
 
     // Reply
@@ -1243,6 +1489,39 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
+// Adds the entries of the history items older than key (or from the newest
+// if fNewest) until there are nCount, after skipping nFrom items.  Returns
+// false if the history ran out first.
+bool static ListHistory(const string& strAccount, CWalletHistoryKey& key, bool fNewest, int nFrom, int nCount, Array& ret)
+{
+    const CWalletTx* pwtx;
+    const CAccountingEntry* pacentry;
+
+    // nFrom counts items the way listtransactions always walked them: every
+    // wallet transaction, whatever its account, and the account's own
+    // accounting entries
+    while (nFrom > 0)
+    {
+        if (!pwalletMain->GetPrevHistory("*", key, fNewest, pwtx, pacentry))
+            return false;
+        fNewest = false;
+        if (pwtx || strAccount == "*" || pacentry->strAccount == strAccount)
+            nFrom--;
+    }
+
+    while (ret.size() < nCount)
+    {
+        if (!pwalletMain->GetPrevHistory(strAccount, key, fNewest, pwtx, pacentry))
+            return false;
+        fNewest = false;
+        if (pwtx)
+            ListTransactions(*pwtx, strAccount, 0, true, ret);
+        if (pacentry)
+            AcentryToJSON(*pacentry, strAccount, ret);
+    }
+    return true;
+}
+
 Value listtransactions(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 3)
@@ -1259,45 +1538,18 @@ Value listtransactions(const Array& params, bool fHelp)
     int nFrom = 0;
     if (params.size() > 2)
         nFrom = params[2].get_int();
+    if (nCount < 0 || nFrom < 0)
+        throw JSONRPCError(-8, "Invalid parameter");
 
     Array ret;
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-
     CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
-        // Firs: get all CWalletTx and CAccountingEntry into a sorted-by-time multimap:
-        typedef pair<CWalletTx*, CAccountingEntry*> TxPair;
-        typedef multimap<int64, TxPair > TxItems;
-        TxItems txByTime;
-
-        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-        {
-            CWalletTx* wtx = &((*it).second);
-            txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
-        }
-        list<CAccountingEntry> acentries;
-        walletdb.ListAccountCreditDebit(strAccount, acentries);
-        BOOST_FOREACH(CAccountingEntry& entry, acentries)
-        {
-            txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
-        }
-
-        // Now: iterate backwards until we have nCount items to return:
-        TxItems::reverse_iterator it = txByTime.rbegin();
-        for (std::advance(it, nFrom); it != txByTime.rend(); ++it)
-        {
-            CWalletTx *const pwtx = (*it).second.first;
-            if (pwtx != 0)
-                ListTransactions(*pwtx, strAccount, 0, true, ret);
-            CAccountingEntry *const pacentry = (*it).second.second;
-            if (pacentry != 0)
-                AcentryToJSON(*pacentry, strAccount, ret);
-
-            if (ret.size() >= nCount) break;
-        }
+        // Walk the history index back from the newest entry
+        CWalletHistoryKey key;
+        ListHistory(strAccount, key, true, nFrom, nCount, ret);
         // ret is now newest to oldest
     }
-    
+
     // Make sure we return only last nCount items (sends-to-self might give us an extra):
     if (ret.size() > nCount)
     {
@@ -1310,6 +1562,48 @@ Value listtransactions(const Array& params, bool fHelp)
     return ret;
 }
 
+Value listtransactionspage(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listtransactionspage [account] [count=10] [cursor]\n"
+            "Returns Object with \"transactions\", at least [count] transactions for account [account]\n"
+            "older than [cursor], oldest first, and \"cursor\" to pass to get the page before it.\n"
+            "Without [cursor] the newest transactions are returned.  Entries from one transaction\n"
+            "are never split across pages.");
+
+    string strAccount = "*";
+    if (params.size() > 0)
+        strAccount = params[0].get_str();
+    int nCount = 10;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount < 0)
+        throw JSONRPCError(-8, "Invalid parameter");
+    CWalletHistoryKey key;
+    bool fNewest = true;
+    if (params.size() > 2 && params[2].get_str() != "")
+    {
+        if (!key.SetString(params[2].get_str()))
+            throw JSONRPCError(-8, "Invalid cursor");
+        fNewest = false;
+    }
+
+    Array vTx;
+    bool fMore = false;
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+        fMore = ListHistory(strAccount, key, fNewest, 0, nCount, vTx);
+    std::reverse(vTx.begin(), vTx.end()); // oldest to newest
+
+    Object ret;
+    ret.push_back(Pair("transactions", vTx));
+    if (fMore)
+        ret.push_back(Pair("cursor", key.ToString()));
+    else
+        ret.push_back(Pair("cursor", Value::null));
+    return ret;
+}
+
 Value listaccounts(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1354,10 +1648,8 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
-        mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
+    BOOST_FOREACH(const PAIRTYPE(string, int64)& item, pwalletMain->GetAccountCreditDebits())
+        mapAccountBalances[item.first] += item.second;
 
     Object ret;
     BOOST_FOREACH(const PAIRTYPE(string, int64)& accountBalance, mapAccountBalances) {
@@ -1417,6 +1709,36 @@ Value backupwallet(const Array& params, bool fHelp)
 }
 
 
+Value keypoolrefill(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "keypoolrefill [size]\n"
+            "Fills the key pool up to [size] keys (default: -keypool setting, at most 100000) and reports how fast they were made.");
+
+    int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0);
+    if (params.size() > 0)
+        nTargetSize = params[0].get_int64();
+    if (nTargetSize < 0 || nTargetSize > 100000)
+        throw JSONRPCError(-8, "Invalid parameter, size must be between 0 and 100000");
+
+    int64 nStart = GetTimeMillis();
+    int nAdded = pwalletMain->TopUpKeyPool(nTargetSize);
+    int64 nElapsed = GetTimeMillis() - nStart;
+
+    int nSize;
+    CRITICAL_BLOCK(pwalletMain->cs_setKeyPool)
+        nSize = pwalletMain->setKeyPool.size();
+
+    Object ret;
+    ret.push_back(Pair("added",      nAdded));
+    ret.push_back(Pair("size",       nSize));
+    ret.push_back(Pair("seconds",    (double)nElapsed / 1000));
+    ret.push_back(Pair("keyspersec", (nElapsed > 0 ? 1000.0 * nAdded / nElapsed : 0.0)));
+    return ret;
+}
+
+
 Value validateaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1447,6 +1769,10 @@ Value validateaddress(const Array& params, bool fHelp)
 }
 
 
+// getwork, getworkaux and getauxblock keep the blocks they hand out in static
+// state, so RPC worker threads take turns in them
+static CCriticalSection cs_getwork;
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1465,6 +1791,7 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "Devcoin is downloading blocks...");
 
+    CCriticalBlock criticalblock(cs_getwork);
     static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
@@ -1516,7 +1843,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1582,6 +1909,7 @@ Value getworkaux(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "I0Coin is downloading blocks...");
 
+    CCriticalBlock criticalblock(cs_getwork);
     static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
@@ -1638,7 +1966,7 @@ Value getworkaux(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate))));
@@ -1744,6 +2072,7 @@ Value getauxblock(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "I0Coin is downloading blocks...");
 
+    CCriticalBlock criticalblock(cs_getwork);
     static map<uint256, CBlock*> mapNewBlock;
     static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
@@ -1792,7 +2121,7 @@ Value getauxblock(const Array& params, bool fHelp)
             vNewBlock.push_back(pblock);
         }
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
@@ -1825,6 +2154,23 @@ Value getauxblock(const Array& params, bool fHelp)
     }
 }
 
+vector<uint256> BuildChainMerkleTree(const vector<uint256>& vLeaves)
+{
+    vector<uint256> vTree = vLeaves;
+    int j = 0;
+    for (int nSize = vLeaves.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        for (int i = 0; i < nSize; i += 2)
+        {
+            int i2 = std::min(i+1, nSize-1);
+            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
+                        BEGIN(vTree[j+i2]), END(vTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return vTree;
+}
+
 Value buildmerkletree(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1)
@@ -1832,28 +2178,17 @@ Value buildmerkletree(const Array& params, bool fHelp)
                 "buildmerkletree <obj>...\n"
                 " build a merkle tree with the given hex-encoded objects\n"
                 );
-    vector<uint256> vTree;
+    vector<uint256> vLeaves;
     BOOST_FOREACH(const Value& obj, params)
     {
         uint256 nHash;
         nHash.SetHex(obj.get_str());
-        vTree.push_back(nHash);
+        vLeaves.push_back(nHash);
     }
+    vector<uint256> vTree = BuildChainMerkleTree(vLeaves);
 
-    int j = 0;
-    for (int nSize = params.size(); nSize > 1; nSize = (nSize + 1) / 2)
-    {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            vTree.push_back(Hash(BEGIN(vTree[j+i]),  END(vTree[j+i]),
-                        BEGIN(vTree[j+i2]), END(vTree[j+i2])));
-        }
-        j += nSize;
-    }
-
-    Array result;
-    BOOST_FOREACH(uint256& nNode, vTree)
+    Array result;
+    BOOST_FOREACH(uint256& nNode, vTree)
     {
         result.push_back(nNode.GetHex());
     }
@@ -1884,6 +2219,8 @@ pair<string, rpcfn_type> pCallTable[] =
 //    make_pair("setgenerate",           &setgenerate),
     make_pair("gethashespersec",       &gethashespersec),
     make_pair("getinfo",               &getinfo),
+    make_pair("getmempoolinfo",        &getmempoolinfo),
+    make_pair("getrelayinfo",          &getrelayinfo),
     make_pair("getnewaddress",         &getnewaddress),
     make_pair("getaccountaddress",     &getaccountaddress),
     make_pair("setaccount",            &setaccount),
@@ -1902,13 +2239,18 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("listreceivedbyaccount", &listreceivedbyaccount),
     make_pair("listreceivedbylabel",   &listreceivedbyaccount), // deprecated
     make_pair("backupwallet",          &backupwallet),
+    make_pair("keypoolrefill",         &keypoolrefill),
     make_pair("validateaddress",       &validateaddress),
     make_pair("getbalance",            &getbalance),
     make_pair("move",                  &movecmd),
     make_pair("sendfrom",              &sendfrom),
     make_pair("sendmany",              &sendmany),
+    make_pair("sendpayouts",           &sendpayouts),
+    make_pair("sweepwallet",           &sweepwallet),
+    make_pair("getsweepinfo",          &getsweepinfo),
     make_pair("gettransaction",        &gettransaction),
     make_pair("listtransactions",      &listtransactions),
+    make_pair("listtransactionspage",  &listtransactionspage),
 //    make_pair("getwork",               &getwork),
 //    make_pair("getworkaux",            &getworkaux),
 //    make_pair("getauxblock",           &getauxblock),
@@ -1930,6 +2272,9 @@ string pAllowInSafeMode[] =
 //    "setgenerate",
     "gethashespersec",
     "getinfo",
+    "getmempoolinfo",
+    "getrelayinfo",
+    "getsweepinfo",
     "getnewaddress",
     "getaccountaddress",
     "setlabel",
@@ -1945,6 +2290,39 @@ string pAllowInSafeMode[] =
 };
 set<string> setAllowInSafeMode(pAllowInSafeMode, pAllowInSafeMode + sizeof(pAllowInSafeMode)/sizeof(pAllowInSafeMode[0]));
 
+// Read-only calls that take cs_main briefly or not at all.  Runs of these in
+// a batch request are spread over several threads; everything else in a
+// batch runs alone, in order.
+string pConcurrentInBatch[] =
+{
+    "getblockcount",
+    "getblocknumber",
+    "getblockbycount",
+    "getblockbyhash",
+    "getconnectioncount",
+    "getdifficulty",
+    "getgenerate",
+    "gethashespersec",
+    "getmempoolinfo",
+    "getrelayinfo",
+    "validateaddress",
+};
+set<string> setConcurrentInBatch(pConcurrentInBatch, pConcurrentInBatch + sizeof(pConcurrentInBatch)/sizeof(pConcurrentInBatch[0]));
+
+// Calls whose results can run to megabytes.  Their replies are serialized
+// straight onto the connection in chunks instead of into a string first.
+string pStreamedReply[] =
+{
+    "getblockbycount",
+    "getblockbyhash",
+    "listreceivedbyaddress",
+    "listreceivedbyaccount",
+    "listtransactions",
+    "listtransactionspage",
+    "listaccounts",
+};
+set<string> setStreamedReply(pStreamedReply, pStreamedReply + sizeof(pStreamedReply)/sizeof(pStreamedReply[0]));
+
 
 
 
@@ -1973,18 +2351,51 @@ string HTTPPost(const string& strMsg, const map<string,string>& mapRequestHeader
 
 string rfc1123Time()
 {
+    // gmtime and setlocale aren't safe to call from several RPC threads at once
+    static CCriticalSection cs_rfc1123Time;
     char buffer[64];
     time_t now;
     time(&now);
-    struct tm* now_gmt = gmtime(&now);
-    string locale(setlocale(LC_TIME, NULL));
-    setlocale(LC_TIME, "C"); // we want posix (aka "C") weekday/month strings
-    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S +0000", now_gmt);
-    setlocale(LC_TIME, locale.c_str());
+    CRITICAL_BLOCK(cs_rfc1123Time)
+    {
+        struct tm* now_gmt = gmtime(&now);
+        string locale(setlocale(LC_TIME, NULL));
+        setlocale(LC_TIME, "C"); // we want posix (aka "C") weekday/month strings
+        strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S +0000", now_gmt);
+        setlocale(LC_TIME, locale.c_str());
+    }
     return string(buffer);
 }
 
-string HTTPReply(int nStatus, const string& strMsg)
+string HTTPReplyHeader(int nStatus, int nContentLength, bool fKeepAlive)
+{
+    // A negative length means the body follows in chunks
+    string strStatus;
+         if (nStatus == 200) strStatus = "OK";
+    else if (nStatus == 400) strStatus = "Bad Request";
+    else if (nStatus == 404) strStatus = "Not Found";
+    else if (nStatus == 500) strStatus = "Internal Server Error";
+    string strLength = "Transfer-Encoding: chunked\r\n";
+    if (nContentLength >= 0)
+        strLength = strprintf("Content-Length: %d\r\n", nContentLength);
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "Content-Type: application/json\r\n"
+            "Server: devcoin-json-rpc/%s\r\n"
+            "X-Long-Polling: /LP\r\n"
+            "\r\n",
+        nStatus,
+        strStatus.c_str(),
+        rfc1123Time().c_str(),
+        fKeepAlive ? "keep-alive" : "close",
+        strLength.c_str(),
+        FormatFullVersion().c_str());
+}
+
+string HTTPReply(int nStatus, const string& strMsg, bool fKeepAlive=false)
 {
     if (nStatus == 401)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -2003,26 +2414,9 @@ string HTTPReply(int nStatus, const string& strMsg)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    string strStatus;
-         if (nStatus == 200) strStatus = "OK";
-    else if (nStatus == 400) strStatus = "Bad Request";
-    else if (nStatus == 404) strStatus = "Not Found";
-    else if (nStatus == 500) strStatus = "Internal Server Error";
-    return strprintf(
-            "HTTP/1.1 %d %s\r\n"
-            "Date: %s\r\n"
-            "Connection: close\r\n"
-            "Content-Length: %d\r\n"
-            "Content-Type: application/json\r\n"
-            "Server: devcoin-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
-        nStatus,
-        strStatus.c_str(),
-        rfc1123Time().c_str(),
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+
+    // Appended rather than formatted in, so the message is copied only once
+    return HTTPReplyHeader(nStatus, strMsg.size(), fKeepAlive) + strMsg;
 }
 
 int ReadHTTPStatus(std::basic_istream<char>& stream)
@@ -2061,30 +2455,96 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+bool ReadHTTPMessage(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
 {
     mapHeadersRet.clear();
     strMessageRet = "";
 
-    // Read status
-    int nStatus = ReadHTTPStatus(stream);
-
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
     if (nLen < 0 || nLen > MAX_SIZE)
-        return 500;
+        return false;
+
+    // Read chunked message
+    if (mapHeadersRet.count("transfer-encoding") && boost::icontains(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        loop
+        {
+            string str;
+            std::getline(stream, str);
+            int nChunk = strtol(str.c_str(), NULL, 16);
+            if (!stream.good() || nChunk < 0 || strMessageRet.size() + nChunk > MAX_SIZE)
+                return false;
+            if (nChunk == 0)
+                break;
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strMessageRet.append(vch.begin(), vch.begin() + stream.gcount());
+            std::getline(stream, str);
+        }
+
+        // Skip trailer
+        map<string, string> mapTrailer;
+        ReadHTTPHeader(stream, mapTrailer);
+        return true;
+    }
 
     // Read message
     if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
-        strMessageRet = string(vch.begin(), vch.end());
+        strMessageRet = string(vch.begin(), vch.begin() + stream.gcount());
     }
 
+    return true;
+}
+
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+{
+    // Read status
+    int nStatus = ReadHTTPStatus(stream);
+
+    // Read header and message
+    if (!ReadHTTPMessage(stream, mapHeadersRet, strMessageRet))
+        return 500;
+
     return nStatus;
 }
 
+bool ReadHTTPRequest(std::basic_istream<char>& stream, string& strPathRet, map<string, string>& mapHeadersRet, string& strMessageRet, bool& fKeepAliveRet, bool& fChunkedRet)
+{
+    // Read request line, skipping blank lines left between pipelined requests
+    string str;
+    while (str.empty() && stream.good())
+    {
+        std::getline(stream, str);
+        boost::trim(str);
+    }
+    if (!stream.good())
+        return false;
+    vector<string> vWords;
+    boost::split(vWords, str, boost::is_any_of(" "));
+    strPathRet = (vWords.size() >= 2 ? vWords[1] : "/");
+    string strProtocol = (vWords.size() >= 3 ? vWords[2] : "HTTP/1.0");
+
+    // Read header and message
+    if (!ReadHTTPMessage(stream, mapHeadersRet, strMessageRet) || !stream.good())
+        return false;
+
+    // HTTP/1.1 connections persist unless the client asks otherwise
+    string strConnection = mapHeadersRet["connection"];
+    boost::to_lower(strConnection);
+    if (strProtocol == "HTTP/1.1")
+        fKeepAliveRet = (strConnection != "close");
+    else
+        fKeepAliveRet = (strConnection == "keep-alive");
+
+    // Only HTTP/1.1 clients are sure to understand chunked replies
+    fChunkedRet = (strProtocol == "HTTP/1.1");
+    return true;
+}
+
 string EncodeBase64(string s)
 {
     BIO *b64, *bmem;
@@ -2147,6 +2607,27 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
 // http://www.codeproject.com/KB/recipes/JSON_Spirit.aspx
 //
 
+bool ReadJSONSpirit(const string& str, Value& valRet)
+{
+    // The Spirit reader is built without BOOST_SPIRIT_THREADSAFE, so the
+    // RPC worker threads parse one request at a time
+    static CCriticalSection cs_spirit;
+    bool fRet = false;
+    CRITICAL_BLOCK(cs_spirit)
+        fRet = read_string(str, valRet);
+    return fRet;
+}
+
+bool ReadJSON(const string& str, Value& valRet)
+{
+    // The Spirit reader is slower, so it is only used when asked for with
+    // -rpcspiritparser
+    static bool fSpirit = GetBoolArg("-rpcspiritparser");
+    if (!fSpirit)
+        return read_string_fast(str, valRet);
+    return ReadJSONSpirit(str, valRet);
+}
+
 string JSONRPCRequest(const string& strMethod, const Array& params, const Value& id)
 {
     Object request;
@@ -2156,7 +2637,7 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     return write_string(Value(request), false) + "\n";
 }
 
-string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 {
     Object reply;
     if (error.type() != null_type)
@@ -2165,18 +2646,27 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
         reply.push_back(Pair("result", result));
     reply.push_back(Pair("error", error));
     reply.push_back(Pair("id", id));
-    return write_string(Value(reply), false) + "\n";
+    return reply;
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string JSONRPCReply(const Value& result, const Value& error, const Value& id)
+{
+    return write_string(Value(JSONRPCReplyObj(result, error, id)), false) + "\n";
+}
+
+int HTTPStatusFromRPCError(const Object& objError)
 {
-    // Send error reply from json-rpc error object
-    int nStatus = 500;
     int code = find_value(objError, "code").get_int();
-    if (code == -32600) nStatus = 400;
-    else if (code == -32601) nStatus = 404;
+    if (code == -32600) return 400;
+    if (code == -32601) return 404;
+    return 500;
+}
+
+void ErrorReply(std::ostream& stream, const Object& objError, const Value& id, bool fKeepAlive=false)
+{
+    // Send error reply from json-rpc error object
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply) << std::flush;
+    stream << HTTPReply(HTTPStatusFromRPCError(objError), strReply, fKeepAlive) << std::flush;
 }
 
 bool ClientAllowed(const string& strAddress)
@@ -2244,199 +2734,1181 @@ private:
 };
 #endif
 
-void ThreadRPCServer(void* parg)
+//
+// Merged mining
+//
+// With -auxchain=<user>:<password>@<host>:<port>, once for each aux chain,
+// this node does the job of the merged-mine-proxy script.  It keeps a block
+// hash from every aux chain, commits to their merkle tree in the coinbase of
+// the work it hands out through getwork and passes solutions on to each
+// chain they solve.
+//
+
+static const int nAuxUpdateInterval = 5;
+static const unsigned int nAuxMerkleTreesToKeep = 24;
+
+class CAuxChain
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
-    try
+public:
+    string strHost;
+    string strPort;
+    string strUserPass;
+    int nChainID;
+    uint256 hashBlock;
+    uint256 hashTarget;
+
+    CAuxChain()
     {
-        vnThreadsRunning[4]++;
-        ThreadRPCServer2(parg);
-        vnThreadsRunning[4]--;
-    }
-    catch (std::exception& e) {
-        vnThreadsRunning[4]--;
-        PrintException(&e, "ThreadRPCServer()");
-    } catch (...) {
-        vnThreadsRunning[4]--;
-        PrintException(NULL, "ThreadRPCServer()");
+        nChainID = -1;
+        hashBlock = 0;
+        hashTarget = 0;
     }
-    printf("ThreadRPCServer exiting\n");
-}
-
-void ThreadRPCServer2(void* parg)
-{
-    printf("ThreadRPCServer started\n");
 
-    if (mapArgs["-rpcuser"] == "" && mapArgs["-rpcpassword"] == "")
+    bool SetSpec(string strSpec)
     {
-        string strWhatAmI = "To use devcoind";
-        if (mapArgs.count("-server"))
-            strWhatAmI = strprintf(_("To use the %s option"), "\"-server\"");
-        else if (mapArgs.count("-daemon"))
-            strWhatAmI = strprintf(_("To use the %s option"), "\"-daemon\"");
-        PrintConsole(
-            _("Warning: %s, you must set rpcpassword=<password>\nin the configuration file: %s\n"
-              "If the file does not exist, create it with owner-readable-only file permissions.\n"),
-                strWhatAmI.c_str(),
-                GetConfigFile().c_str());
-        CreateThread(Shutdown, NULL);
-        return;
+        if (strSpec.compare(0, 7, "http://") == 0)
+            strSpec = strSpec.substr(7);
+        if (!strSpec.empty() && strSpec[strSpec.size()-1] == '/')
+            strSpec.resize(strSpec.size()-1);
+        string::size_type nAt = strSpec.rfind('@');
+        string::size_type nColon = strSpec.rfind(':');
+        if (nAt == string::npos || nColon == string::npos || nColon < nAt)
+            return false;
+        strUserPass = strSpec.substr(0, nAt);
+        strHost = strSpec.substr(nAt + 1, nColon - nAt - 1);
+        strPort = strSpec.substr(nColon + 1);
+        return !strHost.empty() && !strPort.empty();
     }
 
-    bool fUseSSL = GetBoolArg("-rpcssl");
-    asio::ip::address bindAddress = mapArgs.count("-rpcallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
-
-    asio::io_service io_service;
-    ip::tcp::endpoint endpoint(bindAddress, GetArg("-rpcport", 52332));
-    ip::tcp::acceptor acceptor(io_service, endpoint);
-
-    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-
-#ifdef USE_SSL
-    ssl::context context(io_service, ssl::context::sslv23);
-    if (fUseSSL)
+    string ToString() const
     {
-        context.set_options(ssl::context::no_sslv2);
-        filesystem::path certfile = GetArg("-rpcsslcertificatechainfile", "server.cert");
-        if (!certfile.is_complete()) certfile = filesystem::path(GetDataDir()) / certfile;
-        if (filesystem::exists(certfile)) context.use_certificate_chain_file(certfile.string().c_str());
-        else printf("ThreadRPCServer ERROR: missing server certificate file %s\n", certfile.string().c_str());
-        filesystem::path pkfile = GetArg("-rpcsslprivatekeyfile", "server.pem");
-        if (!pkfile.is_complete()) pkfile = filesystem::path(GetDataDir()) / pkfile;
-        if (filesystem::exists(pkfile)) context.use_private_key_file(pkfile.string().c_str(), ssl::context::pem);
-        else printf("ThreadRPCServer ERROR: missing server private key file %s\n", pkfile.string().c_str());
-
-        string ciphers = GetArg("-rpcsslciphers",
-                                         "TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!AH:!3DES:@STRENGTH");
-        SSL_CTX_set_cipher_list(context.impl(), ciphers.c_str());
+        return strHost + ":" + strPort;
     }
-#else
-    if (fUseSSL)
-        throw runtime_error("-rpcssl=1, but devcoin compiled without full openssl libraries.");
-#endif
 
-    loop
+    Value Call(const string& strMethod, const Array& params) const
     {
-        // Accept connection
-#ifdef USE_SSL
-        SSLStream sslStream(io_service, context);
-        SSLIOStreamDevice d(sslStream, fUseSSL);
-        iostreams::stream<SSLIOStreamDevice> stream(d);
-#else
+        // The deadline covers connecting as well as the whole exchange, so a
+        // hung aux chain can't hold up the others or a miner's getwork
         ip::tcp::iostream stream;
-#endif
-
-        ip::tcp::endpoint peer;
-        vnThreadsRunning[4]--;
-#ifdef USE_SSL
-        acceptor.accept(sslStream.lowest_layer(), peer);
+#if BOOST_VERSION >= 106600
+        stream.expires_from_now(boost::asio::chrono::seconds(GetArg("-auxchaintimeout", 10)));
 #else
-        acceptor.accept(*stream.rdbuf(), peer);
+        stream.expires_from_now(boost::posix_time::seconds(GetArg("-auxchaintimeout", 10)));
 #endif
-        vnThreadsRunning[4]++;
-        if (fShutdown)
-            return;
+        stream.connect(strHost, strPort);
+        if (stream.fail())
+            throw runtime_error("couldn't connect to aux chain " + ToString());
 
-        // Restrict callers by IP
-        if (!ClientAllowed(peer.address().to_string()))
-            continue;
+        map<string, string> mapRequestHeaders;
+        mapRequestHeaders["Authorization"] = string("Basic ") + EncodeBase64(strUserPass);
+        stream << HTTPPost(JSONRPCRequest(strMethod, params, 1), mapRequestHeaders) << std::flush;
 
         map<string, string> mapHeaders;
-        string strRequest;
+        string strReply;
+        int nStatus = ReadHTTP(stream, mapHeaders, strReply);
+        if (nStatus == 401)
+            throw runtime_error("incorrect rpcuser or rpcpassword for aux chain " + ToString());
+        Value valReply;
+        if (strReply.empty() || !ReadJSON(strReply, valReply) || valReply.type() != obj_type)
+            throw runtime_error(strprintf("aux chain %s returned HTTP error %d", ToString().c_str(), nStatus));
+
+        const Object& reply = valReply.get_obj();
+        const Value& error = find_value(reply, "error");
+        if (error.type() != null_type)
+            throw runtime_error("aux chain " + ToString() + " returned error " + write_string(error, false));
+        return find_value(reply, "result");
+    }
+};
 
-        boost::thread api_caller(ReadHTTP, boost::ref(stream), boost::ref(mapHeaders), boost::ref(strRequest));
-        if (!api_caller.timed_join(boost::posix_time::seconds(GetArg("-rpctimeout", 30))))
-        {   // Timed out:
-            acceptor.cancel();
-            printf("ThreadRPCServer ReadHTTP timeout\n");
-            continue;
-        }
+// The chain merkle tree committed to in one piece of work, with what is
+// needed to hand its solutions to the aux chains
+class CAuxMerkleTree
+{
+public:
+    int nSize;
+    vector<uint256> vTree;
+    vector<int> vChainIndex;     // slot of each aux chain, -1 if left out
+    vector<uint256> vHashBlock;
+    vector<uint256> vHashTarget;
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+    uint256 GetRoot() const
+    {
+        return vTree.back();
+    }
+
+    // Merkle root with the bytes reversed, tree size and nonce, as
+    // CAuxPow::Check expects them in the parent coinbase
+    vector<unsigned char> GetAux() const
+    {
+        uint256 hashRoot = GetRoot();
+        vector<unsigned char> vchAux(hashRoot.begin(), hashRoot.end());
+        std::reverse(vchAux.begin(), vchAux.end());
+        int nNonce = 0;
+        for (int i = 0; i < 4; i++)
+            vchAux.push_back((nSize >> (8 * i)) & 0xff);
+        for (int i = 0; i < 4; i++)
+            vchAux.push_back((nNonce >> (8 * i)) & 0xff);
+        return vchAux;
+    }
+
+    vector<uint256> GetBranch(int nIndex) const
+    {
+        vector<uint256> vMerkleBranch;
+        int j = 0;
+        for (int nLevelSize = nSize; nLevelSize > 1; nLevelSize = (nLevelSize + 1) / 2)
         {
-            stream << HTTPReply(401, "") << std::flush;
-            continue;
+            int i = std::min(nIndex^1, nLevelSize-1);
+            vMerkleBranch.push_back(vTree[j+i]);
+            nIndex >>= 1;
+            j += nLevelSize;
         }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            // Deter brute-forcing short passwords
-            if (mapArgs["-rpcpassword"].size() < 15)
-                Sleep(50);
+        return vMerkleBranch;
+    }
+};
 
-            stream << HTTPReply(401, "") << std::flush;
-            printf("ThreadRPCServer incorrect password attempt\n");
-            continue;
-        }
+static CCriticalSection cs_mergedMining;
+static vector<CAuxChain> vAuxChains;
+static map<uint256, CAuxMerkleTree> mapAuxMerkleTree;
+static deque<uint256> queueAuxMerkleRoot;
+static unsigned int nAuxMerkleTreeUpdates = 0;
 
-        Value id = Value::null;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest) || valRequest.type() != obj_type)
-                throw JSONRPCError(-32700, "Parse error");
-            const Object& request = valRequest.get_obj();
-
-            // Parse id now so errors from here on will have the id
-            id = find_value(request, "id");
-
-            // Parse method
-            Value valMethod = find_value(request, "method");
-            if (valMethod.type() == null_type)
-                throw JSONRPCError(-32600, "Missing method");
-            if (valMethod.type() != str_type)
-                throw JSONRPCError(-32600, "Method must be a string");
-            string strMethod = valMethod.get_str();
-            if (strMethod != "getwork")
-                printf("ThreadRPCServer method=%s\n", strMethod.c_str());
-
-            // Parse params
-            Value valParams = find_value(request, "params");
-            Array params;
-            if (valParams.type() == array_type)
-                params = valParams.get_array();
-            else if (valParams.type() == null_type)
-                params = Array();
-            else
-                throw JSONRPCError(-32600, "Params must be an array");
+unsigned int GetAuxMerkleTreeUpdates()
+{
+    CRITICAL_BLOCK(cs_mergedMining)
+        return nAuxMerkleTreeUpdates;
+    return 0;
+}
 
-            // Find method
-            map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
-            if (mi == mapCallTable.end())
-                throw JSONRPCError(-32601, "Method not found");
+// Same slot as CAuxPow::Check picks for a chain, with a nonce of zero
+int GetAuxChainIndex(int nChainID, int nSize)
+{
+    unsigned int rand = 0;
+    rand = rand * 1103515245 + 12345;
+    rand += nChainID;
+    rand = rand * 1103515245 + 12345;
+    return rand % nSize;
+}
+
+bool BuildAuxMerkleTree(const vector<CAuxChain>& vChains, CAuxMerkleTree& tree)
+{
+    vector<int> vChainID;
+    BOOST_FOREACH(const CAuxChain& chain, vChains)
+        if (chain.nChainID != -1)
+            vChainID.push_back(chain.nChainID);
+    if (vChainID.empty())
+        return false;
 
-            // Observe safe mode
-            string strWarning = GetWarnings("rpc");
-            if (strWarning != "" && !GetBoolArg("-disablesafemode") && !setAllowInSafeMode.count(strMethod))
-                throw JSONRPCError(-2, string("Safe mode: ") + strWarning);
+    // Smallest power of two that holds every chain, grown until no two
+    // chains want the same slot unless the size was set by hand
+    int nSize = GetArg("-auxmerklesize", 0);
+    bool fFixedSize = (nSize > 0);
+    if (!fFixedSize)
+        for (nSize = 1; nSize < (int)vChainID.size(); nSize *= 2);
+    loop
+    {
+        set<int> setSlots;
+        BOOST_FOREACH(int nChainID, vChainID)
+            setSlots.insert(GetAuxChainIndex(nChainID, nSize));
+        if (fFixedSize || setSlots.size() == vChainID.size() || nSize >= 256)
+            break;
+        nSize *= 2;
+    }
 
-            try
+    // Unused slots hold their own index
+    vector<uint256> vLeaves;
+    vector<bool> vfUsed(nSize, false);
+    for (int i = 0; i < nSize; i++)
+        vLeaves.push_back(uint256(i));
+
+    tree.nSize = nSize;
+    tree.vChainIndex.clear();
+    tree.vHashBlock.clear();
+    tree.vHashTarget.clear();
+    BOOST_FOREACH(const CAuxChain& chain, vChains)
+    {
+        int nIndex = -1;
+        if (chain.nChainID != -1)
+        {
+            nIndex = GetAuxChainIndex(chain.nChainID, nSize);
+            if (vfUsed[nIndex])
             {
-                // Execute
-                Value result = (*(*mi).second)(params, false);
-
-                // Send reply
-                string strReply = JSONRPCReply(result, Value::null, id);
-                stream << HTTPReply(200, strReply) << std::flush;
+                printf("merged mining: aux chain %s collides with another chain in a merkle tree of size %d\n", chain.ToString().c_str(), nSize);
+                nIndex = -1;
             }
-            catch (std::exception& e)
+            else
             {
-                ErrorReply(stream, JSONRPCError(-1, e.what()), id);
+                vLeaves[nIndex] = chain.hashBlock;
+                vfUsed[nIndex] = true;
             }
         }
-        catch (Object& objError)
+        tree.vChainIndex.push_back(nIndex);
+        tree.vHashBlock.push_back(chain.hashBlock);
+        tree.vHashTarget.push_back(chain.hashTarget);
+    }
+    tree.vTree = BuildChainMerkleTree(vLeaves);
+    return true;
+}
+
+void CallAuxChain(const CAuxChain* pchain, const string* pstrMethod, const Array* pparams, Value* pvalRet, string* pstrErrorRet)
+{
+    try
+    {
+        *pvalRet = pchain->Call(*pstrMethod, *pparams);
+    }
+    catch (std::exception& e)
+    {
+        *pstrErrorRet = e.what();
+    }
+}
+
+// Calls every chain at once so a slow chain doesn't hold up the others
+void CallAuxChains(const vector<CAuxChain>& vChains, const string& strMethod, const vector<Array>& vParams,
+                   vector<Value>& vResultRet, vector<string>& vErrorRet)
+{
+    vResultRet.assign(vChains.size(), Value());
+    vErrorRet.assign(vChains.size(), string());
+    boost::thread_group threads;
+    for (int i = 0; i < vChains.size(); i++)
+        threads.create_thread(boost::bind(&CallAuxChain, &vChains[i], &strMethod, &vParams[i], &vResultRet[i], &vErrorRet[i]));
+    threads.join_all();
+}
+
+void UpdateAuxChains()
+{
+    vector<CAuxChain> vChains;
+    CRITICAL_BLOCK(cs_mergedMining)
+        vChains = vAuxChains;
+
+    vector<Value> vResult;
+    vector<string> vError;
+    CallAuxChains(vChains, "getauxblock", vector<Array>(vChains.size()), vResult, vError);
+
+    for (int i = 0; i < vChains.size(); i++)
+    {
+        try
         {
-            ErrorReply(stream, objError, id);
+            if (!vError[i].empty())
+                throw runtime_error(vError[i]);
+            const Object& auxblock = vResult[i].get_obj();
+            vector<unsigned char> vchTarget = ParseHex(find_value(auxblock, "target").get_str());
+            if (vchTarget.size() != 32)
+                throw runtime_error("invalid target");
+            vChains[i].nChainID = find_value(auxblock, "chainid").get_int();
+            vChains[i].hashBlock.SetHex(find_value(auxblock, "hash").get_str());
+            memcpy(vChains[i].hashTarget.begin(), &vchTarget[0], 32);
         }
         catch (std::exception& e)
         {
-            ErrorReply(stream, JSONRPCError(-32700, e.what()), id);
+            // Keep mining the block we had from this chain
+            printf("merged mining: getauxblock failed for %s: %s\n", vChains[i].ToString().c_str(), e.what());
         }
     }
-}
 
+    CAuxMerkleTree tree;
+    if (!BuildAuxMerkleTree(vChains, tree))
+        return;
+
+    CRITICAL_BLOCK(cs_mergedMining)
+    {
+        vAuxChains = vChains;
+        uint256 hashRoot = tree.GetRoot();
+        if (!mapAuxMerkleTree.count(hashRoot))
+        {
+            mapAuxMerkleTree[hashRoot] = tree;
+            queueAuxMerkleRoot.push_back(hashRoot);
+            nAuxMerkleTreeUpdates++;
+            while (queueAuxMerkleRoot.size() > nAuxMerkleTreesToKeep)
+            {
+                mapAuxMerkleTree.erase(queueAuxMerkleRoot.front());
+                queueAuxMerkleRoot.pop_front();
+            }
+        }
+        else if (queueAuxMerkleRoot.back() != hashRoot)
+        {
+            // Back to a tree we already had, make it current again
+            queueAuxMerkleRoot.erase(std::find(queueAuxMerkleRoot.begin(), queueAuxMerkleRoot.end(), hashRoot));
+            queueAuxMerkleRoot.push_back(hashRoot);
+            nAuxMerkleTreeUpdates++;
+        }
+    }
+}
+
+// Set when ThreadRPCServer2 stops the threads it started, which can happen
+// without a shutdown if its accept loop throws
+static bool fRPCStopping = false;
+
+void ThreadMergedMining()
+{
+    printf("ThreadMergedMining started\n");
+    while (!fShutdown && !fRPCStopping)
+    {
+        try
+        {
+            UpdateAuxChains();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadMergedMining()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadMergedMining()");
+        }
+        for (int i = 0; i < nAuxUpdateInterval && !fShutdown && !fRPCStopping; i++)
+            Sleep(1000);
+    }
+    printf("ThreadMergedMining exiting\n");
+}
+
+Value getworkmerged(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getwork [data]\n"
+            "Merged mining with the chains given by -auxchain.\n"
+            "If [data] is not specified, returns formatted hash data to work on:\n"
+            "  \"midstate\" : precomputed hash state after hashing the first half of the data\n"
+            "  \"data\" : block data\n"
+            "  \"hash1\" : formatted hash buffer for second hash\n"
+            "  \"target\" : little endian hash target, the easiest of this and the aux chains\n"
+            "If [data] is specified, submits it to every chain it solves and returns true if any accepted it.");
+
+    if (params.size() == 0)
+    {
+        vector<unsigned char> vchAux;
+        uint256 hashTarget = 0;
+        CRITICAL_BLOCK(cs_mergedMining)
+        {
+            if (queueAuxMerkleRoot.empty())
+                throw JSONRPCError(-10, "Waiting for blocks from the aux chains...");
+            const CAuxMerkleTree& tree = mapAuxMerkleTree[queueAuxMerkleRoot.back()];
+            vchAux = tree.GetAux();
+            for (int i = 0; i < tree.vChainIndex.size(); i++)
+                if (tree.vChainIndex[i] != -1 && tree.vHashTarget[i] > hashTarget)
+                    hashTarget = tree.vHashTarget[i];
+        }
+
+        Array paramsWork;
+        paramsWork.push_back(HexStr(vchAux.begin(), vchAux.end()));
+        Object result = getworkaux(paramsWork, false).get_obj();
+
+        // Ask for shares that solve any of the chains
+        BOOST_FOREACH(Pair& pair, result)
+        {
+            if (pair.name_ != "target")
+                continue;
+            vector<unsigned char> vchTarget = ParseHex(pair.value_.get_str());
+            uint256 hashParentTarget;
+            memcpy(hashParentTarget.begin(), &vchTarget[0], std::min(vchTarget.size(), (size_t)32));
+            if (hashTarget > hashParentTarget)
+                pair.value_ = HexStr(BEGIN(hashTarget), END(hashTarget));
+        }
+        return result;
+    }
+
+    // Find which tree the solution commits to and its hash
+    Array paramsSolution;
+    paramsSolution.push_back("");
+    paramsSolution.push_back(params[0]);
+    Value valSolution = getworkaux(paramsSolution, false);
+    if (valSolution.type() != obj_type)
+    {
+        printf("merged mining: solution for unknown work\n");
+        return false;
+    }
+    vector<unsigned char> vchAux = ParseHex(find_value(valSolution.get_obj(), "aux").get_str());
+    uint256 hash;
+    hash.SetHex(find_value(valSolution.get_obj(), "hash").get_str());
+    if (vchAux.size() < 32)
+        return false;
+    uint256 hashRoot;
+    std::reverse_copy(vchAux.begin(), vchAux.begin() + 32, hashRoot.begin());
+
+    CAuxMerkleTree tree;
+    vector<CAuxChain> vChains;
+    CRITICAL_BLOCK(cs_mergedMining)
+    {
+        if (mapAuxMerkleTree.count(hashRoot))
+        {
+            tree = mapAuxMerkleTree[hashRoot];
+            vChains = vAuxChains;
+        }
+    }
+    if (tree.vChainIndex.size() != vChains.size())
+        vChains.clear();
+
+    // Build the aux proof of work for each aux chain it solves
+    vector<CAuxChain> vSolved;
+    vector<Array> vParams;
+    for (int i = 0; i < vChains.size(); i++)
+    {
+        int nIndex = tree.vChainIndex[i];
+        if (nIndex == -1 || hash > tree.vHashTarget[i])
+            continue;
+        Array paramsAuxPow = paramsSolution;
+        paramsAuxPow.push_back(nIndex);
+        BOOST_FOREACH(const uint256& hashBranch, tree.GetBranch(nIndex))
+            paramsAuxPow.push_back(hashBranch.GetHex());
+        Value valAuxPow = getworkaux(paramsAuxPow, false);
+        if (valAuxPow.type() != obj_type)
+            continue;
+
+        Array paramsSubmit;
+        paramsSubmit.push_back(tree.vHashBlock[i].GetHex());
+        paramsSubmit.push_back(find_value(valAuxPow.get_obj(), "auxpow"));
+        vSolved.push_back(vChains[i]);
+        vParams.push_back(paramsSubmit);
+    }
+
+    // Submit to the aux chains while this chain checks it
+    vector<Value> vResult(vSolved.size());
+    vector<string> vError(vSolved.size());
+    string strMethod = "getauxblock";
+    boost::thread_group threads;
+    for (int i = 0; i < vSolved.size(); i++)
+        threads.create_thread(boost::bind(&CallAuxChain, &vSolved[i], &strMethod, &vParams[i], &vResult[i], &vError[i]));
+
+    Array paramsSubmit;
+    paramsSubmit.push_back("submit");
+    paramsSubmit.push_back(params[0]);
+    bool fAccepted = false;
+    try
+    {
+        fAccepted = getworkaux(paramsSubmit, false).get_bool();
+    }
+    catch (...)
+    {
+        threads.join_all();
+        throw;
+    }
+    threads.join_all();
+
+    string strAux;
+    for (int i = 0; i < vSolved.size(); i++)
+    {
+        bool fAuxAccepted = (vError[i].empty() && vResult[i].type() == bool_type && vResult[i].get_bool());
+        if (!vError[i].empty())
+            printf("merged mining: submitting to %s failed: %s\n", vSolved[i].ToString().c_str(), vError[i].c_str());
+        strAux += strprintf(" %s=%d", vSolved[i].ToString().c_str(), fAuxAccepted);
+        fAccepted |= fAuxAccepted;
+    }
+    printf("merged mining: solve hash=%s parent=%d%s\n", hash.GetHex().c_str(), fAccepted, strAux.c_str());
+    return fAccepted;
+}
+
+// Called before the RPC threads start, so getwork can be swapped without
+// locking the call table
+bool StartMergedMining()
+{
+    if (mapMultiArgs["-auxchain"].empty())
+        return false;
+    BOOST_FOREACH(const string& strSpec, mapMultiArgs["-auxchain"])
+    {
+        CAuxChain chain;
+        if (!chain.SetSpec(strSpec))
+        {
+            printf("merged mining: -auxchain=%s is not <user>:<password>@<host>:<port>\n", strSpec.c_str());
+            continue;
+        }
+        vAuxChains.push_back(chain);
+    }
+    if (vAuxChains.empty())
+        return false;
+    mapCallTable["getwork"] = &getworkmerged;
+    printf("merged mining with %d aux chains\n", (int)vAuxChains.size());
+    return true;
+}
+
+void ThreadRPCServer(void* parg)
+{
+    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer(parg));
+    try
+    {
+        vnThreadsRunning[4]++;
+        ThreadRPCServer2(parg);
+        vnThreadsRunning[4]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[4]--;
+        PrintException(&e, "ThreadRPCServer()");
+    } catch (...) {
+        vnThreadsRunning[4]--;
+        PrintException(NULL, "ThreadRPCServer()");
+    }
+    printf("ThreadRPCServer exiting\n");
+}
+
+//
+// Accepted connections are served by a pool of -rpcthreads workers.  A worker
+// keeps reading requests from its connection for as long as the client keeps
+// it alive, so pipelined requests are answered in order.
+//
+class CRPCConnection
+{
+public:
+#ifdef USE_SSL
+    SSLStream sslStream;
+    SSLIOStreamDevice d;
+    iostreams::stream<SSLIOStreamDevice> stream;
+#else
+    ip::tcp::iostream stream;
+#endif
+    ip::tcp::endpoint peer;
+    int64 nLastActive;
+    bool fBusy;
+    bool fIdle;     // kept alive, its worker waiting for the next request
+    bool fClosed;
+
+    // A long polling request waiting for new work
+    string strLongPollRequest;
+    bool fLongPollKeepAlive;
+    bool fLongPollChunked;
+    bool fLongPollReady;
+    uint256 hashLongPollBestChain;
+    unsigned int nLongPollAuxUpdates;
+    int64 nLongPollStart;
+
+#ifdef USE_SSL
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSL) : sslStream(io_service, context), d(sslStream, fUseSSL), stream(d)
+#else
+    CRPCConnection()
+#endif
+    {
+        nLastActive = GetTime();
+        fBusy = true;
+        fIdle = false;
+        fClosed = false;
+        fLongPollKeepAlive = false;
+        fLongPollChunked = false;
+        fLongPollReady = false;
+        hashLongPollBestChain = 0;
+        nLongPollAuxUpdates = 0;
+        nLongPollStart = 0;
+    }
+
+    void Close()
+    {
+        // Unblocks a worker waiting to read from this connection
+        fClosed = true;
+        boost::system::error_code error;
+#ifdef USE_SSL
+        sslStream.lowest_layer().shutdown(ip::tcp::socket::shutdown_both, error);
+#else
+        stream.rdbuf()->shutdown(ip::tcp::socket::shutdown_both, error);
+#endif
+    }
+};
+
+static boost::mutex mutexRPCConnections;
+static boost::condition_variable condRPCConnections;
+static deque<CRPCConnection*> queueRPCConnections;
+static set<CRPCConnection*> setRPCConnections;
+static list<CRPCConnection*> listLongPoll;
+static int nRPCWorkersFree = 0;
+
+// requires mutexRPCConnections
+void CloseIdleRPCConnections()
+{
+    // A kept-alive connection holds on to its worker between requests, so
+    // with connections waiting and no worker free, the longest idle ones
+    // are closed.  Their clients reconnect for their next request.
+    int nWaiting = (int)queueRPCConnections.size() - nRPCWorkersFree;
+    while (nWaiting-- > 0)
+    {
+        CRPCConnection* pidle = NULL;
+        BOOST_FOREACH(CRPCConnection* pconn, setRPCConnections)
+            if (pconn->fIdle && !pconn->fClosed && (!pidle || pconn->nLastActive < pidle->nLastActive))
+                pidle = pconn;
+        if (!pidle)
+            break;
+        pidle->Close();
+    }
+}
+
+//
+// The parts of one call's reply are kept apart rather than put together in
+// an Object, so a large result is never copied just to be written out.
+//
+class CRPCReply
+{
+public:
+    Value result;
+    Value error;
+    Value id;
+};
+
+void WriteJSONRPCReply(std::ostream& os, const CRPCReply& reply)
+{
+    // Same layout as write_string of a JSONRPCReplyObj
+    os << "{\"result\":";
+    write_stream(reply.error.type() == null_type ? reply.result : Value::null, os, false);
+    os << ",\"error\":";
+    write_stream(reply.error, os, false);
+    os << ",\"id\":";
+    write_stream(reply.id, os, false);
+    os << "}";
+}
+
+void WriteJSONRPCReplies(std::ostream& os, const vector<CRPCReply>& vReply, bool fBatch)
+{
+    if (fBatch)
+        os << "[";
+    for (unsigned int i = 0; i < vReply.size(); i++)
+    {
+        if (i > 0)
+            os << ",";
+        WriteJSONRPCReply(os, vReply[i]);
+    }
+    if (fBatch)
+        os << "]";
+    os << "\n";
+}
+
+//
+// Output device that writes an HTTP/1.1 chunk for every buffer full
+//
+class HTTPChunkedDevice : public iostreams::sink
+{
+public:
+    HTTPChunkedDevice(std::ostream& streamIn) : stream(streamIn) {}
+
+    std::streamsize write(const char* s, std::streamsize n)
+    {
+        // A zero length chunk would end the message
+        if (n > 0)
+        {
+            stream << strprintf("%x\r\n", (unsigned int)n);
+            stream.write(s, n);
+            stream << "\r\n";
+        }
+        return n;
+    }
+
+private:
+    std::ostream& stream;
+};
+
+string GetRPCMethod(const Value& valRequest)
+{
+    if (valRequest.type() != obj_type)
+        return "";
+    const Value& valMethod = find_value(valRequest.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return "";
+    return valMethod.get_str();
+}
+
+void ExecuteRPCCall(const Value& valRequest, CRPCReply& reply)
+{
+    Value& id = reply.id;
+    try
+    {
+        if (valRequest.type() != obj_type)
+            throw JSONRPCError(-32600, "Request must be an object");
+        const Object& request = valRequest.get_obj();
+
+        // Parse id now so errors from here on will have the id
+        id = find_value(request, "id");
+
+        // Parse method
+        Value valMethod = find_value(request, "method");
+        if (valMethod.type() == null_type)
+            throw JSONRPCError(-32600, "Missing method");
+        if (valMethod.type() != str_type)
+            throw JSONRPCError(-32600, "Method must be a string");
+        string strMethod = valMethod.get_str();
+        if (strMethod != "getwork")
+            printf("ThreadRPCServer method=%s\n", strMethod.c_str());
+
+        // Parse params
+        Value valParams = find_value(request, "params");
+        Array params;
+        if (valParams.type() == array_type)
+            params = valParams.get_array();
+        else if (valParams.type() == null_type)
+            params = Array();
+        else
+            throw JSONRPCError(-32600, "Params must be an array");
+
+        // Find method
+        map<string, rpcfn_type>::iterator mi = mapCallTable.find(strMethod);
+        if (mi == mapCallTable.end())
+            throw JSONRPCError(-32601, "Method not found");
+
+        // Observe safe mode
+        string strWarning = GetWarnings("rpc");
+        if (strWarning != "" && !GetBoolArg("-disablesafemode") && !setAllowInSafeMode.count(strMethod))
+            throw JSONRPCError(-2, string("Safe mode: ") + strWarning);
+
+        try
+        {
+            // Execute
+            reply.result = (*(*mi).second)(params, false);
+        }
+        catch (std::exception& e)
+        {
+            reply.error = JSONRPCError(-1, e.what());
+        }
+    }
+    catch (Object& objError)
+    {
+        reply.error = objError;
+    }
+    catch (std::exception& e)
+    {
+        reply.error = JSONRPCError(-32700, e.what());
+    }
+}
+
+bool IsConcurrentInBatch(const Value& valRequest)
+{
+    return setConcurrentInBatch.count(GetRPCMethod(valRequest)) > 0;
+}
+
+void ExecuteRPCBatchRange(const Array* pvRequest, vector<CRPCReply>* pvReply, unsigned int* pnNext, unsigned int nEnd, boost::mutex* pmutex)
+{
+    loop
+    {
+        unsigned int i;
+        {
+            boost::unique_lock<boost::mutex> lock(*pmutex);
+            if (*pnNext >= nEnd)
+                return;
+            i = (*pnNext)++;
+        }
+        ExecuteRPCCall((*pvRequest)[i], (*pvReply)[i]);
+    }
+}
 
+void ExecuteRPCBatch(const Array& vRequest, vector<CRPCReply>& vReply)
+{
+    int nThreads = max(1, (int)GetArg("-rpcthreads", 4));
+    vReply.resize(vRequest.size());
+    unsigned int i = 0;
+    while (i < vRequest.size())
+    {
+        // Find the run of calls starting here that may execute side by side
+        unsigned int nEnd = i + 1;
+        if (IsConcurrentInBatch(vRequest[i]))
+            while (nEnd < vRequest.size() && IsConcurrentInBatch(vRequest[nEnd]))
+                nEnd++;
+
+        unsigned int nNext = i;
+        boost::mutex mutex;
+        int nHelpers = min(nThreads, (int)(nEnd - i)) - 1;
+        boost::thread_group threads;
+        for (int j = 0; j < nHelpers; j++)
+            threads.create_thread(boost::bind(&ExecuteRPCBatchRange, &vRequest, &vReply, &nNext, nEnd, &mutex));
+        ExecuteRPCBatchRange(&vRequest, &vReply, &nNext, nEnd, &mutex);
+        threads.join_all();
+
+        i = nEnd;
+    }
+}
+
+void ExecuteRPCRequest(std::ostream& stream, const string& strRequest, bool fKeepAlive, bool fChunked)
+{
+    // Parse request
+    Value valRequest;
+    if (!ReadJSON(strRequest, valRequest) || (valRequest.type() != obj_type && valRequest.type() != array_type))
+    {
+        ErrorReply(stream, JSONRPCError(-32700, "Parse error"), Value::null, fKeepAlive);
+        return;
+    }
+
+    vector<CRPCReply> vReply;
+    bool fBatch = (valRequest.type() == array_type);
+    int nStatus = 200;
+    bool fStream = false;
+    if (!fBatch)
+    {
+        vReply.resize(1);
+        ExecuteRPCCall(valRequest, vReply[0]);
+        if (vReply[0].error.type() == obj_type)
+            nStatus = HTTPStatusFromRPCError(vReply[0].error.get_obj());
+        fStream = (nStatus == 200 && setStreamedReply.count(GetRPCMethod(valRequest)));
+    }
+    else
+    {
+        // A batch is an array of requests, answered with an array of replies
+        const Array& vRequest = valRequest.get_array();
+        if (vRequest.empty())
+        {
+            ErrorReply(stream, JSONRPCError(-32600, "Empty batch"), Value::null, fKeepAlive);
+            return;
+        }
+        printf("ThreadRPCServer batch of %d requests\n", (int)vRequest.size());
+        ExecuteRPCBatch(vRequest, vReply);
+        fStream = true;
+    }
+
+    if (fStream && fChunked)
+    {
+        stream << HTTPReplyHeader(nStatus, -1, fKeepAlive);
+        {
+            iostreams::stream<HTTPChunkedDevice> chunked(HTTPChunkedDevice(stream), 65536);
+            WriteJSONRPCReplies(chunked, vReply, fBatch);
+            chunked.flush();
+        }
+        stream << "0\r\n\r\n" << std::flush;
+    }
+    else
+    {
+        ostringstream ss;
+        WriteJSONRPCReplies(ss, vReply, fBatch);
+        stream << HTTPReply(nStatus, ss.str(), fKeepAlive) << std::flush;
+    }
+}
+
+// Returns true if the connection was put aside for long polling, in which
+// case it is handed back to a worker later and must not be deleted
+bool ServeRPCConnection(CRPCConnection* pconn)
+{
+    std::iostream& stream = pconn->stream;
+    loop
+    {
+        string strPath;
+        map<string, string> mapHeaders;
+        string strRequest;
+        bool fKeepAlive = false;
+        bool fChunked = false;
+        bool fLongPollReady = pconn->fLongPollReady;
+        if (fLongPollReady)
+        {
+            // Back from waiting for new work, run the request it came with
+            pconn->fLongPollReady = false;
+            strRequest.swap(pconn->strLongPollRequest);
+            fKeepAlive = pconn->fLongPollKeepAlive;
+            fChunked = pconn->fLongPollChunked;
+        }
+        else if (!ReadHTTPRequest(stream, strPath, mapHeaders, strRequest, fKeepAlive, fChunked))
+            return false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            if (pconn->fClosed)
+                return false;
+            pconn->fBusy = true;
+            pconn->fIdle = false;
+        }
+
+        if (!fLongPollReady)
+        {
+            // Check authorization
+            if (mapHeaders.count("authorization") == 0)
+            {
+                stream << HTTPReply(401, "") << std::flush;
+                return false;
+            }
+            if (!HTTPAuthorized(mapHeaders))
+            {
+                // Deter brute-forcing short passwords
+                if (mapArgs["-rpcpassword"].size() < 15)
+                    Sleep(50);
+
+                stream << HTTPReply(401, "") << std::flush;
+                printf("ThreadRPCServer incorrect password attempt\n");
+                return false;
+            }
+
+            // Requests to the long polling path wait for a new best block,
+            // or new aux chain blocks, without holding on to a worker
+            if (strPath.compare(0, 3, "/LP") == 0)
+            {
+                CChainSnapshotRef psnapshot = GetChainSnapshot();
+                unsigned int nAuxUpdates = GetAuxMerkleTreeUpdates();
+                boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+                if (pconn->fClosed)
+                    return false;
+                pconn->strLongPollRequest.swap(strRequest);
+                pconn->fLongPollKeepAlive = fKeepAlive;
+                pconn->fLongPollChunked = fChunked;
+                pconn->hashLongPollBestChain = psnapshot->hashBestChain;
+                pconn->nLongPollAuxUpdates = nAuxUpdates;
+                pconn->nLongPollStart = GetTimeMillis();
+                listLongPoll.push_back(pconn);
+                return true;
+            }
+        }
+
+        // Give up the worker after this reply if other clients are waiting
+        // for one and this client hasn't already pipelined its next request
+        if (fKeepAlive && stream.rdbuf()->in_avail() <= 0)
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            if (!queueRPCConnections.empty())
+                fKeepAlive = false;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            vnThreadsRunning[4]++;
+        }
+        ExecuteRPCRequest(stream, strRequest, fKeepAlive, fChunked);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            vnThreadsRunning[4]--;
+            if (!fKeepAlive || !stream || fShutdown)
+                return false;
+            pconn->fBusy = false;
+            pconn->fIdle = true;
+            pconn->nLastActive = GetTime();
+            CloseIdleRPCConnections();
+        }
+    }
+}
+
+void ThreadRPCWorker()
+{
+    loop
+    {
+        CRPCConnection* pconn = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            nRPCWorkersFree++;
+            while (queueRPCConnections.empty() && !fShutdown && !fRPCStopping)
+                condRPCConnections.timed_wait(lock, boost::posix_time::seconds(1));
+            nRPCWorkersFree--;
+            if (fShutdown || fRPCStopping)
+                return;
+            pconn = queueRPCConnections.front();
+            queueRPCConnections.pop_front();
+            pconn->fBusy = false;
+            pconn->nLastActive = GetTime();
+        }
+
+        bool fLongPoll = false;
+        try
+        {
+            fLongPoll = ServeRPCConnection(pconn);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCWorker()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCWorker()");
+        }
+        if (fLongPoll)
+            continue;
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            setRPCConnections.erase(pconn);
+        }
+        delete pconn;
+    }
+}
+
+void ThreadRPCTimeout()
+{
+    // Close connections whose client has sent no complete request within
+    // -rpctimeout seconds, whether it is a new or a kept-alive connection
+    int64 nTimeout = GetArg("-rpctimeout", 30);
+    while (!fShutdown && !fRPCStopping)
+    {
+        Sleep(1000);
+        boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+        int64 nNow = GetTime();
+        BOOST_FOREACH(CRPCConnection* pconn, setRPCConnections)
+        {
+            if (!pconn->fBusy && !pconn->fClosed && nNow - pconn->nLastActive > nTimeout)
+            {
+                printf("ThreadRPCServer ReadHTTP timeout\n");
+                pconn->Close();
+            }
+        }
+        CloseIdleRPCConnections();
+    }
+}
+
+void ThreadRPCLongPoll()
+{
+    // Hands long polling requests back to the workers as soon as a new best
+    // block is published, or after -rpclongpolltimeout seconds
+    int64 nTimeout = GetArg("-rpclongpolltimeout", 60) * 1000;
+    uint256 hashBestChain = GetChainSnapshot()->hashBestChain;
+    while (!fShutdown && !fRPCStopping)
+    {
+        // New aux chain blocks are only noticed once a second, they
+        // arrive every few seconds at most anyway
+        CChainSnapshotRef psnapshot = WaitForChainSnapshot(hashBestChain, 1000);
+        hashBestChain = psnapshot->hashBestChain;
+        unsigned int nAuxUpdates = GetAuxMerkleTreeUpdates();
+        int64 nNow = GetTimeMillis();
+
+        boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+        int nReleased = 0;
+        list<CRPCConnection*>::iterator it = listLongPoll.begin();
+        while (it != listLongPoll.end())
+        {
+            CRPCConnection* pconn = *it;
+            if (pconn->hashLongPollBestChain == hashBestChain &&
+                pconn->nLongPollAuxUpdates == nAuxUpdates &&
+                nNow - pconn->nLongPollStart < nTimeout && !pconn->fClosed)
+            {
+                it++;
+                continue;
+            }
+            // Ahead of new connections, their miners are on stale work
+            pconn->fLongPollReady = true;
+            queueRPCConnections.push_front(pconn);
+            listLongPoll.erase(it++);
+            nReleased++;
+        }
+        if (nReleased > 0)
+        {
+            condRPCConnections.notify_all();
+            if (fDebug)
+                printf("ThreadRPCLongPoll released %d requests\n", nReleased);
+        }
+    }
+}
+
+void StopRPCThreads(boost::thread_group& threads)
+{
+    // The connections refer to ThreadRPCServer2's io_service and context,
+    // so no thread may still be using one when those go out of scope.
+    // Workers delete the connections they are serving when their reads
+    // fail, the queued and long polling ones are left for here.
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+        fRPCStopping = true;
+        BOOST_FOREACH(CRPCConnection* pconn, setRPCConnections)
+            pconn->Close();
+        condRPCConnections.notify_all();
+    }
+    threads.join_all();
+
+    boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+    BOOST_FOREACH(CRPCConnection* pconn, setRPCConnections)
+        delete pconn;
+    setRPCConnections.clear();
+    queueRPCConnections.clear();
+    listLongPoll.clear();
+}
+
+void ThreadRPCServer2(void* parg)
+{
+    printf("ThreadRPCServer started\n");
+
+    if (mapArgs["-rpcuser"] == "" && mapArgs["-rpcpassword"] == "")
+    {
+        string strWhatAmI = "To use devcoind";
+        if (mapArgs.count("-server"))
+            strWhatAmI = strprintf(_("To use the %s option"), "\"-server\"");
+        else if (mapArgs.count("-daemon"))
+            strWhatAmI = strprintf(_("To use the %s option"), "\"-daemon\"");
+        PrintConsole(
+            _("Warning: %s, you must set rpcpassword=<password>\nin the configuration file: %s\n"
+              "If the file does not exist, create it with owner-readable-only file permissions.\n"),
+                strWhatAmI.c_str(),
+                GetConfigFile().c_str());
+        CreateThread(Shutdown, NULL);
+        return;
+    }
+
+    bool fUseSSL = GetBoolArg("-rpcssl");
+    asio::ip::address bindAddress = mapArgs.count("-rpcallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
+
+    asio::io_service io_service;
+    ip::tcp::endpoint endpoint(bindAddress, GetArg("-rpcport", 52332));
+    ip::tcp::acceptor acceptor(io_service, endpoint);
+
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+
+#ifdef USE_SSL
+    ssl::context context(io_service, ssl::context::sslv23);
+    if (fUseSSL)
+    {
+        context.set_options(ssl::context::no_sslv2);
+        filesystem::path certfile = GetArg("-rpcsslcertificatechainfile", "server.cert");
+        if (!certfile.is_complete()) certfile = filesystem::path(GetDataDir()) / certfile;
+        if (filesystem::exists(certfile)) context.use_certificate_chain_file(certfile.string().c_str());
+        else printf("ThreadRPCServer ERROR: missing server certificate file %s\n", certfile.string().c_str());
+        filesystem::path pkfile = GetArg("-rpcsslprivatekeyfile", "server.pem");
+        if (!pkfile.is_complete()) pkfile = filesystem::path(GetDataDir()) / pkfile;
+        if (filesystem::exists(pkfile)) context.use_private_key_file(pkfile.string().c_str(), ssl::context::pem);
+        else printf("ThreadRPCServer ERROR: missing server private key file %s\n", pkfile.string().c_str());
+
+        string ciphers = GetArg("-rpcsslciphers",
+                                         "TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!AH:!3DES:@STRENGTH");
+        SSL_CTX_set_cipher_list(context.impl(), ciphers.c_str());
+    }
+#else
+    if (fUseSSL)
+        throw runtime_error("-rpcssl=1, but devcoin compiled without full openssl libraries.");
+#endif
+
+    bool fMergedMining = StartMergedMining();
+    int nThreads = max(1, (int)GetArg("-rpcthreads", 4));
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(&ThreadRPCWorker);
+    threads.create_thread(&ThreadRPCTimeout);
+    threads.create_thread(&ThreadRPCLongPoll);
+    printf("ThreadRPCServer using %d worker threads\n", nThreads);
+    if (fMergedMining)
+        threads.create_thread(&ThreadMergedMining);
+
+    try
+    {
+        loop
+        {
+            // Accept connection
+#ifdef USE_SSL
+            CRPCConnection* pconn = new CRPCConnection(io_service, context, fUseSSL);
+#else
+            CRPCConnection* pconn = new CRPCConnection();
+#endif
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+                vnThreadsRunning[4]--;
+            }
+            bool fAllowed = false;
+            try
+            {
+#ifdef USE_SSL
+                acceptor.accept(pconn->sslStream.lowest_layer(), pconn->peer);
+#else
+                acceptor.accept(*pconn->stream.rdbuf(), pconn->peer);
+#endif
+                fAllowed = ClientAllowed(pconn->peer.address().to_string());
+            }
+            catch (...)
+            {
+                delete pconn;
+                boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+                vnThreadsRunning[4]++;
+                throw;
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+                vnThreadsRunning[4]++;
+            }
+            if (fShutdown)
+            {
+                delete pconn;
+                break;
+            }
+
+            // Restrict callers by IP
+            if (!fAllowed)
+            {
+                delete pconn;
+                continue;
+            }
+
+            // Queue for the next free worker
+            boost::unique_lock<boost::mutex> lock(mutexRPCConnections);
+            setRPCConnections.insert(pconn);
+            queueRPCConnections.push_back(pconn);
+            condRPCConnections.notify_one();
+            CloseIdleRPCConnections();
+        }
+    }
+    catch (...)
+    {
+        StopRPCThreads(threads);
+        throw;
+    }
+    StopRPCThreads(threads);
+}
 
 
 Object CallRPC(const string& strMethod, const Array& params)
@@ -2491,7 +3963,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -2510,7 +3982,7 @@ void ConvertTo(Value& value)
     {
         // reinterpret string as unquoted json value
         Value value2;
-        if (!read_string(value.get_str(), value2))
+        if (!ReadJSON(value.get_str(), value2))
             throw runtime_error("type mismatch");
         value = value2.get_value<T>();
     }
@@ -2570,6 +4042,10 @@ int CommandLineRPC(int argc, char *argv[])
         if (strMethod == "sendfrom"               && n > 3) ConvertTo<boost::int64_t>(params[3]);
         if (strMethod == "listtransactions"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
         if (strMethod == "listtransactions"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "listtransactionspage"   && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
+        if (strMethod == "sendpayouts"            && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "sendpayouts"            && n > 3) ConvertTo<boost::int64_t>(params[3]);
         if (strMethod == "getworkaux"             && n > 2) ConvertTo<boost::int64_t>(params[2]);
         if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
 	if (strMethod == "getblockbycount"        && n > 0) ConvertTo<boost::int64_t>(params[0]);
@@ -2577,11 +4053,22 @@ int CommandLineRPC(int argc, char *argv[])
         {
             string s = params[1].get_str();
             Value v;
-            if (!read_string(s, v) || v.type() != obj_type)
+            if (!ReadJSON(s, v) || v.type() != obj_type)
                 throw runtime_error("type mismatch");
             params[1] = v.get_obj();
         }
         if (strMethod == "sendmany"                && n > 2) ConvertTo<boost::int64_t>(params[2]);
+        if (strMethod == "sendpayouts"            && n > 1 && params[1].get_str().substr(0, 1) == "{")
+        {
+            Value v;
+            if (!ReadJSON(params[1].get_str(), v) || v.type() != obj_type)
+                throw runtime_error("type mismatch");
+            params[1] = v.get_obj();
+        }
+        if (strMethod == "sweepwallet"            && n > 0) ConvertTo<double>(params[0]);
+        if (strMethod == "sweepwallet"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
+        if (strMethod == "sweepwallet"            && n > 2) ConvertTo<bool>(params[2]);
+        if (strMethod == "getsweepinfo"           && n > 0) ConvertTo<double>(params[0]);
 
         // Execute
         Object reply = CallRPC(strMethod, params);
@@ -1029,30 +1029,23 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
     if (!Solver(scriptPubKey, vSolution))
         return false;
 
-    // Compile solution
+    // Look up the keys, then sign outside cs_mapKeys so signers on other
+    // threads don't wait on each other
+    vector<pair<CPrivKey, valtype> > vKeys; // private key, pubkey to give or empty
     CRITICAL_BLOCK(keystore.cs_mapKeys)
     {
         BOOST_FOREACH(PAIRTYPE(opcodetype, valtype)& item, vSolution)
         {
             if (item.first == OP_PUBKEY)
             {
-                // Sign
                 const valtype& vchPubKey = item.second;
                 CPrivKey privkey;
                 if (!keystore.GetPrivKey(vchPubKey, privkey))
                     return false;
-                if (hash != 0)
-                {
-                    vector<unsigned char> vchSig;
-                    if (!CKey::Sign(privkey, hash, vchSig))
-                        return false;
-                    vchSig.push_back((unsigned char)nHashType);
-                    scriptSigRet << vchSig;
-                }
+                vKeys.push_back(make_pair(privkey, valtype()));
             }
             else if (item.first == OP_PUBKEYHASH)
             {
-                // Sign and give pubkey
                 map<uint160, valtype>::iterator mi = mapPubKeys.find(uint160(item.second));
                 if (mi == mapPubKeys.end())
                     return false;
@@ -1060,14 +1053,7 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
                 CPrivKey privkey;
                 if (!keystore.GetPrivKey(vchPubKey, privkey))
                     return false;
-                if (hash != 0)
-                {
-                    vector<unsigned char> vchSig;
-                    if (!CKey::Sign(privkey, hash, vchSig))
-                        return false;
-                    vchSig.push_back((unsigned char)nHashType);
-                    scriptSigRet << vchSig << vchPubKey;
-                }
+                vKeys.push_back(make_pair(privkey, vchPubKey));
             }
             else
             {
@@ -1076,6 +1062,22 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
         }
     }
 
+    // Compile solution
+    if (hash != 0)
+    {
+        BOOST_FOREACH(const PAIRTYPE(CPrivKey, valtype)& item, vKeys)
+        {
+            // Sign, and give the pubkey for OP_PUBKEYHASH
+            vector<unsigned char> vchSig;
+            if (!CKey::Sign(item.first, hash, vchSig))
+                return false;
+            vchSig.push_back((unsigned char)nHashType);
+            scriptSigRet << vchSig;
+            if (!item.second.empty())
+                scriptSigRet << item.second;
+        }
+    }
+
     return true;
 }
 
@@ -33,7 +33,7 @@ class CDataStream;
 class CAutoFile;
 static const unsigned int MAX_SIZE = 0x02000000;
 
-static const int VERSION = 32300;
+static const int VERSION = 32301;
 static const char* pszSubVer = "";
 static const bool VERSION_IS_BETA = true;
 
@@ -966,6 +966,13 @@ public:
             return vch.erase(first, last);
     }
 
+    void swap(CDataStream& b)
+    {
+        // Exchanges contents only, type and version stay with each stream
+        vch.swap(b.vch);
+        std::swap(nReadPos, b.nReadPos);
+    }
+
     inline void Compact()
     {
         vch.erase(vch.begin(), vch.begin() + nReadPos);
@@ -0,0 +1,395 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Checks the -auxchain merged mining client in rpc.cpp against stand-in aux
+// chain daemons served from this program, on a one block testnet chain in a
+// scratch data directory.
+//
+// Each stand-in answers getauxblock with a block hash, chain ID and target
+// of its own, and checks the aux proof of work it is handed for that block
+// the way an aux chain would, with CAuxPow::Check and its target.  One of
+// the -auxchain entries has nothing listening and one never replies.
+//
+// Fetching blocks must fill in the chains that answered, leave the others
+// out of the chain merkle tree and take no longer than -auxchaintimeout.
+// getwork must commit to the tree and ask for the easiest target, and a
+// solution must reach only the chains it solves, as a valid proof of work
+// for the block each one handed out.  A chain that stops answering keeps
+// its last block in the tree, and submitting to it fails within the
+// timeout without taking the other chains' submits with it.
+//
+// Prints the failures found and the number of cases tried.
+//
+//   g++ -I.. -I../json -I../cryptopp auxchain_check.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../rpc.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o auxchain_check -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   auxchain_check [scratch data directory, default auxchain_check.tmp]
+//
+#include "headers.h"
+#include "db.h"
+#include "net.h"
+#include "auxpow.h"
+#include "strlcpy.h"
+#undef printf
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+#define printf OutputDebugStringF
+
+using namespace std;
+using namespace boost::asio;
+using namespace json_spirit;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+// From rpc.cpp
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet);
+string HTTPReply(int nStatus, const string& strMsg, bool fKeepAlive);
+string JSONRPCReply(const Value& result, const Value& error, const Value& id);
+string EncodeBase64(string s);
+bool StartMergedMining();
+void UpdateAuxChains();
+unsigned int GetAuxMerkleTreeUpdates();
+Value getworkmerged(const Array& params, bool fHelp);
+
+int nCases = 0;
+int nFailed = 0;
+
+void Check(bool fOk, const string& strWhat)
+{
+    nCases++;
+    if (!fOk)
+    {
+        // The node's own logging stays in debug.log
+        fPrintToConsole = true;
+        printf("FAILED: %s\n", strWhat.c_str());
+        fPrintToConsole = false;
+        nFailed++;
+    }
+}
+
+enum
+{
+    AUX_UP,
+    AUX_HANG,       // reads the request and never replies
+    AUX_DOWN,       // drops the connection without a reply
+};
+
+// An aux chain daemon answering getauxblock on a port of its own
+class CAuxDaemon
+{
+public:
+    int nChainID;
+    uint256 hashBlock;
+    uint256 hashTarget;
+    int nMode;
+    int nPort;
+
+    CCriticalSection cs;
+    int nGetCalls;
+    int nSubmits;
+    int nGoodSubmits;
+    string strLastError;
+
+    io_service ioService;
+    ip::tcp::acceptor acceptor;
+
+    CAuxDaemon(int nChainIDIn, uint256 hashTargetIn) : acceptor(ioService)
+    {
+        nChainID = nChainIDIn;
+        hashBlock = Hash(BEGIN(nChainID), END(nChainID));
+        hashTarget = hashTargetIn;
+        nMode = AUX_UP;
+        nGetCalls = 0;
+        nSubmits = 0;
+        nGoodSubmits = 0;
+
+        ip::tcp::endpoint endpoint(ip::address_v4::loopback(), 0);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        nPort = acceptor.local_endpoint().port();
+        boost::thread(boost::bind(&CAuxDaemon::ThreadAccept, this));
+    }
+
+    string GetSpec() const
+    {
+        return strprintf("aux:secret@127.0.0.1:%d", nPort);
+    }
+
+    void ThreadAccept()
+    {
+        loop
+        {
+            ip::tcp::iostream* pstream = new ip::tcp::iostream();
+            boost::system::error_code ec;
+            acceptor.accept(*pstream->rdbuf(), ec);
+            if (ec)
+            {
+                delete pstream;
+                return;
+            }
+            boost::thread(boost::bind(&CAuxDaemon::ThreadServe, this, pstream));
+        }
+    }
+
+    void ThreadServe(ip::tcp::iostream* pstream)
+    {
+        map<string, string> mapHeaders;
+        string strRequest;
+        ReadHTTP(*pstream, mapHeaders, strRequest);
+
+        int nModeNow;
+        CRITICAL_BLOCK(cs)
+            nModeNow = nMode;
+        if (nModeNow == AUX_HANG)
+            Sleep((GetArg("-auxchaintimeout", 10) + 5) * 1000);
+        if (nModeNow != AUX_UP)
+        {
+            delete pstream;
+            return;
+        }
+
+        Value valReply;
+        if (mapHeaders["authorization"] != "Basic " + EncodeBase64("aux:secret"))
+        {
+            *pstream << HTTPReply(401, "", false) << std::flush;
+            delete pstream;
+            return;
+        }
+        Value valRequest;
+        if (read_string(strRequest, valRequest) && valRequest.type() == obj_type)
+        {
+            const Object& request = valRequest.get_obj();
+            Value valParams = find_value(request, "params");
+            Array params;
+            if (valParams.type() == array_type)
+                params = valParams.get_array();
+            if (find_value(request, "method").get_str() == "getauxblock" && params.empty())
+                valReply = GetAuxBlock();
+            else if (find_value(request, "method").get_str() == "getauxblock" && params.size() == 2)
+                valReply = SubmitAuxBlock(params[0].get_str(), params[1].get_str());
+        }
+        *pstream << HTTPReply(200, JSONRPCReply(valReply, Value::null, 1), false) << std::flush;
+        delete pstream;
+    }
+
+    Value GetAuxBlock()
+    {
+        Object result;
+        CRITICAL_BLOCK(cs)
+        {
+            nGetCalls++;
+            result.push_back(Pair("target", HexStr(BEGIN(hashTarget), END(hashTarget))));
+            result.push_back(Pair("hash", hashBlock.GetHex()));
+            result.push_back(Pair("chainid", nChainID));
+        }
+        return result;
+    }
+
+    // Accepts the block only as an aux chain would
+    bool SubmitAuxBlock(const string& strHash, const string& strAuxPow)
+    {
+        string strError;
+        CRITICAL_BLOCK(cs)
+        {
+            nSubmits++;
+            uint256 hash;
+            hash.SetHex(strHash);
+            CDataStream ss(ParseHex(strAuxPow), SER_GETHASH|SER_BLOCKHEADERONLY);
+            CAuxPow pow;
+            try
+            {
+                ss >> pow;
+            }
+            catch (std::exception& e)
+            {
+                strError = "auxpow doesn't deserialize";
+            }
+            if (strError.empty() && hash != hashBlock)
+                strError = "submitted for a block this chain didn't hand out";
+            else if (strError.empty() && !pow.Check(hash, nChainID))
+                strError = "CAuxPow::Check failed";
+            else if (strError.empty() && pow.GetParentBlockHash() > hashTarget)
+                strError = "parent block is over the target";
+            if (strError.empty())
+                nGoodSubmits++;
+            else
+                strLastError = strError;
+        }
+        return strError.empty();
+    }
+
+    void SetMode(int nModeIn)
+    {
+        CRITICAL_BLOCK(cs)
+            nMode = nModeIn;
+    }
+};
+
+// A port with nothing listening on it
+int GetClosedPort()
+{
+    io_service ioService;
+    ip::tcp::acceptor acceptor(ioService, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+    return acceptor.local_endpoint().port();
+}
+
+// A one block chain with a recent tip, so getwork hands out work
+void MakeChain()
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->nHeight = 1;
+    pindex->nTime = GetAdjustedTime() - 600;
+    pindex->nBits = bnProofOfWorkLimit.GetCompact();
+    pindex->bnChainWork = pindex->GetBlockWork();
+    uint256 hash = Hash(BEGIN(pindex->nTime), END(pindex->nTime));
+    pindex->phashBlock = &(*mapBlockIndex.insert(make_pair(hash, pindex)).first).first;
+    pindexGenesisBlock = pindex;
+    pindexBest = pindex;
+    nBestHeight = pindex->nHeight;
+    hashBestChain = hash;
+
+    // The beneficiary list for the next block, so the coinbase is built
+    // without going to the network for it
+    string strDir = GetDataDir() + "/receiver";
+    boost::filesystem::create_directories(strDir);
+    FILE* file = fopen((strDir + "/receiver_0.csv").c_str(), "w");
+    fprintf(file, "Format,pluribusunum\n_begincoins\n%s\n_endcoins\n", PubKeyToAddress(pwalletMain->vchDefaultKey).c_str());
+    fclose(file);
+
+    // getwork wants a peer
+    vNodes.push_back(new CNode(INVALID_SOCKET, CAddress("127.0.0.1", 1)));
+}
+
+int main(int argc, char* argv[])
+{
+    string strDataDir = (argc > 1 ? argv[1] : "auxchain_check.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+    fTestNet = true;
+    int nTimeout = 2;
+    mapArgs["-auxchaintimeout"] = strprintf("%d", nTimeout);
+
+    boost::filesystem::remove(GetDataDir() + "/auxchain_check.dat");
+    pwalletMain = new CWallet("auxchain_check.dat");
+    bool fFirstRun;
+    if (!pwalletMain->LoadWallet(fFirstRun))
+    {
+        Check(false, "create the wallet");
+        return 1;
+    }
+    MakeChain();
+
+    // Any hash solves the first chain, none solves the second
+    uint256 hashEasy = ~uint256(0);
+    CAuxDaemon daemonEasy(0x21, hashEasy);
+    CAuxDaemon daemonHard(0x22, 0);
+    CAuxDaemon daemonHung(0x23, hashEasy);
+    daemonHung.SetMode(AUX_HANG);
+    string strDown = strprintf("aux:secret@127.0.0.1:%d", GetClosedPort());
+    mapMultiArgs["-auxchain"].push_back(daemonEasy.GetSpec());
+    mapMultiArgs["-auxchain"].push_back(daemonHard.GetSpec());
+    mapMultiArgs["-auxchain"].push_back("http://" + daemonHung.GetSpec() + "/");
+    mapMultiArgs["-auxchain"].push_back(strDown);
+    mapMultiArgs["-auxchain"].push_back("no port");
+    Check(StartMergedMining(), "start merged mining");
+
+    // Before any chain answers there is no work
+    bool fNoWork = false;
+    try
+    {
+        getworkmerged(Array(), false);
+    }
+    catch (Object& objError)
+    {
+        fNoWork = true;
+    }
+    Check(fNoWork, "no work before the aux chains answer");
+
+    // Fetch blocks: the chain down is refused at once, the hung one is
+    // given up on at the timeout while the others answer
+    int64 nStart = GetTimeMillis();
+    UpdateAuxChains();
+    int64 nElapsed = GetTimeMillis() - nStart;
+    Check(nElapsed < (nTimeout + 2) * 1000, strprintf("getauxblock from the aux chains took %"PRI64d" ms with a %d s timeout", nElapsed, nTimeout));
+    Check(GetAuxMerkleTreeUpdates() == 1, "one chain merkle tree built");
+    Check(daemonEasy.nGetCalls == 1 && daemonHard.nGetCalls == 1, "getauxblock called on the chains up");
+
+    // getwork commits to the tree and asks for the easiest aux target
+    Object work;
+    try
+    {
+        work = getworkmerged(Array(), false).get_obj();
+    }
+    catch (Object& objError)
+    {
+        Check(false, "getwork: " + write_string(Value(objError), false));
+        return 1;
+    }
+    Check(find_value(work, "target").get_str() == HexStr(BEGIN(hashEasy), END(hashEasy)), "getwork asks for the easiest aux target");
+    string strData = find_value(work, "data").get_str();
+
+    // A solution reaches the chain it solves, and only that one
+    Array params;
+    params.push_back(strData);
+    bool fAccepted = getworkmerged(params, false).get_bool();
+    Check(fAccepted, "solution accepted by the aux chain it solves");
+    Check(daemonEasy.nSubmits == 1 && daemonEasy.nGoodSubmits == 1, "valid aux proof of work submitted to the chain solved: " + daemonEasy.strLastError);
+    Check(daemonHard.nSubmits == 0, "nothing submitted to the chain not solved");
+
+    // The same work again is for a tree already handed out and still solves
+    fAccepted = getworkmerged(params, false).get_bool();
+    Check(fAccepted && daemonEasy.nGoodSubmits == 2, "solution resubmitted");
+
+    // Unknown work goes nowhere
+    string strUnknown = strData;
+    strUnknown[80] = (strUnknown[80] == '0' ? '1' : '0');
+    params[0] = strUnknown;
+    Check(!getworkmerged(params, false).get_bool() && daemonEasy.nSubmits == 2, "solution for unknown work dropped");
+
+    // The easy chain goes down while the hard one moves on: the easy
+    // chain's block stays in the new tree
+    daemonEasy.SetMode(AUX_DOWN);
+    CRITICAL_BLOCK(daemonHard.cs)
+        daemonHard.hashBlock = Hash(BEGIN(daemonHard.hashBlock), END(daemonHard.hashBlock));
+    UpdateAuxChains();
+    Check(GetAuxMerkleTreeUpdates() == 2, "new tree when a chain moves on");
+    daemonEasy.SetMode(AUX_UP);
+    work = getworkmerged(Array(), false).get_obj();
+    params[0] = find_value(work, "data").get_str();
+    Check(getworkmerged(params, false).get_bool() && daemonEasy.nGoodSubmits == 3, "chain that went down keeps its last block");
+
+    // A chain that hangs on the submit fails it within the timeout
+    daemonEasy.SetMode(AUX_HANG);
+    nStart = GetTimeMillis();
+    fAccepted = getworkmerged(params, false).get_bool();
+    nElapsed = GetTimeMillis() - nStart;
+    Check(!fAccepted, "submit to a hung chain fails");
+    Check(nElapsed < (nTimeout + 2) * 1000, strprintf("submit to a hung chain took %"PRI64d" ms with a %d s timeout", nElapsed, nTimeout));
+
+    // Easy and hard chains both solved by a share, one of them down: the
+    // other still gets its submit
+    daemonEasy.SetMode(AUX_DOWN);
+    CRITICAL_BLOCK(daemonHard.cs)
+    {
+        daemonHard.hashBlock = Hash(BEGIN(daemonHard.hashBlock), END(daemonHard.hashBlock));
+        daemonHard.hashTarget = hashEasy;
+    }
+    UpdateAuxChains();
+    work = getworkmerged(Array(), false).get_obj();
+    params[0] = find_value(work, "data").get_str();
+    Check(getworkmerged(params, false).get_bool() && daemonHard.nGoodSubmits == 1, "submit to one chain survives another chain down: " + daemonHard.strLastError);
+
+    fShutdown = true;
+    DBFlush(true);
+    fPrintToConsole = true;
+    printf("%d cases, %d failed\n", nCases, nFailed);
+    return (nFailed == 0 ? 0 : 1);
+}
@@ -0,0 +1,346 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times CAuxPow::Check per block against the version it replaced, which
+// made three std::search passes over the parent coinbase, reversed the
+// chain merkle root into a heap vector, checked the parent merkle branch
+// first and hashed each branch level through Hash() into a new uint256.
+//
+// There is no network here to fetch a range of merged mined blocks from,
+// so the auxpow headers are made up to look like them: a parent block of
+// 1 to 2000 transactions, so a parent merkle branch of up to 11 levels, a
+// coinbase of up to 100 bytes with the merged mining header, chain merkle
+// root, tree size and nonce among pool tags, and a chain merkle tree of 1
+// to 8 aux chains.  Both versions must accept every one of them, and must
+// agree on variants broken in each way Check looks for.
+//
+// Prints microseconds per block for each version over [passes] passes.
+//
+//   g++ -O2 -I.. -I../json -I../cryptopp auxpow_bench.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o auxpow_bench -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   auxpow_bench [blocks, default 10000] [passes, default 5] [scratch data directory, default auxpow_bench.tmp]
+//
+#include "headers.h"
+#include "auxpow.h"
+#include "strlcpy.h"
+#include <sys/time.h>
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+extern unsigned char pchMergedMiningHeader[4];
+
+uint256 CheckMerkleBranchOld(uint256 hash, const vector<uint256>& vMerkleBranch, int nIndex)
+{
+    if (nIndex == -1)
+        return 0;
+    BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
+    {
+        if (nIndex & 1)
+            hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
+        else
+            hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+        nIndex >>= 1;
+    }
+    return hash;
+}
+
+bool CheckAuxPowOld(CAuxPow& pow, uint256 hashAuxBlock, int nChainID)
+{
+    if (pow.nIndex != 0)
+        return error("AuxPow is not a generate");
+
+    if (!fTestNet && pow.parentBlock.GetChainID() == nChainID)
+        return error("Aux POW parent has our chain ID");
+
+    if (pow.vChainMerkleBranch.size() > 30)
+        return error("Aux POW chain merkle branch too long");
+
+    // Check that the chain merkle root is in the coinbase
+    uint256 nRootHash = CheckMerkleBranchOld(hashAuxBlock, pow.vChainMerkleBranch, pow.nChainIndex);
+    vector<unsigned char> vchRootHash(nRootHash.begin(), nRootHash.end());
+    std::reverse(vchRootHash.begin(), vchRootHash.end()); // correct endian
+
+    // Check that we are in the parent block merkle tree
+    if (CheckMerkleBranchOld(pow.GetHash(), pow.vMerkleBranch, pow.nIndex) != pow.parentBlock.hashMerkleRoot)
+        return error("Aux POW merkle root incorrect");
+
+    const CScript script = pow.vin[0].scriptSig;
+
+    // Check that the same work is not submitted twice to our chain.
+    //
+
+    CScript::const_iterator pcHead =
+        std::search(script.begin(), script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+
+    CScript::const_iterator pc =
+        std::search(script.begin(), script.end(), vchRootHash.begin(), vchRootHash.end());
+
+    if (pc == script.end())
+        return error("Aux POW missing chain merkle root in parent coinbase");
+
+    if (pcHead != script.end())
+    {
+        // Enforce only one chain merkle root by checking that a single instance of the merged
+        // mining header exists just before.
+        if (script.end() != std::search(pcHead + 1, script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader)))
+            return error("Multiple merged mining headers in coinbase");
+        if (pcHead + sizeof(pchMergedMiningHeader) != pc)
+            return error("Merged mining header is not just before chain merkle root");
+    }
+    else
+    {
+        // For backward compatibility.
+        // Enforce only one chain merkle root by checking that it starts early in the coinbase.
+        // 8-12 bytes are enough to encode extraNonce and nBits.
+        if (pc - script.begin() > 20)
+            return error("Aux POW chain merkle root must start in the first 20 bytes of the parent coinbase");
+    }
+
+
+    // Ensure we are at a deterministic point in the merkle leaves by hashing
+    // a nonce and our chain ID and comparing to the index.
+    pc += vchRootHash.size();
+    if (script.end() - pc < 8)
+        return error("Aux POW missing chain merkle tree size and nonce in parent coinbase");
+
+    int nSize;
+    memcpy(&nSize, &pc[0], 4);
+    if (nSize != (1 << pow.vChainMerkleBranch.size()))
+        return error("Aux POW merkle branch size does not match parent coinbase");
+
+    int nNonce;
+    memcpy(&nNonce, &pc[4], 4);
+
+    // Choose a pseudo-random slot in the chain merkle tree
+    // but have it be fixed for a size/nonce/chain combination.
+    //
+    // This prevents the same work from being used twice for the
+    // same chain while reducing the chance that two chains clash
+    // for the same slot.
+    unsigned int rand = nNonce;
+    rand = rand * 1103515245 + 12345;
+    rand += nChainID;
+    rand = rand * 1103515245 + 12345;
+
+    if (pow.nChainIndex != (rand % nSize))
+        return error("Aux POW wrong index");
+
+    return true;
+}
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+// Root of a merkle tree over vLeaves, the last hash of an odd level paired
+// with itself as in a block, and the branch of leaf nIndex
+uint256 BuildBranch(vector<uint256> vLeaves, int nIndex, vector<uint256>& vBranchRet)
+{
+    vBranchRet.clear();
+    while (vLeaves.size() > 1)
+    {
+        if (vLeaves.size() % 2)
+            vLeaves.push_back(vLeaves.back());
+        vBranchRet.push_back(vLeaves[nIndex ^ 1]);
+        vector<uint256> vLevel;
+        for (int i = 0; i < vLeaves.size(); i += 2)
+            vLevel.push_back(Hash(BEGIN(vLeaves[i]), END(vLeaves[i]), BEGIN(vLeaves[i+1]), END(vLeaves[i+1])));
+        vLeaves.swap(vLevel);
+        nIndex >>= 1;
+    }
+    return vLeaves[0];
+}
+
+enum
+{
+    AUXPOW_VALID,
+    AUXPOW_WRONG_INDEX,         // our block in another chain's slot
+    AUXPOW_NO_ROOT,             // root in the coinbase damaged
+    AUXPOW_TWO_HEADERS,         // a second merged mining header in a pool tag
+    AUXPOW_HEADER_APART,        // a byte between the header and the root
+    AUXPOW_ROOT_LATE,           // no header and the root past byte 20
+    AUXPOW_BAD_PARENT_BRANCH,   // coinbase not in the parent merkle tree
+    AUXPOW_VARIANTS,
+};
+
+// An auxpow for hashAuxBlock on chain nChainID, broken as nVariant says
+void MakeAuxPow(CAuxPow& pow, uint256 hashAuxBlock, int nChainID, int nVariant)
+{
+    // Chain merkle tree, nonce zero as the merged mining proxies use
+    int nChains = 1 + rand() % 8;
+    int nSize = 1;
+    while (nSize < nChains)
+        nSize *= 2;
+    unsigned int nSlot = 0;
+    nSlot = nSlot * 1103515245 + 12345;
+    nSlot += nChainID;
+    nSlot = nSlot * 1103515245 + 12345;
+    int nChainIndex = nSlot % nSize;
+    if (nVariant == AUXPOW_WRONG_INDEX)
+    {
+        if (nSize == 1)
+            nSize = 2;
+        nChainIndex = (nSlot % nSize) ^ 1;
+    }
+    vector<uint256> vChainLeaves;
+    for (int i = 0; i < nSize; i++)
+        vChainLeaves.push_back(i == nChainIndex ? hashAuxBlock : GetRandHash256());
+    uint256 hashChainRoot = BuildBranch(vChainLeaves, nChainIndex, pow.vChainMerkleBranch);
+    pow.nChainIndex = nChainIndex;
+
+    // Coinbase: height and extra nonce, the merged mining commitment, then
+    // a pool tag filling what is left of the 100 bytes a scriptSig may have
+    vector<unsigned char> vchAux(UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+    if (nVariant == AUXPOW_HEADER_APART)
+        vchAux.push_back(0);
+    if (nVariant == AUXPOW_ROOT_LATE)
+        vchAux.clear();
+    vector<unsigned char> vchRoot(hashChainRoot.begin(), hashChainRoot.end());
+    std::reverse(vchRoot.begin(), vchRoot.end());
+    if (nVariant == AUXPOW_NO_ROOT)
+        vchRoot[rand() % 32] ^= 1;
+    vchAux.insert(vchAux.end(), vchRoot.begin(), vchRoot.end());
+    int nNonce = 0;
+    vchAux.insert(vchAux.end(), BEGIN(nSize), END(nSize));
+    vchAux.insert(vchAux.end(), BEGIN(nNonce), END(nNonce));
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    CScript& scriptSig = txCoinbase.vin[0].scriptSig;
+    scriptSig << (int)(150000 + rand() % 100000) << CBigNum(rand());
+    if (nVariant == AUXPOW_ROOT_LATE)
+        scriptSig << vector<unsigned char>(20, 'x');
+    scriptSig << vchAux;
+    int nTag = 100 - (int)scriptSig.size() - 1;
+    if (nTag > 0)
+    {
+        vector<unsigned char> vchTag(rand() % (nTag + 1));
+        for (int i = 0; i < vchTag.size(); i++)
+            vchTag[i] = 'a' + rand() % 26;
+        if (nVariant == AUXPOW_TWO_HEADERS && vchTag.size() >= 4)
+            memcpy(&vchTag[vchTag.size() - 4], pchMergedMiningHeader, 4);
+        else if (nVariant == AUXPOW_TWO_HEADERS)
+            vchTag.assign(UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+        scriptSig.insert(scriptSig.end(), vchTag.begin(), vchTag.end());
+    }
+    int nOutputs = 1 + rand() % 3;
+    for (int i = 0; i < nOutputs; i++)
+    {
+        CScript scriptPubKey;
+        uint256 hash = GetRandHash256();
+        scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(hash.begin(), hash.begin() + 20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        txCoinbase.vout.push_back(CTxOut(50 * COIN / nOutputs, scriptPubKey));
+    }
+    *(CTransaction*)&pow = txCoinbase;
+
+    // Parent block with the coinbase first among nTx transactions
+    int nTx = 1 + rand() % 2000;
+    vector<uint256> vTxHash;
+    vTxHash.push_back(pow.GetHash());
+    for (int i = 1; i < nTx; i++)
+        vTxHash.push_back(GetRandHash256());
+    pow.parentBlock.nVersion = 1;
+    pow.parentBlock.hashPrevBlock = GetRandHash256();
+    pow.parentBlock.hashMerkleRoot = BuildBranch(vTxHash, 0, pow.vMerkleBranch);
+    pow.parentBlock.nTime = 1320000000 + rand();
+    pow.parentBlock.nBits = 0x1a0a8b5f;
+    pow.parentBlock.nNonce = rand();
+    if (nVariant == AUXPOW_BAD_PARENT_BRANCH && !pow.vMerkleBranch.empty())
+        pow.vMerkleBranch[rand() % pow.vMerkleBranch.size()] = GetRandHash256();
+    else if (nVariant == AUXPOW_BAD_PARENT_BRANCH)
+        pow.parentBlock.hashMerkleRoot = GetRandHash256();
+    pow.nIndex = 0;
+    pow.hashBlock = pow.parentBlock.GetHash();
+}
+
+double GetMicros()
+{
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000.0 + t.tv_usec;
+}
+
+int main(int argc, char* argv[])
+{
+    int nBlocks = (argc > 1 ? atoi(argv[1]) : 10000);
+    int nPasses = (argc > 2 ? atoi(argv[2]) : 5);
+    string strDataDir = (argc > 3 ? argv[3] : "auxpow_bench.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+    int nChainID = 0x0004;
+
+    // Broken variants both versions must turn down for the same blocks
+    srand(1);
+    int nDisagree = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        for (int nVariant = 0; nVariant < AUXPOW_VARIANTS; nVariant++)
+        {
+            CAuxPow pow;
+            uint256 hashAuxBlock = GetRandHash256();
+            MakeAuxPow(pow, hashAuxBlock, nChainID, nVariant);
+            bool fOld = CheckAuxPowOld(pow, hashAuxBlock, nChainID);
+            bool fNew = pow.Check(hashAuxBlock, nChainID);
+            if (fOld != fNew || fNew != (nVariant == AUXPOW_VALID))
+            {
+                if (nDisagree++ < 10)
+                {
+                    fPrintToConsole = true;
+                    printf("variant %d: old %d new %d\n", nVariant, fOld, fNew);
+                    fPrintToConsole = false;
+                }
+            }
+        }
+    }
+
+    // Each block is an auxpow and its aux block hash
+    vector<CAuxPow> vPow(nBlocks);
+    vector<uint256> vHashAuxBlock(nBlocks);
+    vector<int> vLevels(12, 0);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vHashAuxBlock[i] = GetRandHash256();
+        MakeAuxPow(vPow[i], vHashAuxBlock[i], nChainID, AUXPOW_VALID);
+        vLevels[min((int)vPow[i].vMerkleBranch.size(), 11)]++;
+    }
+    // Check() logs its rejections to debug.log, the results go to the console
+    fPrintToConsole = true;
+    printf("%d auxpow headers, parent merkle branch levels:", nBlocks);
+    for (int i = 0; i < vLevels.size(); i++)
+        if (vLevels[i])
+            printf(" %d:%d", i, vLevels[i]);
+    printf("\n");
+
+    double dOld = 0;
+    double dNew = 0;
+    int nRejected = 0;
+    for (int nPass = 0; nPass < nPasses; nPass++)
+    {
+        double dStart = GetMicros();
+        for (int i = 0; i < nBlocks; i++)
+            if (!CheckAuxPowOld(vPow[i], vHashAuxBlock[i], nChainID))
+                nRejected++;
+        dOld += GetMicros() - dStart;
+
+        dStart = GetMicros();
+        for (int i = 0; i < nBlocks; i++)
+            if (!vPow[i].Check(vHashAuxBlock[i], nChainID))
+                nRejected++;
+        dNew += GetMicros() - dStart;
+    }
+    printf("old %8.2f us/block\n", dOld / nPasses / nBlocks);
+    printf("new %8.2f us/block  %5.2fx\n", dNew / nPasses / nBlocks, dOld / max(dNew, 1.0));
+    printf("%d broken auxpows judged differently, %d valid auxpows rejected\n", nDisagree, nRejected);
+    return (nDisagree == 0 && nRejected == 0 ? 0 : 1);
+}
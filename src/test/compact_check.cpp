@@ -0,0 +1,98 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Differential check of uint256::SetCompact against the OpenSSL MPI decode
+// CBigNum::SetCompact does, the way CheckProofOfWork used to take nBits.
+// Every size byte is tried with edge and random mantissas under three
+// proof of work limits, checking both the accept/reject decision and the
+// target.  Prints the number of encodings tried and the mismatches found.
+//
+//   g++ -I.. compact_check.cpp -o compact_check -lcrypto
+//
+#include "uint256.h"
+#include <openssl/bn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+// nCompact decoded through BN_mpi2bn as CBigNum::SetCompact does, then
+// checked the way CheckProofOfWork checked the CBigNum
+bool CheckCompactBigNum(unsigned int nCompact, const uint256& hashLimit, uint256& hashTarget)
+{
+    unsigned int nSize = nCompact >> 24;
+    vector<unsigned char> vch(4 + nSize);
+    vch[3] = nSize;
+    if (nSize >= 1) vch[4] = (nCompact >> 16) & 0xff;
+    if (nSize >= 2) vch[5] = (nCompact >> 8) & 0xff;
+    if (nSize >= 3) vch[6] = (nCompact >> 0) & 0xff;
+    BIGNUM* bn = BN_mpi2bn(&vch[0], vch.size(), NULL);
+
+    uint256 hashLimitCopy = hashLimit;
+    unsigned char pchLimit[32];
+    for (int i = 0; i < 32; i++)
+        pchLimit[i] = hashLimitCopy.begin()[31-i];
+    BIGNUM* bnLimit = BN_bin2bn(pchLimit, 32, NULL);
+
+    bool fValid = !(BN_is_negative(bn) || BN_is_zero(bn) || BN_cmp(bn, bnLimit) > 0);
+    if (fValid)
+    {
+        unsigned char pchTarget[32] = {0};
+        BN_bn2bin(bn, pchTarget + 32 - BN_num_bytes(bn));
+        for (int i = 0; i < 32; i++)
+            hashTarget.begin()[i] = pchTarget[31-i];
+    }
+    BN_free(bn);
+    BN_free(bnLimit);
+    return fValid;
+}
+
+// The same check CheckProofOfWork makes now
+bool CheckCompactUint256(unsigned int nCompact, const uint256& hashLimit, uint256& hashTarget)
+{
+    bool fNegative;
+    bool fOverflow;
+    hashTarget.SetCompact(nCompact, &fNegative, &fOverflow);
+    return !(fNegative || fOverflow || hashTarget == 0 || hashTarget > hashLimit);
+}
+
+int main(int argc, char* argv[])
+{
+    uint256 vLimit[3] = { ~uint256(0) >> 32, ~uint256(0) >> 28, ~uint256(0) };
+    unsigned int vEdge[] = { 0x000000, 0x000001, 0x00007f, 0x000080, 0x0000ff, 0x000100, 0x00ffff, 0x010000,
+                             0x123456, 0x7fffff, 0x800000, 0x800001, 0xffffff };
+    int nEdge = sizeof(vEdge) / sizeof(vEdge[0]);
+    int nRandom = (argc > 1 ? atoi(argv[1]) : 2000);
+
+    srand(7);
+    int nTried = 0;
+    int nValid = 0;
+    int nMismatch = 0;
+    for (int nLimit = 0; nLimit < 3; nLimit++)
+    {
+        for (unsigned int nSize = 0; nSize < 256; nSize++)
+        {
+            for (int i = 0; i < nEdge + nRandom; i++)
+            {
+                unsigned int nWord = (i < nEdge ? vEdge[i] : (rand() & 0xffffff));
+                unsigned int nCompact = (nSize << 24) | nWord;
+                uint256 hashOld;
+                uint256 hashNew;
+                bool fOld = CheckCompactBigNum(nCompact, vLimit[nLimit], hashOld);
+                bool fNew = CheckCompactUint256(nCompact, vLimit[nLimit], hashNew);
+                nTried++;
+                if (fOld)
+                    nValid++;
+                if (fOld != fNew || (fOld && hashOld != hashNew))
+                {
+                    if (nMismatch++ < 10)
+                        printf("mismatch: nBits %08x limit %d, CBigNum %d, uint256 %d\n", nCompact, nLimit, fOld, fNew);
+                }
+            }
+        }
+    }
+    printf("%d encodings, %d valid, %d mismatches\n", nTried, nValid, nMismatch);
+    return (nMismatch == 0 ? 0 : 1);
+}
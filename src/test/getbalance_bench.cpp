@@ -0,0 +1,214 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times the getbalance RPC on a wallet of 200k transactions, with and
+// without the per-tip caches of CMerkleTx::GetDepthInMainChain and
+// CWalletTx::IsConfirmed.
+//
+// The transactions pay one of the wallet's keys and are confirmed in
+// blocks of 100 on a fake chain, except for 2% that spend the wallet's own
+// coins in unconfirmed chains of 4, each paying its change back and
+// carrying its unconfirmed parents and their confirmed root in vtxPrev.
+// 90% of the confirmed outputs are spent.
+//
+// getbalance and getbalance "*" are each called 10 times:
+//   cached     - as in a running node between blocks
+//   new block  - the tip moves before each call, so IsConfirmed walks
+//                vtxPrev again but depths still come from the cache
+//   uncached   - both caches are dropped before each call, which is what
+//                every call cost before them
+// All of them must give the same balance.  Prints the average milliseconds
+// per call.  The wallet's own logging goes to debug.log in the scratch data
+// directory.
+//
+//   g++ -O2 -I.. -I../json -I../cryptopp getbalance_bench.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../rpc.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o getbalance_bench -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   getbalance_bench [transactions, default 200000] [scratch data directory, default getbalance_bench.tmp]
+//
+#include "headers.h"
+#include "strlcpy.h"
+#include "json/json_spirit_value.h"
+
+using namespace std;
+using namespace json_spirit;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+int64 AmountFromValue(const Value& value);
+Value getbalance(const Array& params, bool fHelp);
+
+enum
+{
+    BALANCE_CACHED,
+    BALANCE_NEW_BLOCK,
+    BALANCE_UNCACHED,
+    BALANCE_MODES
+};
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+CBlockIndex* AddBlockIndex(const uint256& hashBlock, const uint256& hashMerkleRoot)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->phashBlock = &(*mapBlockIndex.insert(make_pair(hashBlock, pindex)).first).first;
+    pindex->hashMerkleRoot = hashMerkleRoot;
+    if (pindexBest)
+    {
+        pindex->nHeight = pindexBest->nHeight + 1;
+        pindex->pprev = pindexBest;
+        pindexBest->pnext = pindex;
+    }
+    pindexBest = pindex;
+    nBestHeight = pindexBest->nHeight;
+    hashBestChain = hashBlock;
+    return pindex;
+}
+
+void MakeWallet(CWallet& wallet, int nTransactions)
+{
+    vector<CScript> vScripts;
+    for (int i = 0; i < 100; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        wallet.AddKey(key);
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(key.GetPubKey());
+        vScripts.push_back(scriptPubKey);
+    }
+    CScript scriptForeign;
+    scriptForeign.SetBitcoinAddress(Hash160(ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f")));
+
+    // Confirmed transactions paying the wallet
+    int nChains = nTransactions / 200;
+    int nConfirmed = nTransactions - 4 * nChains;
+    AddBlockIndex(GetRandHash256(), 0);
+    vector<uint256> vUnspent;
+    for (int nDone = 0; nDone < nConfirmed; nDone += 100)
+    {
+        CBlock block;
+        for (int j = 0; j < 100 && nDone + j < nConfirmed; j++)
+        {
+            CTransaction tx;
+            tx.vin.push_back(CTxIn(COutPoint(GetRandHash256(), 0)));
+            tx.vout.push_back(CTxOut((1 + rand() % 5000) * CENT, vScripts[rand() % vScripts.size()]));
+            tx.vout.push_back(CTxOut(COIN, scriptForeign));
+            block.vtx.push_back(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        uint256 hashBlock = GetRandHash256();
+        AddBlockIndex(hashBlock, block.hashMerkleRoot);
+
+        for (int j = 0; j < block.vtx.size(); j++)
+        {
+            CWalletTx wtx(&wallet, block.vtx[j]);
+            wtx.hashBlock = hashBlock;
+            wtx.vMerkleBranch = block.GetMerkleBranch(j);
+            wtx.nIndex = j;
+            if (rand() % 10 != 0)
+                wtx.MarkSpent(0);
+            else
+                vUnspent.push_back(wtx.GetHash());
+            wallet.mapWallet.insert(make_pair(wtx.GetHash(), wtx));
+        }
+    }
+
+    // Unconfirmed chains spending the wallet's own coins
+    for (int i = 0; i < nChains && !vUnspent.empty(); i++)
+    {
+        uint256 hashPrev = vUnspent.back();
+        vUnspent.pop_back();
+        vector<CMerkleTx> vtxPrev;
+        for (int j = 0; j < 4; j++)
+        {
+            CWalletTx& wtxPrev = wallet.mapWallet[hashPrev];
+            wtxPrev.MarkSpent(0);
+            vtxPrev.push_back(wtxPrev);
+
+            CTransaction tx;
+            tx.vin.push_back(CTxIn(COutPoint(hashPrev, 0)));
+            int64 nValue = wtxPrev.vout[0].nValue;
+            tx.vout.push_back(CTxOut(nValue - nValue / 4, vScripts[rand() % vScripts.size()]));
+            tx.vout.push_back(CTxOut(nValue / 4, scriptForeign));
+            CWalletTx wtx(&wallet, tx);
+            wtx.vtxPrev = vtxPrev;
+            hashPrev = wtx.GetHash();
+            wallet.mapWallet.insert(make_pair(hashPrev, wtx));
+        }
+    }
+}
+
+void DropCaches(CWallet& wallet)
+{
+    nReorganizeCount++;
+    for (map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        (*it).second.pindexConfirmedCached = NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    int nTransactions = (argc > 1 ? atoi(argv[1]) : 200000);
+    string strDataDir = (argc > 2 ? argv[2] : "getbalance_bench.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+    const int nCalls = 10;
+
+    srand(1);
+    CWallet wallet;
+    pwalletMain = &wallet;
+    MakeWallet(wallet, nTransactions);
+
+    Array paramsAll;
+    paramsAll.push_back("*");
+    paramsAll.push_back(1);
+    const Array* vParams[] = { new Array(), &paramsAll };
+    const char* vName[] = { "getbalance", "getbalance \"*\"" };
+
+    // The first call builds the spendable set, which none of the modes time
+    int nMismatch = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        int64 nBalance = AmountFromValue(getbalance(*vParams[i], false));
+        double vMillis[BALANCE_MODES];
+        for (int nMode = 0; nMode < BALANCE_MODES; nMode++)
+        {
+            int64 nTotal = 0;
+            for (int j = 0; j < nCalls; j++)
+            {
+                if (nMode == BALANCE_NEW_BLOCK)
+                    AddBlockIndex(GetRandHash256(), 0);
+                else if (nMode == BALANCE_UNCACHED)
+                    DropCaches(wallet);
+                int64 nStart = GetTimeMicros();
+                int64 nBalanceMode = AmountFromValue(getbalance(*vParams[i], false));
+                nTotal += GetTimeMicros() - nStart;
+                if (nBalanceMode != nBalance)
+                {
+                    fPrintToConsole = true;
+                    printf("%s MISMATCH in mode %d: %s != %s\n", vName[i], nMode, FormatMoney(nBalanceMode).c_str(), FormatMoney(nBalance).c_str());
+                    fPrintToConsole = false;
+                    nMismatch++;
+                }
+            }
+            vMillis[nMode] = nTotal / 1000.0 / nCalls;
+        }
+        fPrintToConsole = true;
+        printf("%-16s cached %8.2fms  new block %8.2fms  uncached %8.2fms  balance %s\n", vName[i],
+               vMillis[BALANCE_CACHED], vMillis[BALANCE_NEW_BLOCK], vMillis[BALANCE_UNCACHED], FormatMoney(nBalance).c_str());
+        fPrintToConsole = false;
+    }
+
+    fPrintToConsole = true;
+    printf("%d transactions, %d mismatches\n", (int)wallet.mapWallet.size(), nMismatch);
+    return (nMismatch == 0 ? 0 : 1);
+}
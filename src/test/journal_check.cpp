@@ -0,0 +1,256 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Checks crash recovery of the -walletjournal journal in a scratch data
+// directory.
+//
+// The last batch of a journal is torn in several ways: cut off at points
+// inside its header, payload and checksum, or with a byte of its payload or
+// checksum changed.  Each time the journal is reopened, and the replay must
+// drop that batch, keep every batch before it and cut the file back to
+// where the batch began.  A batch appended after the cut must then replay.
+//
+// Then a wallet is filled with keys, key pool entries, transactions and
+// address book names while the flush thread compacts the journal in the
+// background.  The journal is replayed from disk as after a crash, and a
+// second wallet loaded from the file must have the same transactions,
+// keys, key pool, address book and default key.
+//
+// Prints the cases tried and the failures found.
+//
+//   g++ -I.. -I../json -I../cryptopp journal_check.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o journal_check -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   journal_check [scratch data directory, default journal_check.tmp]
+//
+#include "headers.h"
+#include "db.h"
+#include "strlcpy.h"
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+int nCases = 0;
+int nFailed = 0;
+
+void Check(bool fOk, const string& strWhat)
+{
+    nCases++;
+    if (!fOk)
+    {
+        // The wallet's own logging stays in debug.log
+        fPrintToConsole = true;
+        printf("FAILED: %s\n", strWhat.c_str());
+        fPrintToConsole = false;
+        nFailed++;
+    }
+}
+
+string ReadFile(const string& strPath)
+{
+    string str;
+    FILE* file = fopen(strPath.c_str(), "rb");
+    if (!file)
+        return str;
+    char pchBuf[65536];
+    size_t nRead;
+    while ((nRead = fread(pchBuf, 1, sizeof(pchBuf), file)) > 0)
+        str.append(pchBuf, nRead);
+    fclose(file);
+    return str;
+}
+
+void WriteFile(const string& strPath, const string& str)
+{
+    FILE* file = fopen(strPath.c_str(), "wb");
+    fwrite(str.data(), 1, str.size(), file);
+    fclose(file);
+}
+
+void RemoveWalletFiles(const string& strFile)
+{
+    boost::filesystem::remove(GetDataDir() + "/" + strFile);
+    boost::filesystem::remove(GetDataDir() + "/" + strFile + ".journal");
+}
+
+string ReadName(const string& strFile, const string& strAddress)
+{
+    CWalletDB walletdb(strFile);
+    string strName;
+    if (!walletdb.ReadName(strAddress, strName))
+        return "(none)";
+    return strName;
+}
+
+void CheckTornBatch()
+{
+    string strFile = "journal_check.dat";
+    string strPath = GetDataDir() + "/" + strFile + ".journal";
+    RemoveWalletFiles(strFile);
+    if (!OpenWalletJournal(strFile, true))
+    {
+        Check(false, "open the journal");
+        return;
+    }
+
+    // Single writes, then a transaction, which is one batch of records
+    for (int i = 0; i < 20; i++)
+        CWalletDB(strFile).WriteName(strprintf("addr%d", i), strprintf("name%d", i));
+    {
+        CWalletDB walletdb(strFile);
+        walletdb.TxnBegin();
+        for (int i = 20; i < 25; i++)
+            walletdb.WriteName(strprintf("addr%d", i), strprintf("name%d", i));
+        walletdb.TxnCommit();
+    }
+    int64 nGood = pwalletJournal->GetSize();
+
+    // The batch to tear overwrites, erases and adds
+    {
+        CWalletDB walletdb(strFile);
+        walletdb.TxnBegin();
+        walletdb.WriteName("addr0", "renamed");
+        walletdb.EraseName("addr1");
+        walletdb.WriteName("addrlast", "last");
+        walletdb.TxnCommit();
+    }
+    int64 nAll = pwalletJournal->GetSize();
+    string strJournal = ReadFile(strPath);
+    Check(strJournal.size() == nAll, "journal size on disk");
+    Check(ReadName(strFile, "addr0") == "renamed" && ReadName(strFile, "addr1") == "(none)", "last batch read back before tearing");
+
+    // Cut inside the header, the payload and the checksum, and damage the
+    // payload and the checksum
+    vector<pair<string, string> > vTorn;
+    int vCut[] = { 1, 4, 8, 11, 12, (int)(nAll - nGood) / 2, (int)(nAll - nGood) - 4, (int)(nAll - nGood) - 1 };
+    for (int i = 0; i < sizeof(vCut) / sizeof(vCut[0]); i++)
+        vTorn.push_back(make_pair(strprintf("cut %d bytes into the last batch", vCut[i]), strJournal.substr(0, nGood + vCut[i])));
+    string strPayload = strJournal;
+    strPayload[nGood + 20] ^= 0x40;
+    vTorn.push_back(make_pair(string("last batch payload damaged"), strPayload));
+    string strChecksum = strJournal;
+    strChecksum[nAll - 2] ^= 0x01;
+    vTorn.push_back(make_pair(string("last batch checksum damaged"), strChecksum));
+
+    for (int i = 0; i < vTorn.size(); i++)
+    {
+        const string& strCase = vTorn[i].first;
+        WriteFile(strPath, vTorn[i].second);
+        Check(pwalletJournal->Open(strFile), strCase + ": replay");
+        Check(pwalletJournal->GetSize() == nGood && ReadFile(strPath).size() == nGood, strCase + ": cut back to the last good batch");
+        bool fKept = true;
+        for (int j = 0; j < 25; j++)
+            if (ReadName(strFile, strprintf("addr%d", j)) != strprintf("name%d", j))
+                fKept = false;
+        Check(fKept, strCase + ": earlier batches kept");
+        Check(ReadName(strFile, "addrlast") == "(none)", strCase + ": torn batch dropped");
+    }
+
+    // Writes after the cut replay
+    CWalletDB(strFile).WriteName("addrafter", "after");
+    Check(pwalletJournal->Open(strFile), "replay after appending to a recovered journal");
+    Check(ReadName(strFile, "addrafter") == "after" && ReadName(strFile, "addr24") == "name24", "batch appended after the cut");
+
+    delete pwalletJournal;
+    pwalletJournal = NULL;
+}
+
+void CheckReplayAfterCompaction()
+{
+    string strFile = "journal_check2.dat";
+    RemoveWalletFiles(strFile);
+    if (!OpenWalletJournal(strFile, true))
+    {
+        Check(false, "open the journal");
+        return;
+    }
+
+    // Loading starts the flush thread, which compacts the journal whenever
+    // it passes -walletjournalsize
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    Check(wallet.LoadWallet(fFirstRun) && fFirstRun, "create the wallet");
+
+    int nCompactions = 0;
+    int64 nSizeLast = pwalletJournal->GetSize();
+    for (int i = 0; i < 60; i++)
+    {
+        vector<unsigned char> vchPubKey = wallet.GetKeyFromKeyPool();
+        wallet.SetAddressBookName(PubKeyToAddress(vchPubKey), strprintf("account%d", i % 5));
+
+        CWalletTx wtx;
+        wtx.vin.push_back(CTxIn(COutPoint(Hash(BEGIN(i), END(i)), 0)));
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(vchPubKey);
+        wtx.vout.push_back(CTxOut((i + 1) * CENT, scriptPubKey));
+        wtx.strFromAccount = strprintf("account%d", i % 3);
+        wallet.AddToWallet(wtx);
+        if (i % 10 == 9)
+            wallet.TopUpKeyPool(GetArg("-keypool", 100) + i);
+
+        if (pwalletJournal->GetSize() < nSizeLast)
+            nCompactions++;
+        nSizeLast = pwalletJournal->GetSize();
+        Sleep(i % 4 == 0 ? 600 : 50);
+    }
+    Check(nCompactions > 0, "journal compacted in the background");
+    fPrintToConsole = true;
+    printf("%d background compactions\n", nCompactions);
+    fPrintToConsole = false;
+
+    // Leave a few batches past the last compaction, too small for the flush
+    // thread to compact again
+    CompactWalletJournal();
+    wallet.SetAddressBookName(PubKeyToAddress(wallet.GetKeyFromKeyPool()), "last");
+    Check(pwalletJournal->GetSize() > 0, "batches pending at the crash");
+
+    // Crash: what was in memory is gone, the journal on disk is replayed
+    // over what the compactions put in the wallet file
+    Check(pwalletJournal->Open(strFile), "replay after compaction");
+    CWallet walletLoaded(strFile);
+    Check(walletLoaded.LoadWallet(fFirstRun) && !fFirstRun, "load the wallet");
+
+    bool fSame = (wallet.mapWallet.size() == walletLoaded.mapWallet.size());
+    for (map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); fSame && it != wallet.mapWallet.end(); ++it)
+    {
+        map<uint256, CWalletTx>::iterator mi = walletLoaded.mapWallet.find((*it).first);
+        if (mi == walletLoaded.mapWallet.end())
+        {
+            fSame = false;
+            break;
+        }
+        CDataStream ss(SER_DISK), ssLoaded(SER_DISK);
+        ss << (*it).second;
+        ssLoaded << (*mi).second;
+        fSame = (ss.str() == ssLoaded.str());
+    }
+    Check(fSame, strprintf("same transactions (%d)", wallet.mapWallet.size()));
+    Check(wallet.mapKeys == walletLoaded.mapKeys, strprintf("same keys (%d)", wallet.mapKeys.size()));
+    Check(wallet.setKeyPool == walletLoaded.setKeyPool, strprintf("same key pool (%d)", wallet.setKeyPool.size()));
+    Check(wallet.mapAddressBook == walletLoaded.mapAddressBook, strprintf("same address book (%d)", wallet.mapAddressBook.size()));
+    Check(wallet.vchDefaultKey == walletLoaded.vchDefaultKey, "same default key");
+}
+
+int main(int argc, char* argv[])
+{
+    string strDataDir = (argc > 1 ? argv[1] : "journal_check.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+    mapArgs["-walletjournalsize"] = "1";
+    mapArgs["-keypool"] = "20";
+
+    CheckTornBatch();
+    CheckReplayAfterCompaction();
+
+    fShutdown = true;
+    Sleep(1000);
+    DBFlush(true);
+    fPrintToConsole = true;
+    printf("%d cases, %d failed\n", nCases, nFailed);
+    return (nFailed == 0 ? 0 : 1);
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times read_string_fast against the Spirit read_string on the kinds of
+// input the RPC server parses: arrays of numbers, arrays of objects with
+// strings, and one large hex string like a getwork or getblock argument,
+// and on the array of numbers nested 500 arrays deep, as a client could send.
+// Both readers must produce the same Value, written back out.  Prints the
+// milliseconds each reader took and the ratio.
+//
+//   g++ -O2 -I../json json_reader_bench.cpp -o json_reader_bench
+//
+#include "json_spirit_reader_template.h"
+#include "json_spirit_writer_template.h"
+#include "json_spirit_fast_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+using namespace std;
+using namespace json_spirit;
+
+double GetMillis()
+{
+    return 1000.0 * clock() / CLOCKS_PER_SEC;
+}
+
+bool Bench(const char* pszName, const string& str, int nRounds)
+{
+    Value valSpirit;
+    Value valFast;
+    double nStart = GetMillis();
+    for (int i = 0; i < nRounds; i++)
+        if (!read_string(str, valSpirit))
+            return false;
+    double nSpirit = GetMillis() - nStart;
+    nStart = GetMillis();
+    for (int i = 0; i < nRounds; i++)
+        if (!read_string_fast(str, valFast))
+            return false;
+    double nFast = GetMillis() - nStart;
+
+    bool fSame = (write_string(valSpirit, false) == write_string(valFast, false));
+    printf("%-16s %8d bytes x %5d  spirit %8.1fms  fast %8.1fms  %5.1fx%s\n", pszName, (int)str.size(), nRounds,
+           nSpirit, nFast, nSpirit / max(nFast, 0.1), fSame ? "" : "  DIFFERENT RESULT");
+    return fSame;
+}
+
+int main(int argc, char* argv[])
+{
+    int nRounds = (argc > 1 ? atoi(argv[1]) : 20);
+    srand(3);
+
+    string strIntegers = "[";
+    for (int i = 0; i < 100000; i++)
+    {
+        char buf[32];
+        sprintf(buf, "%s%d", i ? "," : "", rand() - RAND_MAX / 2);
+        strIntegers += buf;
+    }
+    strIntegers += "]";
+
+    string strObjects = "[";
+    for (int i = 0; i < 10000; i++)
+    {
+        char buf[256];
+        sprintf(buf, "%s{\"account\":\"label %d\",\"address\":\"1%030d\",\"category\":\"receive\",\"amount\":%d.%08d,\"confirmations\":%d}",
+                i ? "," : "", i, rand(), rand() % 1000, rand() % 100000000, rand() % 1000);
+        strObjects += buf;
+    }
+    strObjects += "]";
+
+    string strHex = "[\"";
+    for (int i = 0; i < 1000000; i++)
+        strHex += "0123456789abcdef"[rand() % 16];
+    strHex += "\"]";
+
+    // As deep as the fast reader goes, with the numbers innermost
+    string strNested = string(500, '[') + strIntegers + string(500, ']');
+
+    bool fOk = true;
+    fOk &= Bench("integers", strIntegers, nRounds);
+    fOk &= Bench("objects", strObjects, nRounds);
+    fOk &= Bench("hex string", strHex, nRounds);
+    fOk &= Bench("nested", strNested, nRounds);
+    return (fOk ? 0 : 1);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Checks CBlock::CheckMerkleBranch against the loop it replaced, which
+// hashed each level's pair through Hash() into a new uint256, over random
+// branches of up to 30 levels and random indices.  Prints the number of
+// branches tried and the mismatches found.
+//
+//   g++ -I.. merkle_branch_check.cpp -o merkle_branch_check -lcrypto -lboost_system
+//
+#include "headers.h"
+
+using namespace std;
+
+// printf goes through here in util.h, straight to the console in this program
+int OutputDebugStringF(const char* pszFormat, ...)
+{
+    va_list arg_ptr;
+    va_start(arg_ptr, pszFormat);
+    int ret = vprintf(pszFormat, arg_ptr);
+    va_end(arg_ptr);
+    return ret;
+}
+
+uint256 CheckMerkleBranchOld(uint256 hash, const vector<uint256>& vMerkleBranch, int nIndex)
+{
+    if (nIndex == -1)
+        return 0;
+    BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
+    {
+        if (nIndex & 1)
+            hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
+        else
+            hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+        nIndex >>= 1;
+    }
+    return hash;
+}
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+int main(int argc, char* argv[])
+{
+    int nBranches = (argc > 1 ? atoi(argv[1]) : 100000);
+
+    srand(1);
+    int nMismatch = 0;
+    for (int i = 0; i < nBranches; i++)
+    {
+        vector<uint256> vMerkleBranch(rand() % 31);
+        for (int j = 0; j < vMerkleBranch.size(); j++)
+            vMerkleBranch[j] = GetRandHash256();
+        uint256 hash = GetRandHash256();
+        int nIndex = (i % 100 == 0 ? -1 : rand());
+        if (CBlock::CheckMerkleBranch(hash, vMerkleBranch, nIndex) != CheckMerkleBranchOld(hash, vMerkleBranch, nIndex))
+        {
+            if (nMismatch++ < 10)
+                printf("mismatch: %d levels, index %d\n", (int)vMerkleBranch.size(), nIndex);
+        }
+    }
+    printf("%d branches, %d mismatches\n", nBranches, nMismatch);
+    return (nMismatch == 0 ? 0 : 1);
+}
@@ -0,0 +1,862 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Load test for a running node's JSON-RPC server.  [-clients] threads each
+// keep one HTTP/1.1 connection alive and call getblockcount, getbalance
+// and getblockbyhash in turn for [-seconds] seconds.  Prints requests per
+// second and the median and 99th percentile latency of each method.
+//
+// With -batch, instead times [-calls] getblockbycount calls made one
+// request at a time on one connection against the same calls sent as one
+// JSON-RPC batch.
+//
+//   g++ -O2 -I../json rpc_bench.cpp -o rpc_bench -lboost_thread -lboost_system
+//   rpc_bench -rpcuser=<user> -rpcpassword=<password> [-rpcconnect=127.0.0.1]
+//             [-rpcport=52332] [-clients=8] [-seconds=10]
+// With -stream, instead calls -method with the JSON array -params [-calls]
+// times and prints the time to the first byte and to the end of each reply.
+// Given the node's -pid, also prints its peak resident memory during each
+// call, which needs the permission to write its /proc/<pid>/clear_refs.
+//
+// With -longpoll, instead watches the nodes listening on the comma
+// separated -ports (all on -rpcconnect, with the same credentials) for
+// -seconds while something finds blocks.  Each node is polled with
+// getblockcount every -interval ms and also has a long poll waiting on /LP.
+// For every new height, prints when each node's poll first saw it and when
+// its long poll returned, from the first time any node saw it.
+//
+// With -getwork, instead has [-clients] threads call getblockcount,
+// getdifficulty, getinfo and getconnectioncount in turn for [-seconds]
+// seconds, first alone and then while -miners threads each ask for work
+// with getwork and hand it back, as many miners polling one node do.
+// Prints the latency of each method in both runs and the getwork rate.
+// getwork is only served with -auxchain, so -auxport=<port> also serves a
+// stand-in aux chain on that port for the node's -auxchain=<user>:<password>@127.0.0.1:<port>.
+// Its target is zero, so no share solves it.
+//
+//   rpc_bench -batch [-calls=1000] ...
+//   rpc_bench -stream [-method=listtransactions] [-params=["*",100000]] [-calls=10] [-pid=<pid>] ...
+//   rpc_bench -longpoll -ports=<port>,<port>,... [-seconds=600] [-interval=10] ...
+//   rpc_bench -getwork [-miners=32] [-auxport=<port>] ...
+//
+#include "json_spirit_reader_template.h"
+#include "json_spirit_writer_template.h"
+#include "json_spirit_utils.h"
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace json_spirit;
+
+map<string, string> mapArgs;
+
+string GetArg(const string& strArg, const string& strDefault)
+{
+    if (mapArgs.count(strArg))
+        return mapArgs[strArg];
+    return strDefault;
+}
+
+double GetMillis()
+{
+    timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+string EncodeBase64(const string& str)
+{
+    static const char* pbase64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string strRet;
+    for (unsigned int i = 0; i < str.size(); i += 3)
+    {
+        unsigned int n = (unsigned char)str[i] << 16;
+        if (i + 1 < str.size()) n |= (unsigned char)str[i+1] << 8;
+        if (i + 2 < str.size()) n |= (unsigned char)str[i+2];
+        strRet += pbase64[(n >> 18) & 63];
+        strRet += pbase64[(n >> 12) & 63];
+        strRet += (i + 1 < str.size() ? pbase64[(n >> 6) & 63] : '=');
+        strRet += (i + 2 < str.size() ? pbase64[n & 63] : '=');
+    }
+    return strRet;
+}
+
+string JSONRPCRequest(const string& strMethod, const Array& params, int nId)
+{
+    Object request;
+    request.push_back(Pair("method", strMethod));
+    request.push_back(Pair("params", params));
+    request.push_back(Pair("id", nId));
+    return write_string(Value(request), false);
+}
+
+//
+// One kept-alive connection to the server, reading Content-Length and
+// chunked replies
+//
+class CRPCClient
+{
+private:
+    int hSocket;
+    string strPort;
+    string strBuffer;
+
+public:
+    // When the last reply's status line arrived
+    double dFirstByte;
+
+private:
+
+    bool ReadMore()
+    {
+        char pchBuf[65536];
+        int nRead = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+        if (nRead <= 0)
+            return false;
+        strBuffer.append(pchBuf, nRead);
+        return true;
+    }
+
+    bool ReadLine(string& strLine)
+    {
+        size_t nEnd;
+        while ((nEnd = strBuffer.find("\r\n")) == string::npos)
+            if (!ReadMore())
+                return false;
+        strLine = strBuffer.substr(0, nEnd);
+        strBuffer.erase(0, nEnd + 2);
+        return true;
+    }
+
+    bool ReadBytes(size_t nSize, string& strRet)
+    {
+        while (strBuffer.size() < nSize)
+            if (!ReadMore())
+                return false;
+        strRet.append(strBuffer, 0, nSize);
+        strBuffer.erase(0, nSize);
+        return true;
+    }
+
+public:
+    CRPCClient(const string& strPortIn="")
+    {
+        hSocket = -1;
+        strPort = (strPortIn.empty() ? GetArg("-rpcport", "52332") : strPortIn);
+        dFirstByte = 0;
+    }
+    ~CRPCClient()
+    {
+        Close();
+    }
+
+    bool Connect()
+    {
+        Close();
+        addrinfo* paddr = NULL;
+        if (getaddrinfo(GetArg("-rpcconnect", "127.0.0.1").c_str(), strPort.c_str(), NULL, &paddr) != 0)
+            return false;
+        hSocket = socket(paddr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        bool fOk = (hSocket >= 0 && connect(hSocket, paddr->ai_addr, paddr->ai_addrlen) == 0);
+        freeaddrinfo(paddr);
+        if (!fOk)
+        {
+            Close();
+            return false;
+        }
+        int nOne = 1;
+        setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, &nOne, sizeof(nOne));
+        return true;
+    }
+
+    void Close()
+    {
+        if (hSocket >= 0)
+            close(hSocket);
+        hSocket = -1;
+        strBuffer.clear();
+    }
+
+    // Sends one request and reads the whole reply body.  Returns the HTTP
+    // status, or 0 if the connection broke.
+    int Call(const string& strRequest, string& strReplyRet, const char* pszPath="/")
+    {
+        // The server may close a kept-alive connection just as a request
+        // goes out on it, in which case it's sent again on a new one
+        bool fReused = (hSocket >= 0);
+        if (!fReused && !Connect())
+            return 0;
+        static string strAuth = EncodeBase64(GetArg("-rpcuser", "") + ":" + GetArg("-rpcpassword", ""));
+        char pszHeader[512];
+        sprintf(pszHeader, "POST %s HTTP/1.1\r\n"
+                           "Host: 127.0.0.1\r\n"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: %u\r\n"
+                           "Connection: keep-alive\r\n"
+                           "Authorization: Basic %s\r\n"
+                           "\r\n", pszPath, (unsigned int)strRequest.size(), strAuth.c_str());
+        string strPost = string(pszHeader) + strRequest;
+        string strLine;
+        if (send(hSocket, strPost.data(), strPost.size(), MSG_NOSIGNAL) != (int)strPost.size() ||
+            !ReadLine(strLine) || strLine.size() < 12)
+        {
+            Close();
+            if (!fReused || !Connect() ||
+                send(hSocket, strPost.data(), strPost.size(), MSG_NOSIGNAL) != (int)strPost.size() ||
+                !ReadLine(strLine) || strLine.size() < 12)
+            {
+                Close();
+                return 0;
+            }
+        }
+        dFirstByte = GetMillis();
+        int nStatus = atoi(strLine.c_str() + 9);
+        size_t nContentLength = 0;
+        bool fChunked = false;
+        bool fClose = false;
+        while (ReadLine(strLine) && !strLine.empty())
+        {
+            size_t nColon = strLine.find(':');
+            if (nColon == string::npos)
+                continue;
+            string strName = strLine.substr(0, nColon);
+            string strValue = strLine.substr(nColon + 1);
+            while (!strValue.empty() && strValue[0] == ' ')
+                strValue.erase(0, 1);
+            for (unsigned int i = 0; i < strName.size(); i++)
+                strName[i] = tolower(strName[i]);
+            if (strName == "content-length")
+                nContentLength = strtoul(strValue.c_str(), NULL, 10);
+            else if (strName == "transfer-encoding" && strValue.find("chunked") != string::npos)
+                fChunked = true;
+            else if (strName == "connection" && strValue.find("close") != string::npos)
+                fClose = true;
+        }
+
+        strReplyRet.clear();
+        bool fOk = true;
+        if (!fChunked)
+            fOk = ReadBytes(nContentLength, strReplyRet);
+        else
+        {
+            for (;;)
+            {
+                size_t nChunk;
+                if (!ReadLine(strLine))
+                {
+                    fOk = false;
+                    break;
+                }
+                nChunk = strtoul(strLine.c_str(), NULL, 16);
+                if (nChunk == 0)
+                {
+                    // Trailers up to the blank line
+                    while ((fOk = ReadLine(strLine)) && !strLine.empty())
+                        ;
+                    break;
+                }
+                string strCRLF;
+                if (!ReadBytes(nChunk, strReplyRet) || !ReadBytes(2, strCRLF))
+                {
+                    fOk = false;
+                    break;
+                }
+            }
+        }
+        if (!fOk)
+        {
+            Close();
+            return 0;
+        }
+        if (fClose)
+            Close();
+        return nStatus;
+    }
+
+    // Calls strMethod and returns the reply's result, throwing on an error
+    Value CallMethod(const string& strMethod, const Array& params)
+    {
+        string strReply;
+        int nStatus = Call(JSONRPCRequest(strMethod, params, 1), strReply);
+        Value valReply;
+        if (nStatus == 0 || !read_string(strReply, valReply) || valReply.type() != obj_type)
+        {
+            char pszError[256];
+            sprintf(pszError, "%.100s: no reply (HTTP status %d)", strMethod.c_str(), nStatus);
+            throw runtime_error(pszError);
+        }
+        const Value& error = find_value(valReply.get_obj(), "error");
+        if (error.type() != null_type)
+            throw runtime_error(strMethod + ": " + write_string(error, false));
+        return find_value(valReply.get_obj(), "result");
+    }
+};
+
+
+
+//
+// Latencies of one method, in milliseconds
+//
+class CLatency
+{
+public:
+    string strName;
+    vector<double> vMillis;
+    int nErrors;
+
+    CLatency(const string& strNameIn="")
+    {
+        strName = strNameIn;
+        nErrors = 0;
+    }
+
+    void Add(const CLatency& other)
+    {
+        vMillis.insert(vMillis.end(), other.vMillis.begin(), other.vMillis.end());
+        nErrors += other.nErrors;
+    }
+
+    double Percentile(double dPercent)
+    {
+        if (vMillis.empty())
+            return 0;
+        sort(vMillis.begin(), vMillis.end());
+        unsigned int n = (unsigned int)(dPercent / 100 * vMillis.size());
+        return vMillis[min(n, (unsigned int)vMillis.size() - 1)];
+    }
+
+    void Print(double dSeconds)
+    {
+        printf("%-16s %8d calls %9.1f/s  p50 %8.2fms  p99 %8.2fms  %d errors\n", strName.c_str(), (int)vMillis.size(),
+               vMillis.size() / dSeconds, Percentile(50), Percentile(99), nErrors);
+    }
+};
+
+void ThreadLoad(const vector<string>* pvHash, double dEnd, int nClient, vector<CLatency>* pvLatency)
+{
+    static const char* ppszMethod[] = { "getblockcount", "getbalance", "getblockbyhash" };
+    CRPCClient client;
+    for (int i = nClient; GetMillis() < dEnd; i++)
+    {
+        int nMethod = i % 3;
+        Array params;
+        if (nMethod == 2)
+            params.push_back((*pvHash)[i % pvHash->size()]);
+        string strRequest = JSONRPCRequest(ppszMethod[nMethod], params, i);
+        string strReply;
+        double dStart = GetMillis();
+        if (client.Call(strRequest, strReply) == 200)
+            (*pvLatency)[nMethod].vMillis.push_back(GetMillis() - dStart);
+        else
+            (*pvLatency)[nMethod].nErrors++;
+    }
+}
+
+// getblockbycount for heights 0, 1, ... one call at a time, then as a batch
+bool BenchBatch(int nBestHeight, int nCalls)
+{
+    CRPCClient client;
+    vector<string> vReply;
+    double dStart = GetMillis();
+    for (int i = 0; i < nCalls; i++)
+    {
+        Array params;
+        params.push_back(i % (nBestHeight + 1));
+        string strReply;
+        if (client.Call(JSONRPCRequest("getblockbycount", params, i), strReply) != 200)
+            throw runtime_error("getblockbycount failed");
+        vReply.push_back(strReply);
+    }
+    double dSingle = GetMillis() - dStart;
+
+    Array vRequest;
+    for (int i = 0; i < nCalls; i++)
+    {
+        Array params;
+        params.push_back(i % (nBestHeight + 1));
+        Object request;
+        request.push_back(Pair("method", "getblockbycount"));
+        request.push_back(Pair("params", params));
+        request.push_back(Pair("id", i));
+        vRequest.push_back(request);
+    }
+    string strBatch = write_string(Value(vRequest), false);
+    string strReply;
+    dStart = GetMillis();
+    if (client.Call(strBatch, strReply) != 200)
+        throw runtime_error("batch request failed");
+    double dBatch = GetMillis() - dStart;
+
+    // Each call's result, in order, must be the one the single call gave
+    Value valReply;
+    if (!read_string(strReply, valReply) || valReply.type() != array_type || valReply.get_array().size() != nCalls)
+        throw runtime_error("batch reply isn't an array of one reply per call");
+    int nDifferent = 0;
+    const Array& vBatchReply = valReply.get_array();
+    for (int i = 0; i < nCalls; i++)
+    {
+        Value valSingle;
+        read_string(vReply[i], valSingle);
+        if (valSingle.type() != obj_type || vBatchReply[i].type() != obj_type ||
+            write_string(find_value(valSingle.get_obj(), "result"), false) != write_string(find_value(vBatchReply[i].get_obj(), "result"), false))
+            nDifferent++;
+    }
+
+    printf("%d getblockbycount calls, %d bytes of batch reply\n", nCalls, (int)strReply.size());
+    printf("one at a time %9.1fms  %8.3fms/call\n", dSingle, dSingle / nCalls);
+    printf("batched       %9.1fms  %8.3fms/call  %5.1fx\n", dBatch, dBatch / nCalls, dSingle / max(dBatch, 0.1));
+    if (nDifferent)
+        printf("%d batch results differ from the single calls\n", nDifferent);
+    return (nDifferent == 0);
+}
+
+// A line like "VmHWM:    123456 kB" from /proc/<pid>/status, in kB
+int GetProcStatus(const string& strPid, const char* pszField)
+{
+    FILE* file = fopen(("/proc/" + strPid + "/status").c_str(), "r");
+    if (!file)
+        return -1;
+    int nRet = -1;
+    char psz[256];
+    while (fgets(psz, sizeof(psz), file))
+        if (strncmp(psz, pszField, strlen(pszField)) == 0)
+            nRet = atoi(psz + strlen(pszField) + 1);
+    fclose(file);
+    return nRet;
+}
+
+// Starts the peak resident memory over from the current resident memory
+bool ResetPeakMemory(const string& strPid)
+{
+    FILE* file = fopen(("/proc/" + strPid + "/clear_refs").c_str(), "w");
+    if (!file)
+        return false;
+    bool fOk = (fputs("5", file) >= 0);
+    return (fclose(file) == 0 && fOk);
+}
+
+bool BenchStream(const string& strMethod, const string& strParams, int nCalls, const string& strPid)
+{
+    Value valParams;
+    if (!read_string(strParams, valParams) || valParams.type() != array_type)
+        throw runtime_error("-params isn't a JSON array");
+    string strRequest = JSONRPCRequest(strMethod, valParams.get_array(), 1);
+
+    CRPCClient client;
+    printf("%s %s\n", strMethod.c_str(), strParams.c_str());
+    for (int i = 0; i < nCalls; i++)
+    {
+        bool fMemory = (!strPid.empty() && ResetPeakMemory(strPid));
+        int nRSSBefore = (fMemory ? GetProcStatus(strPid, "VmRSS:") : -1);
+        string strReply;
+        double dStart = GetMillis();
+        if (client.Call(strRequest, strReply) != 200)
+            throw runtime_error(strMethod + " failed");
+        double dEnd = GetMillis();
+        printf("%10d bytes  first byte %8.1fms  last byte %8.1fms", (int)strReply.size(), client.dFirstByte - dStart, dEnd - dStart);
+        if (fMemory)
+            printf("  node peak %7d kB, %+7d kB over its resident %d kB", GetProcStatus(strPid, "VmHWM:"),
+                   GetProcStatus(strPid, "VmHWM:") - nRSSBefore, nRSSBefore);
+        printf("\n");
+    }
+    if (!strPid.empty() && !ResetPeakMemory(strPid))
+        printf("can't write /proc/%s/clear_refs, no memory figures\n", strPid.c_str());
+    return true;
+}
+
+//
+// When each height was first seen on one node by polling and by long poll
+//
+class CNodeTimes
+{
+public:
+    string strPort;
+    int nStartHeight;
+    map<int, double> mapPolled;
+    map<int, double> mapNotified;
+};
+
+boost::mutex mutexNodeTimes;
+
+int GetHeightReply(const string& strReply)
+{
+    Value valReply;
+    if (!read_string(strReply, valReply) || valReply.type() != obj_type)
+        return -1;
+    const Value& result = find_value(valReply.get_obj(), "result");
+    return (result.type() == int_type ? result.get_int() : -1);
+}
+
+void ThreadPollHeight(CNodeTimes* pnode, double dEnd, int nInterval)
+{
+    CRPCClient client(pnode->strPort);
+    string strRequest = JSONRPCRequest("getblockcount", Array(), 1);
+    while (GetMillis() < dEnd)
+    {
+        string strReply;
+        if (client.Call(strRequest, strReply) == 200)
+        {
+            double dNow = GetMillis();
+            int nHeight = GetHeightReply(strReply);
+            boost::mutex::scoped_lock lock(mutexNodeTimes);
+            if (nHeight > pnode->nStartHeight && !pnode->mapPolled.count(nHeight))
+                pnode->mapPolled[nHeight] = dNow;
+        }
+        usleep(nInterval * 1000);
+    }
+}
+
+void ThreadLongPoll(CNodeTimes* pnode, double dEnd)
+{
+    // A long poll still waiting at the end returns by -rpclongpolltimeout
+    CRPCClient client(pnode->strPort);
+    string strRequest = JSONRPCRequest("getblockcount", Array(), 1);
+    while (GetMillis() < dEnd)
+    {
+        string strReply;
+        if (client.Call(strRequest, strReply, "/LP") != 200)
+        {
+            usleep(100000);
+            continue;
+        }
+        double dNow = GetMillis();
+        int nHeight = GetHeightReply(strReply);
+        boost::mutex::scoped_lock lock(mutexNodeTimes);
+        if (nHeight > pnode->nStartHeight && !pnode->mapNotified.count(nHeight))
+            pnode->mapNotified[nHeight] = dNow;
+    }
+}
+
+bool BenchLongPoll(const string& strPorts, double dSeconds, int nInterval)
+{
+    vector<CNodeTimes> vNode;
+    size_t nPos = 0;
+    while (nPos <= strPorts.size())
+    {
+        size_t nComma = strPorts.find(',', nPos);
+        if (nComma == string::npos)
+            nComma = strPorts.size();
+        CNodeTimes node;
+        node.strPort = strPorts.substr(nPos, nComma - nPos);
+        if (!node.strPort.empty())
+            vNode.push_back(node);
+        nPos = nComma + 1;
+    }
+    if (vNode.empty())
+        throw runtime_error("no -ports given");
+    for (unsigned int i = 0; i < vNode.size(); i++)
+    {
+        CRPCClient client(vNode[i].strPort);
+        vNode[i].nStartHeight = client.CallMethod("getblockcount", Array()).get_int();
+    }
+
+    printf("watching %d nodes for %.0f seconds\n", (int)vNode.size(), dSeconds);
+    double dEnd = GetMillis() + dSeconds * 1000;
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < vNode.size(); i++)
+    {
+        threads.create_thread(boost::bind(&ThreadPollHeight, &vNode[i], dEnd, nInterval));
+        threads.create_thread(boost::bind(&ThreadLongPoll, &vNode[i], dEnd));
+    }
+    threads.join_all();
+
+    // Each height against the first time any node's poll saw it.  A long
+    // poll can return up to -interval ms before its node's poll notices.
+    set<int> setHeight;
+    for (unsigned int i = 0; i < vNode.size(); i++)
+        for (map<int, double>::iterator it = vNode[i].mapPolled.begin(); it != vNode[i].mapPolled.end(); ++it)
+            setHeight.insert((*it).first);
+    vector<vector<double> > vvLatency(vNode.size());
+    int nMissed = 0;
+    BOOST_FOREACH(int nHeight, setHeight)
+    {
+        double dFirst = 0;
+        for (unsigned int i = 0; i < vNode.size(); i++)
+            if (vNode[i].mapPolled.count(nHeight) && (dFirst == 0 || vNode[i].mapPolled[nHeight] < dFirst))
+                dFirst = vNode[i].mapPolled[nHeight];
+        printf("height %7d", nHeight);
+        for (unsigned int i = 0; i < vNode.size(); i++)
+        {
+            CNodeTimes& node = vNode[i];
+            printf("  port %s:", node.strPort.c_str());
+            if (node.mapPolled.count(nHeight))
+                printf(" polled %+7.0fms", node.mapPolled[nHeight] - dFirst);
+            else
+                printf(" polled        -");
+            if (node.mapNotified.count(nHeight))
+            {
+                printf(" notified %+7.0fms", node.mapNotified[nHeight] - dFirst);
+                if (node.mapPolled.count(nHeight))
+                    vvLatency[i].push_back(node.mapNotified[nHeight] - node.mapPolled[nHeight]);
+            }
+            else
+            {
+                printf(" notified        -");
+                nMissed++;
+            }
+        }
+        printf("\n");
+    }
+    for (unsigned int i = 0; i < vNode.size(); i++)
+    {
+        CLatency latency("port " + vNode[i].strPort);
+        latency.vMillis = vvLatency[i];
+        printf("%-16s %5d heights  notified after polling p50 %+8.1fms  p99 %+8.1fms\n", latency.strName.c_str(),
+               (int)latency.vMillis.size(), latency.Percentile(50), latency.Percentile(99));
+    }
+    if (nMissed)
+        printf("%d times a long poll never returned a height its node reached\n", nMissed);
+    return true;
+}
+
+// Answers the node's getauxblock calls: the same block and a zero target
+// every time, and false for a submit
+void ThreadAuxChain(int hListenSocket)
+{
+    for (;;)
+    {
+        int hSocket = accept(hListenSocket, NULL, NULL);
+        if (hSocket < 0)
+            continue;
+        string strRequest;
+        size_t nHeaderEnd = string::npos;
+        size_t nContentLength = 0;
+        char pchBuf[4096];
+        int nRead;
+        while ((nRead = recv(hSocket, pchBuf, sizeof(pchBuf), 0)) > 0)
+        {
+            strRequest.append(pchBuf, nRead);
+            if (nHeaderEnd == string::npos && (nHeaderEnd = strRequest.find("\r\n\r\n")) != string::npos)
+            {
+                size_t nPos = strRequest.find("Content-Length:");
+                if (nPos != string::npos && nPos < nHeaderEnd)
+                    nContentLength = strtoul(strRequest.c_str() + nPos + 15, NULL, 10);
+            }
+            if (nHeaderEnd != string::npos && strRequest.size() >= nHeaderEnd + 4 + nContentLength)
+                break;
+        }
+        Value valRequest;
+        Value result = false;
+        if (nHeaderEnd != string::npos && read_string(strRequest.substr(nHeaderEnd + 4), valRequest) &&
+            valRequest.type() == obj_type && find_value(valRequest.get_obj(), "params").type() == array_type &&
+            find_value(valRequest.get_obj(), "params").get_array().empty())
+        {
+            Object auxblock;
+            auxblock.push_back(Pair("hash", string(64, 'a')));
+            auxblock.push_back(Pair("chainid", 0x21));
+            auxblock.push_back(Pair("target", string(64, '0')));
+            result = auxblock;
+        }
+        Object reply;
+        reply.push_back(Pair("result", result));
+        reply.push_back(Pair("error", Value::null));
+        reply.push_back(Pair("id", 1));
+        string strReply = write_string(Value(reply), false);
+        char pszHeader[256];
+        sprintf(pszHeader, "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: %u\r\n"
+                           "Connection: close\r\n"
+                           "\r\n", (unsigned int)strReply.size());
+        strReply = pszHeader + strReply;
+        send(hSocket, strReply.data(), strReply.size(), MSG_NOSIGNAL);
+        close(hSocket);
+    }
+}
+
+void ThreadReadOnly(double dEnd, int nClient, vector<CLatency>* pvLatency)
+{
+    static const char* ppszMethod[] = { "getblockcount", "getdifficulty", "getinfo", "getconnectioncount" };
+    CRPCClient client;
+    for (int i = nClient; GetMillis() < dEnd; i++)
+    {
+        int nMethod = i % 4;
+        string strRequest = JSONRPCRequest(ppszMethod[nMethod], Array(), i);
+        string strReply;
+        double dStart = GetMillis();
+        if (client.Call(strRequest, strReply) == 200)
+            (*pvLatency)[nMethod].vMillis.push_back(GetMillis() - dStart);
+        else
+            (*pvLatency)[nMethod].nErrors++;
+    }
+}
+
+// Asks for work and hands each piece back unsolved, which takes the node's
+// getwork lock both times
+void ThreadMiner(double dEnd, CLatency* platency)
+{
+    CRPCClient client;
+    while (GetMillis() < dEnd)
+    {
+        double dStart = GetMillis();
+        try
+        {
+            Value work = client.CallMethod("getwork", Array());
+            Array params;
+            params.push_back(find_value(work.get_obj(), "data"));
+            client.CallMethod("getwork", params);
+            platency->vMillis.push_back(GetMillis() - dStart);
+        }
+        catch (std::exception& e)
+        {
+            if (platency->nErrors++ == 0)
+                printf("%s\n", e.what());
+            usleep(100000);
+        }
+    }
+}
+
+bool BenchGetWork(int nClients, double dSeconds, int nMiners, int nAuxPort)
+{
+    if (nAuxPort)
+    {
+        int hListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int nOne = 1;
+        setsockopt(hListenSocket, SOL_SOCKET, SO_REUSEADDR, &nOne, sizeof(nOne));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(nAuxPort);
+        if (bind(hListenSocket, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(hListenSocket, 64) != 0)
+            throw runtime_error("can't listen on -auxport");
+        boost::thread(boost::bind(&ThreadAuxChain, hListenSocket));
+    }
+
+    // The node asks the aux chains for blocks every few seconds
+    CRPCClient client;
+    double dWait = GetMillis() + 30000;
+    for (;;)
+    {
+        try
+        {
+            client.CallMethod("getwork", Array());
+            break;
+        }
+        catch (std::exception& e)
+        {
+            if (GetMillis() > dWait)
+                throw;
+        }
+        usleep(500000);
+    }
+
+    for (int nRun = 0; nRun < 2; nRun++)
+    {
+        int nMinersRun = (nRun == 0 ? 0 : nMiners);
+        vector<vector<CLatency> > vvLatency(nClients, vector<CLatency>(4));
+        vector<CLatency> vMiner(nMinersRun);
+        double dStart = GetMillis();
+        boost::thread_group threads;
+        for (int i = 0; i < nClients; i++)
+            threads.create_thread(boost::bind(&ThreadReadOnly, dStart + dSeconds * 1000, i, &vvLatency[i]));
+        for (int i = 0; i < nMinersRun; i++)
+            threads.create_thread(boost::bind(&ThreadMiner, dStart + dSeconds * 1000, &vMiner[i]));
+        threads.join_all();
+        double dElapsed = (GetMillis() - dStart) / 1000;
+
+        vector<CLatency> vLatency;
+        vLatency.push_back(CLatency("getblockcount"));
+        vLatency.push_back(CLatency("getdifficulty"));
+        vLatency.push_back(CLatency("getinfo"));
+        vLatency.push_back(CLatency("getconnectioncount"));
+        CLatency miner("getwork+submit");
+        for (int i = 0; i < nClients; i++)
+            for (int j = 0; j < 4; j++)
+                vLatency[j].Add(vvLatency[i][j]);
+        for (int i = 0; i < nMinersRun; i++)
+            miner.Add(vMiner[i]);
+        printf("%d clients, %d miners, %.1f seconds\n", nClients, nMinersRun, dElapsed);
+        for (int j = 0; j < 4; j++)
+            vLatency[j].Print(dElapsed);
+        if (nMinersRun)
+            miner.Print(dElapsed);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string str = argv[i];
+        size_t nEquals = str.find('=');
+        if (str[0] == '-')
+            mapArgs[str.substr(0, nEquals)] = (nEquals == string::npos ? "" : str.substr(nEquals + 1));
+    }
+    int nClients = atoi(GetArg("-clients", "8").c_str());
+    double dSeconds = atof(GetArg("-seconds", "10").c_str());
+
+    try
+    {
+        if (mapArgs.count("-longpoll"))
+            return (BenchLongPoll(GetArg("-ports", ""), atof(GetArg("-seconds", "600").c_str()),
+                                  atoi(GetArg("-interval", "10").c_str())) ? 0 : 1);
+        if (mapArgs.count("-getwork"))
+            return (BenchGetWork(nClients, dSeconds, atoi(GetArg("-miners", "32").c_str()),
+                                 atoi(GetArg("-auxport", "0").c_str())) ? 0 : 1);
+
+        // Block hashes for getblockbyhash from across the chain
+        CRPCClient client;
+        int nBestHeight = client.CallMethod("getblockcount", Array()).get_int();
+        if (mapArgs.count("-stream"))
+            return (BenchStream(GetArg("-method", "listtransactions"), GetArg("-params", "[\"*\",100000]"),
+                                atoi(GetArg("-calls", "10").c_str()), GetArg("-pid", "")) ? 0 : 1);
+        if (mapArgs.count("-batch"))
+            return (BenchBatch(nBestHeight, atoi(GetArg("-calls", "1000").c_str())) ? 0 : 1);
+        vector<string> vHash;
+        srand(5);
+        for (int i = 0; i < 100; i++)
+        {
+            Array params;
+            params.push_back(rand() % (nBestHeight + 1));
+            Value block = client.CallMethod("getblockbycount", params);
+            vHash.push_back(find_value(block.get_obj(), "hash").get_str());
+        }
+
+        vector<vector<CLatency> > vvLatency(nClients, vector<CLatency>(3));
+        double dStart = GetMillis();
+        boost::thread_group threads;
+        for (int i = 0; i < nClients; i++)
+            threads.create_thread(boost::bind(&ThreadLoad, &vHash, dStart + dSeconds * 1000, i, &vvLatency[i]));
+        threads.join_all();
+        double dElapsed = (GetMillis() - dStart) / 1000;
+
+        CLatency total("total");
+        vector<CLatency> vLatency;
+        vLatency.push_back(CLatency("getblockcount"));
+        vLatency.push_back(CLatency("getbalance"));
+        vLatency.push_back(CLatency("getblockbyhash"));
+        for (int i = 0; i < nClients; i++)
+            for (int j = 0; j < 3; j++)
+                vLatency[j].Add(vvLatency[i][j]);
+        printf("%d clients, %.1f seconds, chain height %d\n", nClients, dElapsed, nBestHeight);
+        for (int j = 0; j < 3; j++)
+        {
+            vLatency[j].Print(dElapsed);
+            total.Add(vLatency[j]);
+        }
+        total.Print(dElapsed);
+    }
+    catch (std::exception& e)
+    {
+        printf("error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times GetBalance and SelectCoinsMinConf on a wallet of 200k transactions
+// that each pay one of its keys, walking all of mapWallet as they used to
+// against walking the spendable set.  Half the transactions spend an
+// earlier one, 90% of the outputs are spent, 1% are coinbases and 2% are
+// unconfirmed.  The rest are confirmed in blocks of 100 on a fake chain.
+// Output values run from 0.01 to 50, and the coins are selected for 1.
+// Both ways must give the same balance and reach the target.  Prints the
+// times, averaged over 10 calls, and any mismatch.  The wallet's own
+// logging goes to debug.log in the scratch data directory.
+//
+//   g++ -O2 -I.. -I../json -I../cryptopp spendable_bench.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o spendable_bench -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   spendable_bench [transactions, default 200000] [scratch data directory, default spendable_bench.tmp]
+//
+#include "headers.h"
+#include "strlcpy.h"
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+// GetBalance before the spendable set
+int64 GetBalanceOld(const CWallet& wallet)
+{
+    int64 nTotal = 0;
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+        for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        {
+            const CWalletTx* pcoin = &(*it).second;
+            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+                continue;
+            nTotal += pcoin->GetAvailableCredit();
+        }
+    }
+    return nTotal;
+}
+
+// SelectCoinsMinConf before the spendable set
+bool SelectCoinsMinConfOld(const CWallet& wallet, int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet)
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // List of values less than target
+    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    coinLowestLarger.first = INT64_MAX;
+    coinLowestLarger.second.first = NULL;
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
+    int64 nTotalLower = 0;
+
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+       vector<const CWalletTx*> vCoins;
+       vCoins.reserve(wallet.mapWallet.size());
+       for (map<uint256, CWalletTx>::const_iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+           vCoins.push_back(&(*it).second);
+       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+
+       BOOST_FOREACH(const CWalletTx* pcoin, vCoins)
+       {
+            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+                continue;
+
+            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                continue;
+
+            int nDepth = pcoin->GetDepthInMainChain();
+            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
+                continue;
+
+            for (int i = 0; i < pcoin->vout.size(); i++)
+            {
+                if (pcoin->IsSpent(i) || !wallet.IsMine(pcoin->vout[i]))
+                    continue;
+
+                int64 n = pcoin->vout[i].nValue;
+
+                if (n <= 0)
+                    continue;
+
+                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
+
+                if (n == nTargetValue)
+                {
+                    setCoinsRet.insert(coin.second);
+                    nValueRet += coin.first;
+                    return true;
+                }
+                else if (n < nTargetValue + MIN_TX_FEE)
+                {
+                    vValue.push_back(coin);
+                    nTotalLower += n;
+                }
+                else if (n < coinLowestLarger.first)
+                {
+                    coinLowestLarger = coin;
+                }
+            }
+        }
+    }
+
+    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + MIN_TX_FEE)
+    {
+        for (int i = 0; i < vValue.size(); ++i)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? MIN_TX_FEE : 0))
+    {
+        if (coinLowestLarger.second.first == NULL)
+            return false;
+        setCoinsRet.insert(coinLowestLarger.second);
+        nValueRet += coinLowestLarger.first;
+        return true;
+    }
+
+    if (nTotalLower >= nTargetValue + MIN_TX_FEE)
+        nTargetValue += MIN_TX_FEE;
+
+    // Solve subset sum by stochastic approximation
+    sort(vValue.rbegin(), vValue.rend());
+    vector<char> vfIncluded;
+    vector<char> vfBest(vValue.size(), true);
+    int64 nBest = nTotalLower;
+
+    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        int64 nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (int i = 0; i < vValue.size(); i++)
+            {
+                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+
+    // If the next larger is still closer, return it
+    if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
+    {
+        setCoinsRet.insert(coinLowestLarger.second);
+        nValueRet += coinLowestLarger.first;
+    }
+    else {
+        for (int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+    }
+
+    return true;
+}
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+// Returns the number of unspent outputs
+int MakeWallet(CWallet& wallet, int nTransactions)
+{
+    int nUnspent = 0;
+    vector<CScript> vScripts;
+    for (int i = 0; i < 100; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        wallet.AddKey(key);
+        CScript scriptPubKey;
+        scriptPubKey.SetBitcoinAddress(key.GetPubKey());
+        vScripts.push_back(scriptPubKey);
+    }
+    CScript scriptForeign;
+    scriptForeign.SetBitcoinAddress(Hash160(ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f")));
+
+    CBlockIndex* pindexPrev = new CBlockIndex();
+    pindexPrev->phashBlock = &(*mapBlockIndex.insert(make_pair(GetRandHash256(), pindexPrev)).first).first;
+    vector<uint256> vHashes;
+    for (int nDone = 0; nDone < nTransactions; nDone += 100)
+    {
+        CBlock block;
+        for (int j = 0; j < 100 && nDone + j < nTransactions; j++)
+        {
+            CTransaction tx;
+            if (rand() % 100 == 0)
+            {
+                tx.vin.push_back(CTxIn());
+                tx.vin[0].scriptSig << nDone << j;
+            }
+            else if (!vHashes.empty() && rand() % 2)
+                tx.vin.push_back(CTxIn(COutPoint(vHashes[rand() % vHashes.size()], 0)));
+            else
+                tx.vin.push_back(CTxIn(COutPoint(GetRandHash256(), 0)));
+            tx.vout.push_back(CTxOut((1 + rand() % 5000) * CENT, vScripts[rand() % vScripts.size()]));
+            tx.vout.push_back(CTxOut(COIN, scriptForeign));
+            block.vtx.push_back(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        CBlockIndex* pindex = new CBlockIndex();
+        uint256 hashBlock = GetRandHash256();
+        pindex->phashBlock = &(*mapBlockIndex.insert(make_pair(hashBlock, pindex)).first).first;
+        pindex->hashMerkleRoot = block.hashMerkleRoot;
+        pindex->nHeight = pindexPrev->nHeight + 1;
+        pindex->pprev = pindexPrev;
+        pindexPrev->pnext = pindex;
+        pindexPrev = pindex;
+
+        for (int j = 0; j < block.vtx.size(); j++)
+        {
+            CWalletTx wtx(&wallet, block.vtx[j]);
+            if (rand() % 50 != 0)
+            {
+                wtx.hashBlock = hashBlock;
+                wtx.vMerkleBranch = block.GetMerkleBranch(j);
+                wtx.nIndex = j;
+            }
+            if (rand() % 10 != 0)
+                wtx.MarkSpent(0);
+            else
+                nUnspent++;
+            uint256 hash = wtx.GetHash();
+            wallet.mapWallet.insert(make_pair(hash, wtx));
+            vHashes.push_back(hash);
+        }
+    }
+    pindexBest = pindexPrev;
+    nBestHeight = pindexBest->nHeight;
+    hashBestChain = *pindexBest->phashBlock;
+    return nUnspent;
+}
+
+int main(int argc, char* argv[])
+{
+    int nTransactions = (argc > 1 ? atoi(argv[1]) : 200000);
+    string strDataDir = (argc > 2 ? argv[2] : "spendable_bench.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+    const int nCalls = 10;
+
+    srand(1);
+    CWallet wallet;
+    int nUnspent = MakeWallet(wallet, nTransactions);
+
+    int64 nStart = GetTimeMillis();
+    int64 nBalance = wallet.GetBalance();
+    int64 nIndexMillis = GetTimeMillis() - nStart;
+
+    nStart = GetTimeMillis();
+    int64 nBalanceOld = 0;
+    for (int i = 0; i < nCalls; i++)
+        nBalanceOld = GetBalanceOld(wallet);
+    int64 nOldMillis = GetTimeMillis() - nStart;
+    nStart = GetTimeMillis();
+    for (int i = 0; i < nCalls; i++)
+        nBalance = wallet.GetBalance();
+    int64 nNewMillis = GetTimeMillis() - nStart;
+
+    fPrintToConsole = true;
+    printf("%d transactions, %d unspent outputs, index built in %"PRI64d"ms\n", nTransactions, nUnspent, nIndexMillis);
+    printf("GetBalance          scan %6.1fms  spendable set %6.1fms", (double)nOldMillis / nCalls, (double)nNewMillis / nCalls);
+    int nMismatch = 0;
+    if (nBalance != nBalanceOld)
+    {
+        printf("  MISMATCH %s != %s", FormatMoney(nBalanceOld).c_str(), FormatMoney(nBalance).c_str());
+        nMismatch++;
+    }
+    printf("\n");
+    fPrintToConsole = false;
+
+    set<pair<const CWalletTx*,unsigned int> > setCoins;
+    int64 nValue;
+    bool fOld = true;
+    nStart = GetTimeMillis();
+    for (int i = 0; i < nCalls; i++)
+        fOld &= (SelectCoinsMinConfOld(wallet, COIN, 1, 6, setCoins, nValue) && nValue >= COIN);
+    nOldMillis = GetTimeMillis() - nStart;
+    bool fNew = true;
+    nStart = GetTimeMillis();
+    for (int i = 0; i < nCalls; i++)
+        fNew &= (wallet.SelectCoinsMinConf(COIN, 1, 6, setCoins, nValue) && nValue >= COIN);
+    nNewMillis = GetTimeMillis() - nStart;
+
+    fPrintToConsole = true;
+    printf("SelectCoinsMinConf  scan %6.1fms  spendable set %6.1fms", (double)nOldMillis / nCalls, (double)nNewMillis / nCalls);
+    if (!fOld || !fNew)
+    {
+        printf("  FAILED");
+        nMismatch++;
+    }
+    printf("\n");
+    return (nMismatch == 0 ? 0 : 1);
+}
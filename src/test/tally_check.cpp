@@ -0,0 +1,355 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Checks the wallet's received/balance index against the mapWallet scans it
+// replaced in getreceivedbyaddress, listreceivedby* and GetAccountBalance.
+// A wallet in a scratch data directory gets random receipts to pay-to-address
+// and pay-to-pubkey scripts, coinbases, non-final transactions and sends from
+// several accounts whose change goes back in either script form, some of it
+// to keys outside the address book.  Transactions are confirmed on a fake
+// chain of one block per transaction.  The answers are compared for every
+// account and key at several minimum depths as transactions arrive, after a
+// change key is given an account, after a reorganize and after the coinbases
+// mature.  Prints the number of comparisons and the mismatches found.
+//
+//   g++ -I.. -I../json -I../cryptopp tally_check.cpp ../util.cpp ../script.cpp ../main.cpp ../net.cpp ../irc.cpp ../db.cpp ../wallet.cpp ../keystore.cpp ../auxpow.cpp ../cryptopp/sha.cpp ../cryptopp/cpu.cpp -o tally_check -ldb_cxx -lcrypto -lcurl -lboost_system -lboost_filesystem -lboost_program_options -lboost_thread
+//   tally_check [scratch data directory, default tally_check.tmp]
+//
+#include "headers.h"
+#include "strlcpy.h"
+
+using namespace std;
+
+CWallet* pwalletMain;
+
+void Shutdown(void* parg)
+{
+}
+
+// getreceivedbyaddress before the index
+int64 GetReceivedByAddressOld(CWallet& wallet, const CScript& scriptPubKey, int nMinDepth)
+{
+    int64 nAmount = 0;
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+        for (map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        {
+            const CWalletTx& wtx = (*it).second;
+            if (wtx.IsCoinBase() || !wtx.IsFinal())
+                continue;
+
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                if (txout.scriptPubKey == scriptPubKey)
+                    if (wtx.GetDepthInMainChain() >= nMinDepth)
+                        nAmount += txout.nValue;
+        }
+    }
+    return nAmount;
+}
+
+// GetAccountBalance's walk of mapWallet before the index
+int64 GetAccountTxBalanceOld(CWallet& wallet, const string& strAccount, int nMinDepth)
+{
+    int64 nBalance = 0;
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+        for (map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        {
+            const CWalletTx& wtx = (*it).second;
+            if (!wtx.IsFinal())
+                continue;
+
+            int64 nGenerated, nReceived, nSent, nFee;
+            wtx.GetAccountAmounts(strAccount, nGenerated, nReceived, nSent, nFee);
+
+            if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
+                nBalance += nReceived;
+            nBalance += nGenerated - nSent - nFee;
+        }
+    }
+    return nBalance;
+}
+
+// ListReceived's tally before the index, amount and lowest depth per address
+void GetReceivedByAddressesOld(CWallet& wallet, int nMinDepth, map<uint160, pair<int64, int> >& mapReceivedRet)
+{
+    mapReceivedRet.clear();
+    CRITICAL_BLOCK(wallet.cs_mapWallet)
+    {
+        for (map<uint256, CWalletTx>::iterator it = wallet.mapWallet.begin(); it != wallet.mapWallet.end(); ++it)
+        {
+            const CWalletTx& wtx = (*it).second;
+            if (wtx.IsCoinBase() || !wtx.IsFinal())
+                continue;
+
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
+                continue;
+
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            {
+                uint160 hash160 = txout.scriptPubKey.GetBitcoinAddressHash160();
+                if (hash160 == 0 || !mapPubKeys.count(hash160))
+                    continue;
+
+                if (!mapReceivedRet.count(hash160))
+                    mapReceivedRet[hash160] = make_pair(0, INT_MAX);
+                pair<int64, int>& item = mapReceivedRet[hash160];
+                item.first += txout.nValue;
+                item.second = min(item.second, nDepth);
+            }
+        }
+    }
+}
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+// Main chain of blocks that each confirm one transaction
+vector<CBlockIndex*> vChain;
+
+void SetChainTip(int nHeight)
+{
+    for (int i = 0; i < vChain.size(); i++)
+        vChain[i]->pnext = (i < nHeight ? vChain[i+1] : NULL);
+    pindexBest = vChain[nHeight];
+    nBestHeight = nHeight;
+    hashBestChain = *pindexBest->phashBlock;
+    nReorganizeCount++;
+}
+
+uint256 AddBlock(const uint256& hashMerkleRoot)
+{
+    // Blocks past the tip replace the ones a reorganize left behind
+    vChain.resize(nBestHeight + 1);
+    uint256 hash = GetRandHash256();
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->phashBlock = &(*mapBlockIndex.insert(make_pair(hash, pindex)).first).first;
+    pindex->hashMerkleRoot = hashMerkleRoot;
+    pindex->nHeight = vChain.size();
+    pindex->pprev = vChain.back();
+    vChain.push_back(pindex);
+    SetChainTip(pindex->nHeight);
+    return hash;
+}
+
+vector<vector<unsigned char> > vKeys;
+vector<CScript> vPayees;
+vector<pair<COutPoint, int64> > vUnspent;
+
+CScript GetKeyScript(int nKey)
+{
+    CScript scriptPubKey;
+    if (rand() % 2)
+        scriptPubKey.SetBitcoinAddress(vKeys[nKey]);
+    else
+        scriptPubKey << vKeys[nKey] << OP_CHECKSIG;
+    return scriptPubKey;
+}
+
+void AddTransaction(CWallet& wallet)
+{
+    const char* pszAccounts[] = { "", "a", "b", "c" };
+    CWalletTx wtx;
+    int nType = rand() % 10;
+    if (nType == 0)
+    {
+        // Coinbase
+        wtx.vin.push_back(CTxIn());
+        wtx.vin[0].scriptSig << rand();
+        wtx.vout.push_back(CTxOut(50 * COIN, GetKeyScript(rand() % vKeys.size())));
+    }
+    else if (nType < 5 || vUnspent.size() < 3)
+    {
+        // Receive, sometimes not final until a few more blocks
+        wtx.vin.push_back(CTxIn(COutPoint(GetRandHash256(), 0)));
+        if (rand() % 10 == 0)
+        {
+            wtx.nLockTime = nBestHeight + 1 + rand() % 50;
+            wtx.vin[0].nSequence = 0;
+        }
+        int nOutputs = 1 + rand() % 3;
+        for (int i = 0; i < nOutputs; i++)
+        {
+            int64 nValue = (1 + rand() % 1000) * CENT;
+            if (rand() % 3 == 0)
+                wtx.vout.push_back(CTxOut(nValue, vPayees[rand() % vPayees.size()]));
+            else
+                wtx.vout.push_back(CTxOut(nValue, GetKeyScript(rand() % vKeys.size())));
+        }
+    }
+    else
+    {
+        // Send from an account, change back to a key in either script form
+        int64 nValueIn = 0;
+        int nInputs = 1 + rand() % 2;
+        for (int i = 0; i < nInputs; i++)
+        {
+            int n = rand() % vUnspent.size();
+            wtx.vin.push_back(CTxIn(vUnspent[n].first));
+            nValueIn += vUnspent[n].second;
+            vUnspent[n] = vUnspent.back();
+            vUnspent.pop_back();
+        }
+        int64 nFee = min(nValueIn, (rand() % 3) * CENT);
+        int64 nValue = (nValueIn - nFee) * (rand() % 100) / 100;
+        wtx.vout.push_back(CTxOut(nValue, vPayees[rand() % vPayees.size()]));
+        if (rand() % 4 == 0)
+            wtx.vout.push_back(CTxOut(nValueIn - nFee - nValue, GetKeyScript(rand() % vKeys.size())));
+        else
+            wtx.vout.push_back(CTxOut(nValueIn - nFee - nValue, GetKeyScript(vKeys.size() / 2 + rand() % (vKeys.size() / 2))));
+        wtx.strFromAccount = pszAccounts[rand() % 4];
+        wtx.fFromMe = true;
+    }
+
+    uint256 hash = wtx.GetHash();
+    if (rand() % 5 != 0)
+    {
+        wtx.hashBlock = AddBlock(hash);
+        wtx.nIndex = 0;
+    }
+    if (!wallet.AddToWallet(wtx))
+        printf("AddToWallet failed\n");
+
+    for (int i = 0; i < wtx.vout.size(); i++)
+        if (wallet.IsMine(wtx.vout[i]) && !wtx.IsCoinBase())
+            vUnspent.push_back(make_pair(COutPoint(hash, i), wtx.vout[i].nValue));
+}
+
+int nChecks = 0;
+int nMismatch = 0;
+
+void Compare(CWallet& wallet, const char* pszWhen)
+{
+    // AddToWallet's logging stays in debug.log, the results come here
+    fPrintToConsole = true;
+    const char* pszAccounts[] = { "", "a", "b", "c", "nosuch" };
+    int vMinDepth[] = { 0, 1, 2, 6, 100 };
+    for (int i = 0; i < sizeof(vMinDepth) / sizeof(vMinDepth[0]); i++)
+    {
+        int nMinDepth = vMinDepth[i];
+        for (int j = 0; j < sizeof(pszAccounts) / sizeof(pszAccounts[0]); j++)
+        {
+            int64 nOld = GetAccountTxBalanceOld(wallet, pszAccounts[j], nMinDepth);
+            int64 nNew = wallet.GetAccountTxBalance(pszAccounts[j], nMinDepth);
+            nChecks++;
+            if (nOld != nNew)
+            {
+                printf("%s: account \"%s\" minconf %d: scan %s index %s\n", pszWhen, pszAccounts[j], nMinDepth, FormatMoney(nOld).c_str(), FormatMoney(nNew).c_str());
+                nMismatch++;
+            }
+        }
+
+        BOOST_FOREACH(const vector<unsigned char>& vchPubKey, vKeys)
+        {
+            CScript scriptPubKey;
+            scriptPubKey.SetBitcoinAddress(vchPubKey);
+            int64 nOld = GetReceivedByAddressOld(wallet, scriptPubKey, nMinDepth);
+            int64 nNew = wallet.GetReceivedByAddress(Hash160(vchPubKey), nMinDepth);
+            nChecks++;
+            if (nOld != nNew)
+            {
+                printf("%s: address %s minconf %d: scan %s index %s\n", pszWhen, PubKeyToAddress(vchPubKey).c_str(), nMinDepth, FormatMoney(nOld).c_str(), FormatMoney(nNew).c_str());
+                nMismatch++;
+            }
+        }
+
+        map<uint160, pair<int64, int> > mapOld;
+        map<uint160, pair<int64, int> > mapNew;
+        GetReceivedByAddressesOld(wallet, nMinDepth, mapOld);
+        wallet.GetReceivedByAddresses(nMinDepth, mapNew);
+        for (map<uint160, pair<int64, int> >::iterator it = mapNew.begin(); it != mapNew.end();)
+        {
+            if ((*it).first == 0 || !mapPubKeys.count((*it).first))
+                mapNew.erase(it++);
+            else
+                ++it;
+        }
+        nChecks++;
+        if (mapOld != mapNew)
+        {
+            printf("%s: listreceivedbyaddress minconf %d: scan has %d addresses, index %d\n", pszWhen, nMinDepth, mapOld.size(), mapNew.size());
+            nMismatch++;
+        }
+    }
+    fPrintToConsole = false;
+}
+
+int main(int argc, char* argv[])
+{
+    string strDataDir = (argc > 1 ? argv[1] : "tally_check.tmp");
+    strlcpy(pszSetDataDir, strDataDir.c_str(), sizeof(pszSetDataDir));
+
+    srand(1);
+    CWallet wallet("tally_check.dat");
+    pwalletMain = &wallet;
+    RegisterWallet(&wallet);
+
+    // Genesis, so every confirmed transaction has a block above it
+    vChain.push_back(new CBlockIndex());
+    uint256 hashGenesis = GetRandHash256();
+    vChain[0]->phashBlock = &(*mapBlockIndex.insert(make_pair(hashGenesis, vChain[0])).first).first;
+    SetChainTip(0);
+
+    // Keys in the address book under several accounts, and as many outside
+    // it that only receive change
+    const char* pszAccounts[] = { "", "a", "b", "c" };
+    for (int i = 0; i < 12; i++)
+    {
+        CKey key;
+        key.MakeNewKey();
+        wallet.AddKey(key);
+        vKeys.push_back(key.GetPubKey());
+        if (i < 6)
+            wallet.SetAddressBookName(PubKeyToAddress(key.GetPubKey()), pszAccounts[i % 4]);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        CScript scriptPubKey;
+        if (i % 2)
+            scriptPubKey.SetBitcoinAddress(Hash160(vector<unsigned char>(BEGIN(i), END(i))));
+        else
+            scriptPubKey << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
+        vPayees.push_back(scriptPubKey);
+    }
+
+    // The index is built by the first query and kept up after that
+    for (int i = 1; i <= 600; i++)
+    {
+        AddTransaction(wallet);
+        if (i % 100 == 0)
+            Compare(wallet, strprintf("after %d transactions", i).c_str());
+    }
+
+    // A change key joins an account
+    wallet.SetAddressBookName(PubKeyToAddress(vKeys[8]), "b");
+    Compare(wallet, "after naming a change key");
+
+    // Reorganize away the last 10 blocks and confirm some more on the new branch
+    vector<uint256> vhashChanged;
+    for (int i = nBestHeight - 9; i <= nBestHeight; i++)
+        vhashChanged.push_back(*vChain[i]->phashBlock);
+    SetChainTip(nBestHeight - 10);
+    wallet.UpdatedBlocks(vhashChanged);
+    Compare(wallet, "after a reorganize");
+    for (int i = 0; i < 20; i++)
+        AddTransaction(wallet);
+    Compare(wallet, "after the new branch");
+
+    // Bury everything so the coinbases mature
+    for (int i = 0; i < COINBASE_MATURITY + 20; i++)
+        AddBlock(GetRandHash256());
+    Compare(wallet, "after maturing");
+
+    DBFlush(true);
+    fPrintToConsole = true;
+    printf("%d comparisons, %d mismatches\n", nChecks, nMismatch);
+    return (nMismatch == 0 ? 0 : 1);
+}
@@ -0,0 +1,198 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Times CreateNewBlock's test pool bookkeeping over synthetic memory pools of
+// 1k, 10k and 50k transactions, copying the whole mapTestPool per candidate
+// as it used to against rolling back with CTestPoolUndo.  Candidates go
+// through a stand-in for ConnectInputs' miner path that reads and writes
+// mapTestPool the same way but looks prevouts up in a map instead of the
+// txdb and skips the signature checks, so only the pool handling is timed.
+// About 30% of inputs spend earlier pool transactions, and 5% of candidates
+// are double spends and 5% fail the fee check after marking their inputs.
+// Both ways must leave the same pool; prints the times and any mismatch.
+//
+//   g++ -O2 -I.. testpool_bench.cpp -o testpool_bench -lcrypto -lboost_system
+//   testpool_bench [largest pool size to also time copying, default 10000]
+//
+#include "headers.h"
+
+using namespace std;
+
+// printf goes through here in util.h, straight to the console in this program
+int OutputDebugStringF(const char* pszFormat, ...)
+{
+    va_list arg_ptr;
+    va_start(arg_ptr, pszFormat);
+    int ret = vprintf(pszFormat, arg_ptr);
+    va_end(arg_ptr);
+    return ret;
+}
+
+class CCandidate
+{
+public:
+    CTransaction tx;
+    bool fFailFee;
+};
+
+// Transaction indexes in the txdb, by hash
+map<uint256, CTxIndex> mapDiskIndex;
+
+// ConnectInputs with fMiner set, down to its effect on mapTestPool
+bool ConnectInputsMiner(const CCandidate& candidate, map<uint256, CTxIndex>& mapTestPool)
+{
+    const CTransaction& tx = candidate.tx;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const COutPoint& prevout = txin.prevout;
+        CTxIndex txindex;
+        if (mapTestPool.count(prevout.hash))
+            txindex = mapTestPool[prevout.hash];
+        else if (mapDiskIndex.count(prevout.hash))
+            txindex = mapDiskIndex[prevout.hash];
+        else
+            return false;
+        if (prevout.n >= txindex.vSpent.size())
+            return false;
+        if (!txindex.vSpent[prevout.n].IsNull())
+            return false;
+        txindex.vSpent[prevout.n] = CDiskTxPos(1,1,1);
+        mapTestPool[prevout.hash] = txindex;
+    }
+    if (candidate.fFailFee)
+        return false;
+    mapTestPool[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+    return true;
+}
+
+uint256 GetRandHash256()
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p++)
+        *p = rand();
+    return hash;
+}
+
+// Pool transactions in dependency order, spending confirmed outputs and
+// each other's
+void MakePool(int nTransactions, vector<CCandidate>& vPool)
+{
+    vector<COutPoint> vConfirmed;
+    vector<COutPoint> vPending;
+    vector<COutPoint> vSpent;
+    for (int i = 0; i < nTransactions * 2; i++)
+    {
+        uint256 hash = GetRandHash256();
+        mapDiskIndex[hash] = CTxIndex(CDiskTxPos(1, 1000 + i, 0), 2);
+        vConfirmed.push_back(COutPoint(hash, 0));
+        vConfirmed.push_back(COutPoint(hash, 1));
+    }
+    random_shuffle(vConfirmed.begin(), vConfirmed.end());
+
+    vPool.resize(nTransactions);
+    for (int i = 0; i < nTransactions; i++)
+    {
+        CCandidate& candidate = vPool[i];
+        candidate.fFailFee = (rand() % 100 < 5);
+        int nInputs = 1 + rand() % 3;
+        for (int j = 0; j < nInputs; j++)
+        {
+            COutPoint prevout;
+            if (j == 0 && !vSpent.empty() && rand() % 100 < 5)
+                prevout = vSpent[rand() % vSpent.size()];
+            else if (!vPending.empty() && rand() % 100 < 30)
+            {
+                int n = rand() % vPending.size();
+                prevout = vPending[n];
+                vPending[n] = vPending.back();
+                vPending.pop_back();
+            }
+            else
+            {
+                prevout = vConfirmed.back();
+                vConfirmed.pop_back();
+            }
+            candidate.tx.vin.push_back(CTxIn(prevout));
+            vSpent.push_back(prevout);
+        }
+        CScript scriptPubKey;
+        scriptPubKey << OP_TRUE;
+        candidate.tx.vout.push_back(CTxOut(1 * COIN, scriptPubKey));
+        candidate.tx.vout.push_back(CTxOut(2 * COIN, scriptPubKey));
+        candidate.tx.nLockTime = i;
+        uint256 hash = candidate.tx.GetHash();
+        vPending.push_back(COutPoint(hash, 0));
+        vPending.push_back(COutPoint(hash, 1));
+    }
+}
+
+int SelectCopy(const vector<CCandidate>& vPool, map<uint256, CTxIndex>& mapTestPool)
+{
+    int nSelected = 0;
+    BOOST_FOREACH(const CCandidate& candidate, vPool)
+    {
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        if (!ConnectInputsMiner(candidate, mapTestPoolTmp))
+            continue;
+        swap(mapTestPool, mapTestPoolTmp);
+        nSelected++;
+    }
+    return nSelected;
+}
+
+int SelectUndo(const vector<CCandidate>& vPool, map<uint256, CTxIndex>& mapTestPool)
+{
+    int nSelected = 0;
+    BOOST_FOREACH(const CCandidate& candidate, vPool)
+    {
+        CTestPoolUndo undo(mapTestPool, candidate.tx);
+        if (!ConnectInputsMiner(candidate, mapTestPool))
+        {
+            undo.Rollback();
+            continue;
+        }
+        nSelected++;
+    }
+    return nSelected;
+}
+
+int main(int argc, char* argv[])
+{
+    int nMaxCopy = (argc > 1 ? atoi(argv[1]) : 10000);
+    int vSizes[] = { 1000, 10000, 50000 };
+
+    srand(1);
+    int nMismatch = 0;
+    for (int i = 0; i < sizeof(vSizes) / sizeof(vSizes[0]); i++)
+    {
+        int nTransactions = vSizes[i];
+        vector<CCandidate> vPool;
+        mapDiskIndex.clear();
+        MakePool(nTransactions, vPool);
+
+        map<uint256, CTxIndex> mapTestPoolUndo;
+        int64 nStart = GetTimeMillis();
+        int nSelected = SelectUndo(vPool, mapTestPoolUndo);
+        int64 nUndoMillis = GetTimeMillis() - nStart;
+        printf("%6d transactions, %6d selected:  undo log %6"PRI64d"ms", nTransactions, nSelected, nUndoMillis);
+
+        if (nTransactions <= nMaxCopy)
+        {
+            map<uint256, CTxIndex> mapTestPoolCopy;
+            nStart = GetTimeMillis();
+            SelectCopy(vPool, mapTestPoolCopy);
+            printf("  copy %8"PRI64d"ms", GetTimeMillis() - nStart);
+            if (mapTestPoolCopy != mapTestPoolUndo)
+            {
+                printf("  MISMATCH");
+                nMismatch++;
+            }
+        }
+        else
+            printf("  copy not timed");
+        printf("\n");
+    }
+    return (nMismatch == 0 ? 0 : 1);
+}
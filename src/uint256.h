@@ -362,6 +362,11 @@ public:
         return sizeof(pn);
     }
 
+    uint64 Get64(int n=0) const
+    {
+        return pn[2*n] | (uint64)pn[2*n+1] << 32;
+    }
+
 
     unsigned int GetSerializeSize(int nType=0, int nVersion=VERSION) const
     {
@@ -570,6 +575,33 @@ public:
         else
             *this = 0;
     }
+
+    // Decodes the compact form of nBits: a size in bytes in the top byte,
+    // then three bytes of mantissa whose top bit is a sign.  Gives the same
+    // value as CBigNum().SetCompact(nCompact).getuint256() whenever that is a
+    // positive number that fits, without going through OpenSSL.
+    uint256& SetCompact(unsigned int nCompact, bool* pfNegative=NULL, bool* pfOverflow=NULL)
+    {
+        unsigned int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = (nSize != 0 && (nCompact & 0x00800000) != 0);
+        if (pfOverflow)
+            *pfOverflow = (nWord != 0 && (nSize > 34 ||
+                                          (nWord > 0xff && nSize > 33) ||
+                                          (nWord > 0xffff && nSize > 32)));
+        return *this;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -108,6 +108,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 
+        // Keep the received/balance index current
+        TallyTransaction(wtx);
+
         // Notify UI
         vWalletUpdated.push_back(hash);
 
@@ -144,6 +147,7 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     CRITICAL_BLOCK(cs_mapWallet)
     {
+        UntallyTransaction(hash);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -397,84 +401,393 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+//
+// Rescan pipeline.  A reader thread loads blocks in chain order, keeping the
+// blk file open between reads, filter threads hash the transactions and look
+// their outputs up in the set of our scripts, and the scanning thread applies
+// the results in order, taking cs_mapWallet only for the block at hand.
+//
+static const int RESCAN_BLOCKS_AHEAD = 256;
+
+class CRescanBlock
+{
+public:
+    int nPos;
+    CBlockIndex* pindex;
+    CBlock block;
+    vector<uint256> vHash;
+    vector<char> vfMine;
+};
+
+// The two script forms setScript holds for every key.  IsMine can match
+// other encodings of them too, so anything else is left to IsMine.
+bool static IsRescanScript(const CScript& script)
+{
+    if ((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65))
+        return script[script.size()-1] == OP_CHECKSIG;
+    return (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+            script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG);
+}
+
+class CWalletRescan
+{
+public:
+    const CKeyStore* pkeystore;
+    vector<CBlockIndex*> vIndex;
+    set<CScript> setScript;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<CRescanBlock*> queueRead;
+    map<int, CRescanBlock*> mapFiltered;
+    int nApplied;
+    bool fReadDone;
+    bool fAbort;
+
+    CWalletRescan(const CKeyStore* pkeystoreIn)
+    {
+        pkeystore = pkeystoreIn;
+        nApplied = 0;
+        fReadDone = false;
+        fAbort = false;
+    }
+
+    ~CWalletRescan()
+    {
+        BOOST_FOREACH(CRescanBlock* p, queueRead)
+            delete p;
+        for (map<int, CRescanBlock*>::iterator it = mapFiltered.begin(); it != mapFiltered.end(); ++it)
+            delete (*it).second;
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        cond.notify_all();
+    }
+
+    // An exception escaping a pipeline thread aborts the rescan, rather than
+    // leaving the scanning thread waiting for a block that never comes
+    void ThreadRead()
+    {
+        try
+        {
+            Read();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ScanForWalletTransactions() reader");
+            Abort();
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ScanForWalletTransactions() reader");
+            Abort();
+        }
+    }
+
+    void ThreadFilter()
+    {
+        try
+        {
+            Filter();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ScanForWalletTransactions() filter");
+            Abort();
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ScanForWalletTransactions() filter");
+            Abort();
+        }
+    }
+
+    void Read()
+    {
+        FILE* file = NULL;
+        unsigned int nFileOpen = (unsigned int)-1;
+        for (int i = 0; i < vIndex.size(); i++)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && i - nApplied >= RESCAN_BLOCKS_AHEAD)
+                    cond.wait(lock);
+                if (fAbort)
+                    break;
+            }
+
+            CRescanBlock* p = new CRescanBlock();
+            p->nPos = i;
+            p->pindex = vIndex[i];
+            if (p->pindex->nFile != nFileOpen)
+            {
+                if (file)
+                    fclose(file);
+                file = OpenBlockFile(p->pindex->nFile, 0, "rb");
+                nFileOpen = p->pindex->nFile;
+            }
+            if (file && fseek(file, p->pindex->nBlockPos, SEEK_SET) == 0)
+            {
+                CAutoFile filein(file);
+                try
+                {
+                    filein >> p->block;
+                    file = filein.release();
+                }
+                catch (std::exception& e)
+                {
+                    printf("ScanForWalletTransactions() : failed to read block at height %d\n", p->pindex->nHeight);
+                    p->block.SetNull();
+                    nFileOpen = (unsigned int)-1;
+                    file = NULL;
+                }
+            }
+            else
+                printf("ScanForWalletTransactions() : OpenBlockFile failed for height %d\n", p->pindex->nHeight);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queueRead.push_back(p);
+            cond.notify_all();
+        }
+        if (file)
+            fclose(file);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        cond.notify_all();
+    }
+
+    void Filter()
+    {
+        loop
+        {
+            CRescanBlock* p;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRead.empty() && !fReadDone && !fAbort)
+                    cond.wait(lock);
+                if (queueRead.empty() || fAbort)
+                    return;
+                p = queueRead.front();
+                queueRead.pop_front();
+            }
+
+            // Same header checks ReadFromDisk does
+            if (!p->block.vtx.empty() && !p->block.CheckProofOfWork(INT_MAX))
+            {
+                printf("ScanForWalletTransactions() : errors in block header at height %d\n", p->pindex->nHeight);
+                p->block.SetNull();
+            }
+            if (!p->block.vtx.empty() && p->block.GetHash() != p->pindex->GetBlockHash())
+            {
+                printf("ScanForWalletTransactions() : block at height %d doesn't match its index\n", p->pindex->nHeight);
+                p->block.SetNull();
+            }
+
+            p->vHash.reserve(p->block.vtx.size());
+            p->vfMine.reserve(p->block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, p->block.vtx)
+            {
+                char fMine = false;
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                {
+                    if (setScript.count(txout.scriptPubKey))
+                        fMine = true;
+                    else if (!IsRescanScript(txout.scriptPubKey) && IsMine(*pkeystore, txout.scriptPubKey))
+                        fMine = true;
+                    if (fMine)
+                        break;
+                }
+                p->vHash.push_back(tx.GetHash());
+                p->vfMine.push_back(fMine);
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapFiltered[p->nPos] = p;
+            cond.notify_all();
+        }
+    }
+};
+
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
-    CRITICAL_BLOCK(cs_mapWallet)
+    // The network thread moves pnext as it connects blocks, so the chain
+    // to scan is taken in one go under cs_main
+    CWalletRescan rescan(this);
+    CRITICAL_BLOCK(cs_main)
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+            rescan.vIndex.push_back(pindex);
+    if (rescan.vIndex.empty())
+        return 0;
+
+    CRITICAL_BLOCK(cs_mapKeys)
+    {
+        for (map<vector<unsigned char>, CPrivKey>::const_iterator it = mapKeys.begin(); it != mapKeys.end(); ++it)
+        {
+            CScript scriptPubKey;
+            scriptPubKey << (*it).first << OP_CHECKSIG;
+            rescan.setScript.insert(scriptPubKey);
+            scriptPubKey.SetBitcoinAddress((*it).first);
+            rescan.setScript.insert(scriptPubKey);
+        }
+    }
+
+    int nThreads = boost::thread::hardware_concurrency();
+    nThreads = max(1, min(8, nThreads));
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CWalletRescan::ThreadRead, &rescan));
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CWalletRescan::ThreadFilter, &rescan));
+
+    int64 nStart = GetTimeMillis();
+    int64 nLastReport = nStart;
+    int64 nTransactions = 0;
+    int nMatched = 0;
+    try
     {
-        while (pindex)
+        for (int i = 0; i < rescan.vIndex.size() && !fShutdown; i++)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            CRescanBlock* p;
+            {
+                boost::unique_lock<boost::mutex> lock(rescan.mutex);
+                while (!rescan.mapFiltered.count(i) && !rescan.fAbort)
+                    rescan.cond.wait(lock);
+                if (rescan.fAbort)
+                    throw runtime_error(strprintf("ScanForWalletTransactions() : aborted at height %d", rescan.vIndex[i]->nHeight));
+                p = rescan.mapFiltered[i];
+                rescan.mapFiltered.erase(i);
+            }
+
+            // Anything paying us, already known, or spending one of ours goes
+            // through the normal path; the rest can't touch the wallet.
+            // Working out its depth reads the block index, hence cs_main.
+            CRITICAL_BLOCK(cs_main)
+            CRITICAL_BLOCK(cs_mapWallet)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                for (int j = 0; j < p->block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = p->block.vtx[j];
+                    bool fRelevant = p->vfMine[j] || mapWallet.count(p->vHash[j]);
+                    for (int k = 0; k < tx.vin.size() && !fRelevant; k++)
+                        fRelevant = mapWallet.count(tx.vin[k].prevout.hash);
+                    if (!fRelevant)
+                        continue;
+                    nMatched++;
+                    if (AddToWalletIfInvolvingMe(tx, &p->block, fUpdate))
+                        ret++;
+                }
+            }
+            nTransactions += p->block.vtx.size();
+            delete p;
+
+            {
+                boost::unique_lock<boost::mutex> lock(rescan.mutex);
+                rescan.nApplied = i + 1;
+                rescan.cond.notify_all();
+            }
+
+            int64 nNow = GetTimeMillis();
+            if (nNow - nLastReport >= 10000)
+            {
+                nLastReport = nNow;
+                printf("ScanForWalletTransactions() : height %d, %d of %d blocks, %.1f blocks/s, %"PRI64d" transactions, %d matched\n",
+                       rescan.vIndex[i]->nHeight, i + 1, rescan.vIndex.size(), 1000.0 * (i + 1) / (nNow - nStart), nTransactions, nMatched);
             }
-            pindex = pindex->pnext;
         }
     }
+    catch (...)
+    {
+        rescan.Abort();
+        threads.join_all();
+        throw;
+    }
+    if (fShutdown)
+        rescan.Abort();
+    threads.join_all();
+
+    int64 nElapsed = max((int64)1, GetTimeMillis() - nStart);
+    printf("ScanForWalletTransactions() : scanned %d blocks, %"PRI64d" transactions in %"PRI64d"ms (%.1f blocks/s), %d matched, %d added\n",
+           rescan.vIndex.size(), nTransactions, nElapsed, 1000.0 * rescan.vIndex.size() / nElapsed, nMatched, ret);
     return ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
 {
+    // Runs in the background once the node is up, so the locks are only
+    // held for a batch of transactions at a time
+    int64 nStart = GetTimeMillis();
+    vector<uint256> vHash;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        vHash.reserve(mapWallet.size());
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            vHash.push_back((*it).first);
+    }
+
     CTxDB txdb("r");
     bool fRepeat = true;
-    while (fRepeat) CRITICAL_BLOCK(cs_mapWallet)
+    while (fRepeat && !fShutdown)
     {
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        unsigned int nPos = 0;
+        while (nPos < vHash.size() && !fShutdown)
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_mapWallet)
         {
-            CWalletTx& wtx = item.second;
-            if (wtx.IsCoinBase() && wtx.IsSpent(0))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            unsigned int nEnd = min(nPos + 100, (unsigned int)vHash.size());
+            for (; nPos < nEnd; nPos++)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
+                map<uint256, CWalletTx>::iterator mi = mapWallet.find(vHash[nPos]);
+                if (mi == mapWallet.end())
                     continue;
-                }
-                for (int i = 0; i < txindex.vSpent.size(); i++)
+                CWalletTx& wtx = (*mi).second;
+                if (wtx.IsCoinBase() && wtx.IsSpent(0))
+                    continue;
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (int i = 0; i < txindex.vSpent.size(); i++)
+                    {
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Reaccept any txes of ours that aren't already in a block
+                    if (!wtx.IsCoinBase())
+                        wtx.AcceptWalletTransaction(txdb, false);
                 }
             }
-            else
-            {
-                // Reaccept any txes of ours that aren't already in a block
-                if (!wtx.IsCoinBase())
-                    wtx.AcceptWalletTransaction(txdb, false);
-            }
         }
-        if (!vMissingTx.empty())
+        if (!vMissingTx.empty() && !fShutdown)
         {
             // TODO: optimize this to scan just part of the block chain?
             if (ScanForWalletTransactions(pindexGenesisBlock))
                 fRepeat = true;  // Found missing transactions: re-do Reaccept.
         }
     }
+    printf("ReacceptWalletTransactions() : checked %d transactions in %"PRI64d"ms\n", vHash.size(), GetTimeMillis() - nStart);
 }
 
 void CWalletTx::RelayWalletTransaction(CTxDB& txdb)
@@ -564,151 +877,631 @@ int64 CWallet::GetBalance() const
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        // Only transactions with unspent outputs of ours can add anything
+        UpdateTally();
+        vector<uint256> vSpent;
+        for (map<uint256, CWalletTxTally*>::const_iterator it = mapSpendable.begin(); it != mapSpendable.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+            const CWalletTxTally* ptally = (*it).second;
+            const CWalletTx* pcoin = ptally->pwtx;
+            if (ptally->nHeight == INT_MAX && !pcoin->IsConfirmed())
                 continue;
-            nTotal += pcoin->GetAvailableCredit();
+            // An immature coinbase has no available credit either, but
+            // PruneSpendable keeps it for its unspent outputs
+            int64 nCredit = pcoin->GetAvailableCredit();
+            if (nCredit == 0)
+                vSpent.push_back((*it).first);
+            nTotal += nCredit;
+        }
+        PruneSpendable(vSpent);
+        CRITICAL_BLOCK(cs_nLastBalance)
+        {
+            nLastBalance = nTotal;
+            fLastBalance = true;
         }
     }
 
-    //printf("GetBalance() %"PRI64d"ms\n", GetTimeMillis() - nStart);
+    if (fDebug && GetBoolArg("-printbalance"))
+        printf("GetBalance() %"PRI64d"ms\n", GetTimeMillis() - nStart);
     return nTotal;
 }
 
-
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+int64 CWallet::GetBalanceNoWait() const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
+    // Recompute only if nothing else holds the wallet, otherwise answer with
+    // the balance as of the last time it was computed.  Until there is one,
+    // wait rather than answer 0.
+    TRY_CRITICAL_BLOCK(cs_mapWallet)
+        return GetBalance();
+    CRITICAL_BLOCK(cs_nLastBalance)
+        if (fLastBalance)
+            return nLastBalance;
+    return GetBalance();
+}
 
-    // List of values less than target
-    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = INT64_MAX;
-    coinLowestLarger.second.first = NULL;
-    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
-    int64 nTotalLower = 0;
 
-    CRITICAL_BLOCK(cs_mapWallet)
-    {
-       vector<const CWalletTx*> vCoins;
-       vCoins.reserve(mapWallet.size());
-       for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-           vCoins.push_back(&(*it).second);
-       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
 
-       BOOST_FOREACH(const CWalletTx* pcoin, vCoins)
-       {
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
-                continue;
 
-            for (int i = 0; i < pcoin->vout.size(); i++)
-            {
-                if (pcoin->IsSpent(i) || !IsMine(pcoin->vout[i]))
-                    continue;
+//////////////////////////////////////////////////////////////////////////////
+//
+// Received and account balance index
+//
 
-                int64 n = pcoin->vout[i].nValue;
+int static GetTallyMaxHeight(int nMinDepth)
+{
+    // Buckets at or below this height have at least nMinDepth confirmations
+    if (nMinDepth <= 0)
+        return INT_MAX;
+    return nBestHeight - nMinDepth + 1;
+}
 
-                if (n <= 0)
-                    continue;
+void CWallet::ApplyHistory(const CWalletHistoryKey& key, const vector<string>& vAccounts, int nSign) const
+{
+    if (nSign > 0)
+        setHistory.insert(key);
+    else
+        setHistory.erase(key);
+    BOOST_FOREACH(const string& strAccount, vAccounts)
+    {
+        set<CWalletHistoryKey>& setAccount = mapAccountHistory[strAccount];
+        if (nSign > 0)
+            setAccount.insert(key);
+        else if (setAccount.erase(key) && setAccount.empty())
+            mapAccountHistory.erase(strAccount);
+    }
+}
 
-                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
+void CWallet::ApplyTally(const CWalletTxTally& tally, int nSign) const
+{
+    // Non-final transactions are listed but not counted
+    ApplyHistory(CWalletHistoryKey(tally.nTime, 0, tally.hashTx), tally.vAccounts, nSign);
+    if (!tally.fFinal)
+        return;
 
-                if (n == nTargetValue)
-                {
-                    setCoinsRet.insert(coin.second);
-                    nValueRet += coin.first;
-                    return true;
-                }
-//                else if (n < nTargetValue + CENT)
-                else if (n < nTargetValue + MIN_TX_FEE)
-                {
-                    vValue.push_back(coin);
-                    nTotalLower += n;
-                }
-                else if (n < coinLowestLarger.first)
-                {
-                    coinLowestLarger = coin;
-                }
-            }
-        }
+    BOOST_FOREACH(const PAIRTYPE(uint160, int64)& item, tally.vReceivedAddress)
+    {
+        CAddressTally& addrtally = mapAddressTally[item.first];
+        addrtally.address.Add(tally.nHeight, nSign * item.second, nSign);
+        addrtally.all.Add(tally.nHeight, nSign * item.second, nSign);
+        if (tally.fFromMe)
+            addrtally.fromMe.Add(tally.nHeight, nSign * item.second, nSign);
+    }
+    BOOST_FOREACH(const PAIRTYPE(uint160, int64)& item, tally.vReceivedOther)
+    {
+        CAddressTally& addrtally = mapAddressTally[item.first];
+        addrtally.all.Add(tally.nHeight, nSign * item.second, nSign);
+        if (tally.fFromMe)
+            addrtally.fromMe.Add(tally.nHeight, nSign * item.second, nSign);
     }
 
-//    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT)
-    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + MIN_TX_FEE)
+    if (tally.fCoinBase)
+        tallyGenerated.Add(tally.nHeight, nSign * tally.nGenerated, nSign);
+
+    if (tally.fFromMe)
     {
-        for (int i = 0; i < vValue.size(); ++i)
+        map<CScript, int64>& mapSent = mapTallySent[tally.strSentAccount];
+        BOOST_FOREACH(const PAIRTYPE(CScript, int64)& item, tally.vSent)
+            if ((mapSent[item.first] += nSign * item.second) == 0)
+                mapSent.erase(item.first);
+        mapTallyFee[tally.strSentAccount] += nSign * tally.nFee;
+    }
+}
+
+void CWallet::UntallyTransaction(const uint256& hash) const
+{
+    map<uint256, CWalletTxTally>::iterator mi = mapTxTally.find(hash);
+    if (mi == mapTxTally.end())
+        return;
+    const CWalletTxTally& tally = (*mi).second;
+    ApplyTally(tally, -1);
+    if (tally.hashBlock != 0)
+    {
+        map<uint256, set<uint256> >::iterator mi2 = mapTallyByBlock.find(tally.hashBlock);
+        if (mi2 != mapTallyByBlock.end())
         {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
+            (*mi2).second.erase(hash);
+            if ((*mi2).second.empty())
+                mapTallyByBlock.erase(mi2);
         }
-        return true;
     }
+    setTallyNotFinal.erase(hash);
+    mapSpendable.erase(hash);
+    mapTxTally.erase(mi);
+}
 
-//    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? CENT : 0))
-    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? MIN_TX_FEE : 0))
+void CWallet::TallyTransaction(const CWalletTx& wtx) const
+{
+    // Mirrors what GetAmounts/GetAccountAmounts and the getreceivedby*
+    // scans count, so the indexed answers match a full walk of mapWallet
+    if (!fTallyBuilt)
+        return;
+    uint256 hash = wtx.GetHash();
+    UntallyTransaction(hash);
+
+    CWalletTxTally& tally = mapTxTally[hash];
+    tally.hashTx = hash;
+    tally.nTime = wtx.GetTxTime();
+    tally.hashBlock = wtx.hashBlock;
+    if (tally.hashBlock != 0)
+        mapTallyByBlock[tally.hashBlock].insert(hash);
+    tally.fFinal = wtx.IsFinal();
+    if (!tally.fFinal)
+        setTallyNotFinal.insert(hash);
+    wtx.GetDepthInMainChain(tally.nHeight);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+        tally.pwtx = &(*mi).second;
+    bool fUnspent = false;
+    for (int i = 0; i < wtx.vout.size(); i++)
     {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
+        if (wtx.vout[i].nValue <= 0 || !IsMine(wtx.vout[i]))
+            continue;
+        tally.vMine.push_back(i);
+        if (!wtx.IsSpent(i))
+            fUnspent = true;
     }
+    if (fUnspent && tally.pwtx && tally.fFinal)
+        mapSpendable[hash] = &tally;
 
-//    if (nTotalLower >= nTargetValue + CENT)
-//        nTargetValue += CENT;
-    if (nTotalLower >= nTargetValue + MIN_TX_FEE)
-        nTargetValue += MIN_TX_FEE;
+    if (wtx.IsCoinBase())
+    {
+        tally.fCoinBase = true;
+        tally.nGenerated = GetCredit((const CTransaction&)wtx);
+    }
+    else
+    {
+        int64 nDebit = wtx.GetDebit();
+        tally.fFromMe = (nDebit > 0);
+        if (tally.fFromMe)
+        {
+            tally.strSentAccount = wtx.strFromAccount;
+            tally.nFee = nDebit - wtx.GetValueOut();
+        }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend());
-    vector<char> vfIncluded;
-    vector<char> vfBest(vValue.size(), true);
-    int64 nBest = nTotalLower;
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        {
+            if (tally.fFromMe)
+                tally.vSent.push_back(make_pair(txout.scriptPubKey, txout.nValue));
+            if (!IsMine(txout))
+                continue;
 
-    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
+            // Outputs with no recognizable address stay under 0
+            uint160 hash160;
+            vector<unsigned char> vchPubKey;
+            if (!ExtractHash160(txout.scriptPubKey, hash160))
+                if (ExtractPubKey(txout.scriptPubKey, NULL, vchPubKey))
+                    hash160 = Hash160(vchPubKey);
+
+            if (hash160 != 0 && txout.scriptPubKey.GetBitcoinAddressHash160() == hash160)
+                tally.vReceivedAddress.push_back(make_pair(hash160, txout.nValue));
+            else
+                tally.vReceivedOther.push_back(make_pair(hash160, txout.nValue));
+        }
+    }
+
+    SetTallyAccounts(tally);
+    ApplyTally(tally, 1);
+}
+
+void CWallet::SetTallyAccounts(CWalletTxTally& tally) const
+{
+    // A superset of the accounts ListTransactions gives entries under,
+    // change included, using the address book as it is now
+    set<string> setAccounts;
+    if (tally.fCoinBase)
+        setAccounts.insert("");
+    if (tally.fFromMe)
+        setAccounts.insert(tally.strSentAccount);
+    CRITICAL_BLOCK(cs_mapAddressBook)
     {
-        vfIncluded.assign(vValue.size(), false);
-        int64 nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        for (int i = 0; i < 2; i++)
         {
-            for (int i = 0; i < vValue.size(); i++)
+            BOOST_FOREACH(const PAIRTYPE(uint160, int64)& item, (i == 0 ? tally.vReceivedAddress : tally.vReceivedOther))
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                string strAccount;
+                if (item.first != 0)
                 {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
+                    map<string, string>::const_iterator mi = mapAddressBook.find(Hash160ToAddress(item.first));
+                    if (mi != mapAddressBook.end())
+                        strAccount = (*mi).second;
                 }
+                setAccounts.insert(strAccount);
             }
         }
     }
+    tally.vAccounts.assign(setAccounts.begin(), setAccounts.end());
+}
 
-    // If the next larger is still closer, return it
-    if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
+void CWallet::UpdateTally() const
+{
+    if (!fTallyBuilt)
     {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
+        int64 nStart = GetTimeMillis();
+        fTallyBuilt = true;
+        fHistoryAccountsStale = false;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            TallyTransaction((*it).second);
+        printf("UpdateTally() : indexed %d wallet transactions in %"PRI64d"ms\n", mapWallet.size(), GetTimeMillis() - nStart);
+        return;
+    }
+
+    // Transactions that weren't final when indexed get another look
+    vector<uint256> vFinal;
+    BOOST_FOREACH(const uint256& hash, setTallyNotFinal)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end() && (*mi).second.IsFinal())
+            vFinal.push_back(hash);
+    }
+    BOOST_FOREACH(const uint256& hash, vFinal)
+        TallyTransaction((*mapWallet.find(hash)).second);
+
+    // An address with history was given a different account
+    if (fHistoryAccountsStale)
+    {
+        fHistoryAccountsStale = false;
+        for (map<uint256, CWalletTxTally>::iterator it = mapTxTally.begin(); it != mapTxTally.end(); ++it)
+        {
+            CWalletTxTally& tally = (*it).second;
+            CWalletHistoryKey key(tally.nTime, 0, tally.hashTx);
+            ApplyHistory(key, tally.vAccounts, -1);
+            SetTallyAccounts(tally);
+            ApplyHistory(key, tally.vAccounts, 1);
+        }
+    }
+}
+
+void CWallet::PruneSpendable(const vector<uint256>& vSpent) const
+{
+    BOOST_FOREACH(const uint256& hash, vSpent)
+    {
+        map<uint256, CWalletTxTally*>::iterator mi = mapSpendable.find(hash);
+        if (mi == mapSpendable.end())
+            continue;
+        const CWalletTxTally* ptally = (*mi).second;
+        bool fUnspent = false;
+        BOOST_FOREACH(unsigned int i, ptally->vMine)
+            if (!ptally->pwtx->IsSpent(i))
+                fUnspent = true;
+        if (!fUnspent)
+            mapSpendable.erase(mi);
+    }
+}
+
+void CWallet::UpdatedBlocks(const vector<uint256>& vhashBlock)
+{
+    // Blocks joined or left the main chain, so the heights recorded for
+    // their transactions may be stale
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        if (!fTallyBuilt)
+            return;
+        BOOST_FOREACH(const uint256& hashBlock, vhashBlock)
+        {
+            map<uint256, set<uint256> >::iterator mi = mapTallyByBlock.find(hashBlock);
+            if (mi == mapTallyByBlock.end())
+                continue;
+            set<uint256> setHash = (*mi).second;
+            BOOST_FOREACH(const uint256& hash, setHash)
+            {
+                map<uint256, CWalletTx>::iterator mi2 = mapWallet.find(hash);
+                if (mi2 != mapWallet.end())
+                    TallyTransaction((*mi2).second);
+            }
+        }
+    }
+}
+
+void CWallet::IndexAccountingEntry(const CAccountingEntry& acentry)
+{
+    // Called with cs_mapWallet held as entries are loaded or written
+    mapAcentries[acentry.nEntryNo] = acentry;
+    mapAccountCreditDebit[acentry.strAccount] += acentry.nCreditDebit;
+    vector<string> vAccounts(1, acentry.strAccount);
+    ApplyHistory(CWalletHistoryKey(acentry.nTime, acentry.nEntryNo, 0), vAccounts, 1);
+}
+
+int64 CWallet::GetAccountCreditDebit(const string& strAccount) const
+{
+    int64 nCreditDebit = 0;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        map<string, int64>::const_iterator mi = mapAccountCreditDebit.find(strAccount);
+        if (mi != mapAccountCreditDebit.end())
+            nCreditDebit = (*mi).second;
+    }
+    return nCreditDebit;
+}
+
+map<string, int64> CWallet::GetAccountCreditDebits() const
+{
+    map<string, int64> mapRet;
+    CRITICAL_BLOCK(cs_mapWallet)
+        mapRet = mapAccountCreditDebit;
+    return mapRet;
+}
+
+bool CWallet::GetPrevHistory(const string& strAccount, CWalletHistoryKey& key, bool fNewest, const CWalletTx*& pwtxRet, const CAccountingEntry*& pacentryRet) const
+{
+    // Steps key to the next older history entry of strAccount ("*" for
+    // all), or to the newest one if fNewest.  The caller holds
+    // cs_mapWallet for as long as it uses the returned pointers.
+    pwtxRet = NULL;
+    pacentryRet = NULL;
+
+    // Every time, not just for the newest: a cursor kept from before a
+    // restart arrives with the index not built yet
+    UpdateTally();
+
+    const set<CWalletHistoryKey>* psetHistory = &setHistory;
+    if (strAccount != "*")
+    {
+        map<string, set<CWalletHistoryKey> >::const_iterator mi = mapAccountHistory.find(strAccount);
+        if (mi == mapAccountHistory.end())
+            return false;
+        psetHistory = &(*mi).second;
+    }
+
+    set<CWalletHistoryKey>::const_iterator it = (fNewest ? psetHistory->end() : psetHistory->lower_bound(key));
+    while (it != psetHistory->begin())
+    {
+        key = *(--it);
+        if (key.nEntryNo != 0)
+        {
+            map<uint64, CAccountingEntry>::const_iterator mi = mapAcentries.find(key.nEntryNo);
+            if (mi != mapAcentries.end())
+                pacentryRet = &(*mi).second;
+        }
+        else
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(key.hashTx);
+            if (mi != mapWallet.end())
+                pwtxRet = &(*mi).second;
+        }
+        if (pwtxRet || pacentryRet)
+            return true;
+    }
+    return false;
+}
+
+int64 CWallet::GetReceivedByAddress(const uint160& hash160, int nMinDepth)
+{
+    int64 nAmount = 0;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        UpdateTally();
+        map<uint160, CAddressTally>::const_iterator mi = mapAddressTally.find(hash160);
+        if (mi != mapAddressTally.end())
+            nAmount = (*mi).second.address.GetAmount(GetTallyMaxHeight(nMinDepth));
+    }
+    return nAmount;
+}
+
+void CWallet::GetReceivedByAddresses(int nMinDepth, map<uint160, pair<int64, int> >& mapReceivedRet)
+{
+    // Amount and lowest confirmation count per address, for listreceivedby*
+    mapReceivedRet.clear();
+    int nMaxHeight = GetTallyMaxHeight(nMinDepth);
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        UpdateTally();
+        for (map<uint160, CAddressTally>::const_iterator it = mapAddressTally.begin(); it != mapAddressTally.end(); ++it)
+        {
+            const CReceivedTally& tally = (*it).second.address;
+            int nHeight = tally.GetMaxHeight(nMaxHeight);
+            if (nHeight < 0)
+                continue;
+            int nConf = (nHeight == INT_MAX ? 0 : nBestHeight - nHeight + 1);
+            mapReceivedRet[(*it).first] = make_pair(tally.GetAmount(nMaxHeight), nConf);
+        }
+    }
+}
+
+int64 CWallet::GetAccountTxBalance(const string& strAccount, int nMinDepth)
+{
+    // Same total as summing GetAccountAmounts over mapWallet, without the
+    // internal accounting entries
+    int64 nBalance = 0;
+    int nMaxHeight = GetTallyMaxHeight(nMinDepth);
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        UpdateTally();
+
+        // Received
+        CRITICAL_BLOCK(cs_mapAddressBook)
+        {
+            if (strAccount != "")
+            {
+                BOOST_FOREACH(const PAIRTYPE(string, string)& item, mapAddressBook)
+                {
+                    uint160 hash160;
+                    if (item.second != strAccount || !AddressToHash160(item.first, hash160))
+                        continue;
+                    map<uint160, CAddressTally>::const_iterator mi = mapAddressTally.find(hash160);
+                    if (mi != mapAddressTally.end())
+                        nBalance += (*mi).second.all.GetAmount(nMaxHeight);
+                }
+            }
+            else
+            {
+                // The default account also gets everything sent to addresses
+                // not in the address book, less the change from our own sends
+                for (map<uint160, CAddressTally>::const_iterator it = mapAddressTally.begin(); it != mapAddressTally.end(); ++it)
+                {
+                    const CAddressTally& addrtally = (*it).second;
+                    if ((*it).first == 0)
+                    {
+                        nBalance += addrtally.all.GetAmount(nMaxHeight);
+                        continue;
+                    }
+                    map<string, string>::const_iterator mi = mapAddressBook.find(Hash160ToAddress((*it).first));
+                    if (mi == mapAddressBook.end())
+                        nBalance += addrtally.all.GetAmount(nMaxHeight) - addrtally.fromMe.GetAmount(nMaxHeight);
+                    else if ((*mi).second == "")
+                        nBalance += addrtally.all.GetAmount(nMaxHeight);
+                }
+            }
+        }
+
+        // Generated, credited to the default account once mature
+        if (strAccount == "")
+            nBalance += tallyGenerated.GetAmount(nBestHeight - (COINBASE_MATURITY+20) + 1);
+
+        // Sent and fees, not counting change
+        map<string, map<CScript, int64> >::const_iterator mi = mapTallySent.find(strAccount);
+        if (mi != mapTallySent.end())
+            for (map<CScript, int64>::const_iterator it = (*mi).second.begin(); it != (*mi).second.end(); ++it)
+                if (!IsChange(CTxOut((*it).second, (*it).first)))
+                    nBalance -= (*it).second;
+        map<string, int64>::const_iterator mi2 = mapTallyFee.find(strAccount);
+        if (mi2 != mapTallyFee.end())
+            nBalance -= (*mi2).second;
+    }
+    return nBalance;
+}
+
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    // List of values less than target
+    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    coinLowestLarger.first = INT64_MAX;
+    coinLowestLarger.second.first = NULL;
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
+    int64 nTotalLower = 0;
+
+    int64 nStart = GetTimeMillis();
+    int nCandidates = 0;
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+       // Candidates come from the spendable set, with depths taken from the
+       // heights the tally keeps current instead of a lookup per transaction
+       UpdateTally();
+       vector<const CWalletTxTally*> vCoins;
+       vCoins.reserve(mapSpendable.size());
+       for (map<uint256, CWalletTxTally*>::const_iterator it = mapSpendable.begin(); it != mapSpendable.end(); ++it)
+           vCoins.push_back((*it).second);
+       random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+       nCandidates = vCoins.size();
+
+       BOOST_FOREACH(const CWalletTxTally* ptally, vCoins)
+       {
+            const CWalletTx* pcoin = ptally->pwtx;
+            int nDepth = (ptally->nHeight == INT_MAX ? 0 : nBestHeight - ptally->nHeight + 1);
+            if (nDepth == 0 && !pcoin->IsConfirmed())
+                continue;
+
+            if (pcoin->IsCoinBase() && nDepth < COINBASE_MATURITY+20)
+                continue;
+
+            if (nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
+                continue;
+
+            BOOST_FOREACH(unsigned int i, ptally->vMine)
+            {
+                if (pcoin->IsSpent(i))
+                    continue;
+
+                int64 n = pcoin->vout[i].nValue;
+
+                pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin,i));
+
+                if (n == nTargetValue)
+                {
+                    setCoinsRet.insert(coin.second);
+                    nValueRet += coin.first;
+                    return true;
+                }
+//                else if (n < nTargetValue + CENT)
+                else if (n < nTargetValue + MIN_TX_FEE)
+                {
+                    vValue.push_back(coin);
+                    nTotalLower += n;
+                }
+                else if (n < coinLowestLarger.first)
+                {
+                    coinLowestLarger = coin;
+                }
+            }
+        }
+    }
+
+    if (fDebug && GetBoolArg("-printcoinselection"))
+        printf("SelectCoinsMinConf() : %d candidates, %d below target, %"PRI64d"ms\n", nCandidates, vValue.size(), GetTimeMillis() - nStart);
+
+//    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + CENT)
+    if (nTotalLower == nTargetValue || nTotalLower == nTargetValue + MIN_TX_FEE)
+    {
+        for (int i = 0; i < vValue.size(); ++i)
+        {
+            setCoinsRet.insert(vValue[i].second);
+            nValueRet += vValue[i].first;
+        }
+        return true;
+    }
+
+//    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? CENT : 0))
+    if (nTotalLower < nTargetValue + (coinLowestLarger.second.first ? MIN_TX_FEE : 0))
+    {
+        if (coinLowestLarger.second.first == NULL)
+            return false;
+        setCoinsRet.insert(coinLowestLarger.second);
+        nValueRet += coinLowestLarger.first;
+        return true;
+    }
+
+//    if (nTotalLower >= nTargetValue + CENT)
+//        nTargetValue += CENT;
+    if (nTotalLower >= nTargetValue + MIN_TX_FEE)
+        nTargetValue += MIN_TX_FEE;
+
+    // Solve subset sum by stochastic approximation
+    sort(vValue.rbegin(), vValue.rend());
+    vector<char> vfIncluded;
+    vector<char> vfBest(vValue.size(), true);
+    int64 nBest = nTotalLower;
+
+    for (int nRep = 0; nRep < 1000 && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        int64 nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (int i = 0; i < vValue.size(); i++)
+            {
+                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+
+    // If the next larger is still closer, return it
+    if (coinLowestLarger.second.first && coinLowestLarger.first - nTargetValue <= nBest - nTargetValue)
+    {
+        setCoinsRet.insert(coinLowestLarger.second);
+        nValueRet += coinLowestLarger.first;
+    }
     else {
         for (int i = 0; i < vValue.size(); i++)
             if (vfBest[i])
@@ -730,6 +1523,10 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
 bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
+    // Coins spent by a copy of wallet.dat may still look unspent
+    if (!fSpentChecked)
+        return false;
+
     return (SelectCoinsMinConf(nTargetValue, 1, 6, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 1, 1, setCoinsRet, nValueRet) ||
             SelectCoinsMinConf(nTargetValue, 0, 1, setCoinsRet, nValueRet));
@@ -856,6 +1653,373 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& w
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet);
 }
 
+void static SignInputs(const CWallet* pwallet, const vector<const CWalletTx*>* pvPrev, CTransaction txTo, vector<CScript>* pvScriptSigRet, int nThread, int nThreads)
+{
+    // Each thread signs its own copy; an input's signature hash doesn't
+    // cover the other inputs' scripts
+    for (unsigned int i = nThread; i < txTo.vin.size(); i += nThreads)
+    {
+        try
+        {
+            if (SignSignature(*pwallet, *(*pvPrev)[i], txTo, i))
+                (*pvScriptSigRet)[i] = txTo.vin[i].scriptSig;
+        }
+        catch (std::exception& e)
+        {
+            // Left empty, which fails the transaction
+            PrintExceptionContinue(&e, "SignInputs()");
+        }
+    }
+}
+
+bool CWallet::CreatePayoutTransaction(const vector<pair<CScript, int64> >& vecSend, unsigned int& nPaymentsRet, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet)
+{
+    // Same fee rules as CreateTransaction, but the fee is worked out with
+    // placeholder signatures of the largest size each input's script takes.
+    // Coins are only selected again when the fee estimate grows or the
+    // payments have to be cut, and the inputs are signed once, on several
+    // threads.  Pays the first nPaymentsRet payments of vecSend, as many as
+    // fit under the size limit.
+    if (vecSend.empty())
+        return false;
+    BOOST_FOREACH (const PAIRTYPE(CScript, int64)& s, vecSend)
+        if (s.second < 0)
+            return false;
+
+    wtxNew.pwallet = this;
+
+    // Pay-to-address inputs take a signature and a public key, pay-to-pubkey
+    // ones, like most coinbase outputs, only the signature
+    CScript scriptPlaceholderAddress;
+    scriptPlaceholderAddress << vector<unsigned char>(73, 0) << vector<unsigned char>(65, 0);
+    CScript scriptPlaceholderPubKey;
+    scriptPlaceholderPubKey << vector<unsigned char>(73, 0);
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        // txdb must be opened before the mapWallet lock
+        CTxDB txdb("r");
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            nPaymentsRet = vecSend.size();
+            nFeeRet = nTransactionFee;
+            vector<const CWalletTx*> vPrev;
+            loop
+            {
+                wtxNew.vin.clear();
+                wtxNew.vout.clear();
+                wtxNew.fFromMe = true;
+
+                int64 nValue = 0;
+                for (unsigned int i = 0; i < nPaymentsRet; i++)
+                {
+                    nValue += vecSend[i].second;
+                    if (nValue < 0)
+                        return false;
+                }
+                int64 nTotalValue = nValue + nFeeRet;
+                double dPriority = 0;
+                // vouts to the payees
+                for (unsigned int i = 0; i < nPaymentsRet; i++)
+                    wtxNew.vout.push_back(CTxOut(vecSend[i].second, vecSend[i].first));
+
+                // Choose coins to use
+                set<pair<const CWalletTx*,unsigned int> > setCoins;
+                int64 nValueIn = 0;
+                if (!SelectCoins(nTotalValue, setCoins, nValueIn))
+                    return false;
+                BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+                {
+                    int64 nCredit = pcoin.first->vout[pcoin.second].nValue;
+                    dPriority += (double)nCredit * pcoin.first->GetDepthInMainChain();
+                }
+
+                // Fill a vout back to self with any change
+                int64 nChange = nValueIn - nTotalValue;
+                if (nChange >= MIN_TX_FEE)
+                {
+                    vector<unsigned char> vchPubKey = reservekey.GetReservedKey();
+                    assert(mapKeys.count(vchPubKey));
+
+                    CScript scriptChange;
+                    if (vecSend[0].first.GetBitcoinAddressHash160() != 0)
+                        scriptChange.SetBitcoinAddress(vchPubKey);
+                    else
+                        scriptChange << vchPubKey << OP_CHECKSIG;
+
+                    vector<CTxOut>::iterator position = wtxNew.vout.begin()+GetRandInt(wtxNew.vout.size());
+                    wtxNew.vout.insert(position, CTxOut(nChange, scriptChange));
+                }
+                else
+                    reservekey.ReturnKey();
+
+                // Fill vin, unsigned for now
+                vPrev.clear();
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                {
+                    wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+                    if (coin.first->vout[coin.second].scriptPubKey.GetBitcoinAddressHash160() != 0)
+                        wtxNew.vin.back().scriptSig = scriptPlaceholderAddress;
+                    else
+                        wtxNew.vin.back().scriptSig = scriptPlaceholderPubKey;
+                    vPrev.push_back(coin.first);
+                }
+
+                // Limit size.  Too big, pay fewer addresses, in proportion
+                // to how far over the limit this came out, and start the
+                // fee estimate again.
+                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK);
+                if (nBytes >= MAX_BLOCK_SIZE_GEN/5)
+                {
+                    if (nPaymentsRet == 1)
+                        return false;
+                    nPaymentsRet = max(1U, min(nPaymentsRet - 1, (unsigned int)((uint64)nPaymentsRet * (MAX_BLOCK_SIZE_GEN/5) * 9 / 10 / nBytes)));
+                    nFeeRet = nTransactionFee;
+                    continue;
+                }
+                dPriority /= nBytes;
+
+                // Check that enough fee is included.  The signed transaction
+                // can only be smaller, which never needs a bigger fee.
+                int64 nPayFee = nTransactionFee * (1 + (int64)nBytes / 1000);
+                bool fAllowFree = CTransaction::AllowFree(dPriority);
+                int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree);
+                if (nFeeRet < max(nPayFee, nMinFee))
+                {
+                    nFeeRet = max(nPayFee, nMinFee);
+                    continue;
+                }
+                break;
+            }
+
+            // Sign
+            vector<CScript> vScriptSig(wtxNew.vin.size());
+            int nThreads = 1;
+            if (wtxNew.vin.size() >= 8)
+                nThreads = max(1, min(8, (int)boost::thread::hardware_concurrency()));
+            if (nThreads == 1)
+                SignInputs(this, &vPrev, wtxNew, &vScriptSig, 0, 1);
+            else
+            {
+                boost::thread_group threads;
+                for (int i = 0; i < nThreads; i++)
+                    threads.create_thread(boost::bind(&SignInputs, this, &vPrev, (CTransaction)wtxNew, &vScriptSig, i, nThreads));
+                threads.join_all();
+            }
+            for (unsigned int i = 0; i < wtxNew.vin.size(); i++)
+            {
+                if (vScriptSig[i].empty())
+                    return false;
+                wtxNew.vin[i].scriptSig = vScriptSig[i];
+            }
+
+            // Fill vtxPrev by copying from previous transactions vtxPrev
+            wtxNew.AddSupportingTransactions(txdb);
+            wtxNew.fTimeReceivedIsTxTime = true;
+        }
+    }
+    return true;
+}
+
+void CWallet::GetSweepCandidates(int64 nMaxCoinValue, vector<pair<double, pair<const CWalletTx*,unsigned int> > >& vCandidatesRet) const
+{
+    // Confirmed, mature outputs worth at most nMaxCoinValue (0 for any),
+    // with the value * depth they add to a spending transaction's priority
+    vCandidatesRet.clear();
+    CRITICAL_BLOCK(cs_mapWallet)
+    {
+        UpdateTally();
+        for (map<uint256, CWalletTxTally*>::const_iterator it = mapSpendable.begin(); it != mapSpendable.end(); ++it)
+        {
+            const CWalletTxTally* ptally = (*it).second;
+            const CWalletTx* pcoin = ptally->pwtx;
+            if (ptally->nHeight == INT_MAX)
+                continue;
+            int nDepth = nBestHeight - ptally->nHeight + 1;
+            if (pcoin->IsCoinBase() && nDepth < COINBASE_MATURITY+20)
+                continue;
+
+            BOOST_FOREACH(unsigned int i, ptally->vMine)
+            {
+                int64 nValue = pcoin->vout[i].nValue;
+                if (pcoin->IsSpent(i) || (nMaxCoinValue > 0 && nValue > nMaxCoinValue))
+                    continue;
+                vCandidatesRet.push_back(make_pair((double)nValue * nDepth, make_pair(pcoin, i)));
+            }
+        }
+    }
+}
+
+bool CWallet::CreateSweepTransaction(int64 nMaxCoinValue, bool fAllowFee, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet)
+{
+    wtxNew.pwallet = this;
+    if (!fSpentChecked)
+        return false;
+
+    CRITICAL_BLOCK(cs_main)
+    {
+        // txdb must be opened before the mapWallet lock
+        CTxDB txdb("r");
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            vector<pair<double, pair<const CWalletTx*,unsigned int> > > vCandidates;
+            GetSweepCandidates(nMaxCoinValue, vCandidates);
+            sort(vCandidates.rbegin(), vCandidates.rend());
+
+            // Take the highest priority coins first.  Each one added lowers the
+            // average, so stop once the next would take the transaction out of
+            // the free priority range, or past the size limit.
+            vector<pair<const CWalletTx*,unsigned int> > vCoins;
+            int64 nValueIn = 0;
+            double dPriority = 0;
+            unsigned int nBytes = SWEEP_TX_OVERHEAD;
+            for (int i = 0; i < vCandidates.size(); i++)
+            {
+                if (nBytes + SWEEP_INPUT_SIZE > MAX_SWEEP_TX_SIZE)
+                    break;
+                if (!fAllowFee && !CTransaction::AllowFree((dPriority + vCandidates[i].first) / (nBytes + SWEEP_INPUT_SIZE)))
+                    break;
+                const pair<const CWalletTx*,unsigned int>& coin = vCandidates[i].second;
+                vCoins.push_back(coin);
+                nValueIn += coin.first->vout[coin.second].nValue;
+                dPriority += vCandidates[i].first;
+                nBytes += SWEEP_INPUT_SIZE;
+            }
+            if (vCoins.size() < 2)
+                return false;
+
+            nFeeRet = 0;
+            loop
+            {
+                wtxNew.vin.clear();
+                wtxNew.vout.clear();
+                wtxNew.fFromMe = true;
+
+                // Everything goes to one new key of ours
+                if (nValueIn - nFeeRet < MIN_TX_FEE)
+                    return false;
+                CScript scriptPubKey;
+                scriptPubKey.SetBitcoinAddress(reservekey.GetReservedKey());
+                wtxNew.vout.push_back(CTxOut(nValueIn - nFeeRet, scriptPubKey));
+
+                // Fill vin
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, vCoins)
+                    wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+
+                // Sign
+                int nIn = 0;
+                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, vCoins)
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                        return false;
+
+                // Check that enough fee is included
+                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK);
+                bool fAllowFree = CTransaction::AllowFree(dPriority / nBytes);
+                if (!fAllowFree && !fAllowFee)
+                    return false;
+                // A free sweep pays nothing, whatever -paytxfee asks of sends
+                int64 nPayFee = (fAllowFee ? nTransactionFee * (1 + (int64)nBytes / 1000) : 0);
+                int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree);
+                if (!fAllowFee && nMinFee > 0)
+                    return false;
+                if (nFeeRet < max(nPayFee, nMinFee))
+                {
+                    nFeeRet = max(nPayFee, nMinFee);
+                    continue;
+                }
+
+                // Fill vtxPrev by copying from previous transactions vtxPrev
+                wtxNew.AddSupportingTransactions(txdb);
+                wtxNew.fTimeReceivedIsTxTime = true;
+
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+int CWallet::SweepWallet(int64 nMaxCoinValue, int nMaxTransactions, bool fAllowFee, vector<uint256>& vhashRet)
+{
+    // The new outputs are unconfirmed, so later passes never pick them up again
+    for (int i = 0; i < nMaxTransactions && !fShutdown; i++)
+    {
+        CWalletTx wtx;
+        CReserveKey reservekey(this);
+        int64 nFee = 0;
+        if (!CreateSweepTransaction(nMaxCoinValue, fAllowFee, wtx, reservekey, nFee))
+            break;
+        if (!CommitTransaction(wtx, reservekey))
+            break;
+
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            nSweepTransactions++;
+            nSweepInputs += wtx.vin.size();
+            nSweepValue += wtx.GetValueOut() + nFee;
+            nSweepFees += nFee;
+            nSweepTime = GetTime();
+        }
+        vhashRet.push_back(wtx.GetHash());
+        printf("SweepWallet() : swept %d outputs into %s, fee %s\n", wtx.vin.size(), wtx.GetHash().ToString().substr(0,10).c_str(), FormatMoney(nFee).c_str());
+    }
+    return vhashRet.size();
+}
+
+void ThreadReacceptWalletTransactions(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+    vnThreadsRunning[6]++;
+    try
+    {
+        pwallet->ReacceptWalletTransactions();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadReacceptWalletTransactions()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadReacceptWalletTransactions()");
+    }
+
+    // Even after a failure, so the wallet isn't left unable to spend
+    pwallet->fSpentChecked = true;
+    vnThreadsRunning[6]--;
+}
+
+void ThreadSweepWallet(void* parg)
+{
+    CWallet* pwallet = (CWallet*)parg;
+
+    int64 nMaxCoinValue = 0;
+    if (mapArgs.count("-sweepmaxvalue") && !ParseMoney(mapArgs["-sweepmaxvalue"], nMaxCoinValue))
+    {
+        printf("ThreadSweepWallet() : invalid amount for -sweepmaxvalue\n");
+        return;
+    }
+    int nMaxTransactions = GetArg("-sweeptransactions", 1);
+
+    vnThreadsRunning[7]++;
+    while (!fShutdown)
+    {
+        for (int i = 0; i < 600 && !fShutdown; i++)
+            Sleep(1000);
+        if (fShutdown || IsInitialBlockDownload())
+            continue;
+
+        // Only free transactions, one batch per ten minutes
+        vector<uint256> vhash;
+        try
+        {
+            pwallet->SweepWallet(nMaxCoinValue, nMaxTransactions, false, vhash);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadSweepWallet()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadSweepWallet()");
+        }
+    }
+    vnThreadsRunning[7]--;
+}
+
 // Call after CreateTransaction unless you want to abort
 bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 {
@@ -914,6 +2078,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 // requires cs_main lock
 string CWallet::SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee)
 {
+    if (!fSpentChecked)
+        return _("Error: The wallet is still checking which of its coins are spent, try again shortly  ");
+
     CReserveKey reservekey(this);
     int64 nFeeRequired;
     if (!CreateTransaction(scriptPubKey, nValue, wtxNew, reservekey, nFeeRequired))
@@ -1018,31 +2185,142 @@ bool GetWalletFile(CWallet* pwallet, string &strWalletFileOut)
     return true;
 }
 
+void static GenerateKeys(vector<pair<vector<unsigned char>, CPrivKey> >* pvKey, int nThread, int nThreads)
+{
+    for (unsigned int i = nThread; i < pvKey->size(); i += nThreads)
+    {
+        try
+        {
+            CKey key;
+            key.MakeNewKey();
+            (*pvKey)[i] = make_pair(key.GetPubKey(), key.GetPrivKey());
+        }
+        catch (std::exception& e)
+        {
+            // Left empty and skipped
+            PrintExceptionContinue(&e, "GenerateKeys()");
+        }
+    }
+}
+
+int CWallet::TopUpKeyPool(int64 nTargetSize)
+{
+    // Keys are made on several threads without holding any locks, then
+    // written up to 1000 at a time, each batch in one wallet transaction.
+    // The pool lives in the wallet file, there is none without one.
+    if (!fFileBacked)
+        return 0;
+    int nAdded = 0;
+    loop
+    {
+        int64 nMissing;
+        CRITICAL_BLOCK(cs_setKeyPool)
+            nMissing = nTargetSize - (int64)setKeyPool.size();
+        if (nMissing <= 0)
+            break;
+
+        vector<pair<vector<unsigned char>, CPrivKey> > vKey(min(nMissing, (int64)1000));
+        RandAddSeedPerfmon();
+        int nThreads = 1;
+        if (vKey.size() >= 16)
+            nThreads = max(1, min(8, (int)boost::thread::hardware_concurrency()));
+        if (nThreads == 1)
+            GenerateKeys(&vKey, 0, 1);
+        else
+        {
+            boost::thread_group threads;
+            for (int i = 0; i < nThreads; i++)
+                threads.create_thread(boost::bind(&GenerateKeys, &vKey, i, nThreads));
+            threads.join_all();
+        }
+
+        int nBatch = 0;
+        CRITICAL_BLOCK(cs_main)
+        CRITICAL_BLOCK(cs_mapWallet)
+        CRITICAL_BLOCK(cs_setKeyPool)
+        {
+            CWalletDB walletdb(strWalletFile);
+            walletdb.TxnBegin();
+            int64 nEnd = 1;
+            if (!setKeyPool.empty())
+                nEnd = *(--setKeyPool.end()) + 1;
+            for (unsigned int i = 0; i < vKey.size() && setKeyPool.size() + nBatch < nTargetSize; i++)
+            {
+                if (vKey[i].first.empty())
+                    continue;
+                if (!walletdb.WriteKey(vKey[i].first, vKey[i].second) ||
+                    !walletdb.WritePool(nEnd + nBatch, CKeyPool(vKey[i].first)))
+                {
+                    walletdb.TxnAbort();
+                    throw runtime_error("TopUpKeyPool() : writing generated key failed");
+                }
+                nBatch++;
+            }
+            if (!walletdb.TxnCommit())
+                throw runtime_error("TopUpKeyPool() : committing generated keys failed");
+
+            // Only known to the wallet once they're on disk
+            CRITICAL_BLOCK(cs_mapKeys)
+            {
+                for (int i = 0, n = 0; n < nBatch; i++)
+                {
+                    if (vKey[i].first.empty())
+                        continue;
+                    mapKeys[vKey[i].first] = vKey[i].second;
+                    mapPubKeys[Hash160(vKey[i].first)] = vKey[i].first;
+                    setKeyPool.insert(nEnd + n++);
+                }
+            }
+            printf("keypool added %d keys, size=%d\n", nBatch, setKeyPool.size());
+        }
+        if (nBatch == 0 && nMissing > 0)
+        {
+            bool fGenerated = false;
+            for (unsigned int i = 0; i < vKey.size(); i++)
+                if (!vKey[i].first.empty())
+                    fGenerated = true;
+            if (!fGenerated)
+                throw runtime_error("TopUpKeyPool() : key generation failed");
+        }
+        nAdded += nBatch;
+    }
+    return nAdded;
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
     keypool.vchPubKey.clear();
+
+    // Without a wallet file every reservation is a new key
+    if (!fFileBacked)
+    {
+        CKey key;
+        key.MakeNewKey();
+        if (!AddKey(key))
+            throw runtime_error("ReserveKeyFromKeyPool() : AddKey failed");
+        keypool = CKeyPool(key.GetPubKey());
+        return;
+    }
+
+    // Top up key pool
+    int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0);
+    TopUpKeyPool(nTargetSize+1);
+
     CRITICAL_BLOCK(cs_main)
     CRITICAL_BLOCK(cs_mapWallet)
     CRITICAL_BLOCK(cs_setKeyPool)
     {
         CWalletDB walletdb(strWalletFile);
 
-        // Top up key pool
-        int64 nTargetSize = max(GetArg("-keypool", 100), (int64)0);
-        while (setKeyPool.size() < nTargetSize+1)
-        {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("ReserveKeyFromKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%d\n", nEnd, setKeyPool.size());
-        }
+        // Other reservers may have taken every key since the top up, so make
+        // one more while holding the lock
+        if (setKeyPool.empty())
+            TopUpKeyPool(1);
+        if (setKeyPool.empty())
+            throw runtime_error("ReserveKeyFromKeyPool() : key pool is empty");
 
         // Get the oldest key
-        assert(!setKeyPool.empty());
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
         if (!walletdb.ReadPool(nIndex, keypool))
@@ -1084,6 +2362,12 @@ bool CWallet::SetAddressBookName(const std::string& strAddress, const std::strin
     {
         CRITICAL_BLOCK(cs_mapAddressBook)
             mapAddressBook[strAddress] = strName;
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            uint160 hash160;
+            if (fTallyBuilt && AddressToHash160(strAddress, hash160) && mapAddressTally.count(hash160))
+                fHistoryAccountsStale = true;
+        }
         return true;
     }
     else
@@ -1100,6 +2384,12 @@ bool CWallet::EraseAddressBookName(const std::string& strAddress)
     {
         CRITICAL_BLOCK(cs_mapAddressBook)
             mapAddressBook.erase(strAddress);
+        CRITICAL_BLOCK(cs_mapWallet)
+        {
+            uint160 hash160;
+            if (fTallyBuilt && AddressToHash160(strAddress, hash160) && mapAddressTally.count(hash160))
+                fHistoryAccountsStale = true;
+        }
         return true;
     }
     else
@@ -1155,7 +2445,7 @@ int64 CWallet::GetOldestKeyPoolTime()
 
 vector<unsigned char> CReserveKey::GetReservedKey()
 {
-    if (nIndex == -1)
+    if (nIndex == -1 && vchPubKey.empty())
     {
         CKeyPool keypool;
         pwallet->ReserveKeyFromKeyPool(nIndex, keypool);
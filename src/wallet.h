@@ -12,12 +12,248 @@ class CWalletTx;
 class CReserveKey;
 class CWalletDB;
 
+// Consolidation transactions stay under the 10K free size
+static const unsigned int MAX_SWEEP_TX_SIZE = 9000;
+static const unsigned int SWEEP_INPUT_SIZE = 180;   // signed pay-to-address input, rounded up
+static const unsigned int SWEEP_TX_OVERHEAD = 44;   // version, locktime, counts and one output
+
+// Payout batches leave most of the standard size limit for inputs
+static const int DEFAULT_PAYOUT_OUTPUTS = 500;
+
+
+//
+// Amounts received by one address, bucketed by the height of the block that
+// confirmed them so a minimum depth can be applied without looking at the
+// transactions again.  Unconfirmed amounts are kept under INT_MAX.
+//
+class CReceivedTally
+{
+public:
+    int64 nTotal;
+    std::map<int, std::pair<int64, int> > mapHeight; // height -> (amount, outputs)
+
+    CReceivedTally()
+    {
+        nTotal = 0;
+    }
+
+    void Add(int nHeight, int64 nValue, int nCount)
+    {
+        nTotal += nValue;
+        std::pair<int64, int>& bucket = mapHeight[nHeight];
+        bucket.first += nValue;
+        bucket.second += nCount;
+        if (bucket.second == 0)
+            mapHeight.erase(nHeight);
+    }
+
+    // Total of the buckets at or below nMaxHeight
+    int64 GetAmount(int nMaxHeight) const
+    {
+        // Most queries only exclude the last few blocks, so subtract those
+        int64 nAmount = nTotal;
+        std::map<int, std::pair<int64, int> >::const_reverse_iterator it;
+        for (it = mapHeight.rbegin(); it != mapHeight.rend() && (*it).first > nMaxHeight; ++it)
+            nAmount -= (*it).second.first;
+        return nAmount;
+    }
+
+    // Highest bucket at or below nMaxHeight, -1 if there is none
+    int GetMaxHeight(int nMaxHeight) const
+    {
+        std::map<int, std::pair<int64, int> >::const_iterator it = mapHeight.upper_bound(nMaxHeight);
+        if (it == mapHeight.begin())
+            return -1;
+        --it;
+        return (*it).first;
+    }
+};
+
+class CAddressTally
+{
+public:
+    CReceivedTally address; // standard address scripts only, as getreceivedby* count them
+    CReceivedTally all;     // any script form that pays this key
+    CReceivedTally fromMe;  // part of all from transactions we sent, may be change
+};
+
+//
+// What one wallet transaction added to the tallies, kept so it can be taken
+// back out exactly when the transaction changes or its block is reorganized.
+// Also lists the outputs coin selection and GetBalance need to look at.
+//
+class CWalletTxTally
+{
+public:
+    const CWalletTx* pwtx;
+    uint256 hashTx;
+    int64 nTime;
+    bool fFinal;
+    std::vector<std::string> vAccounts; // accounts listtransactions can show it under
+    std::vector<unsigned int> vMine;    // our outputs with a nonzero value
+    uint256 hashBlock;
+    int nHeight;
+    bool fCoinBase;
+    bool fFromMe;
+    int64 nGenerated;
+    std::vector<std::pair<uint160, int64> > vReceivedAddress;
+    std::vector<std::pair<uint160, int64> > vReceivedOther;
+    std::string strSentAccount;
+    std::vector<std::pair<CScript, int64> > vSent;
+    int64 nFee;
+
+    CWalletTxTally()
+    {
+        pwtx = NULL;
+        hashTx = 0;
+        nTime = 0;
+        fFinal = true;
+        hashBlock = 0;
+        nHeight = INT_MAX;
+        fCoinBase = false;
+        fFromMe = false;
+        nGenerated = 0;
+        nFee = 0;
+    }
+};
+
+
+//
+// Internal transfers.
+// Database key is acentry<account><counter>
+//
+class CAccountingEntry
+{
+public:
+    std::string strAccount;
+    int64 nCreditDebit;
+    int64 nTime;
+    std::string strOtherAccount;
+    std::string strComment;
+    uint64 nEntryNo; // database key number, not serialized
+
+    CAccountingEntry()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nCreditDebit = 0;
+        nTime = 0;
+        strAccount.clear();
+        strOtherAccount.clear();
+        strComment.clear();
+        nEntryNo = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        // Note: strAccount is serialized as part of the key, not here.
+        READWRITE(nCreditDebit);
+        READWRITE(nTime);
+        READWRITE(strOtherAccount);
+        READWRITE(strComment);
+    )
+};
+
+//
+// Position of a wallet transaction or internal accounting entry in the
+// wallet history, ordered by time.  Accounting entries carry their entry
+// number and sort after the transactions with the same time.
+//
+class CWalletHistoryKey
+{
+public:
+    int64 nTime;
+    uint64 nEntryNo;
+    uint256 hashTx;
+
+    CWalletHistoryKey()
+    {
+        nTime = 0;
+        nEntryNo = 0;
+        hashTx = 0;
+    }
+
+    CWalletHistoryKey(int64 nTimeIn, uint64 nEntryNoIn, const uint256& hashTxIn)
+    {
+        nTime = nTimeIn;
+        nEntryNo = nEntryNoIn;
+        hashTx = hashTxIn;
+    }
+
+    friend bool operator<(const CWalletHistoryKey& a, const CWalletHistoryKey& b)
+    {
+        if (a.nTime != b.nTime)
+            return a.nTime < b.nTime;
+        if (a.nEntryNo != b.nEntryNo)
+            return a.nEntryNo < b.nEntryNo;
+        return a.hashTx < b.hashTx;
+    }
+
+    std::string ToString() const
+    {
+        return strprintf("%"PRI64d":%"PRI64u":%s", nTime, nEntryNo, hashTx.GetHex().c_str());
+    }
+
+    bool SetString(const std::string& str)
+    {
+        std::string::size_type nSep1 = str.find(':');
+        std::string::size_type nSep2 = (nSep1 == std::string::npos ? nSep1 : str.find(':', nSep1 + 1));
+        if (nSep2 == std::string::npos || str.size() - nSep2 - 1 != 64)
+            return false;
+        nTime = atoi64(str.substr(0, nSep1));
+        nEntryNo = atoi64(str.substr(nSep1 + 1, nSep2 - nSep1 - 1));
+        hashTx.SetHex(str.substr(nSep2 + 1));
+        return true;
+    }
+};
+
+
 class CWallet : public CKeyStore
 {
 private:
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
+    // Received/balance index over mapWallet, guarded by cs_mapWallet and
+    // built the first time it's queried.  mapSpendable holds the
+    // transactions that still have unspent outputs of ours; fully spent
+    // ones are dropped from it as they're noticed.
+    mutable bool fTallyBuilt;
+    mutable std::map<uint256, CWalletTxTally> mapTxTally;
+    mutable std::map<uint256, std::set<uint256> > mapTallyByBlock;
+    mutable std::set<uint256> setTallyNotFinal;
+    mutable std::map<uint256, CWalletTxTally*> mapSpendable;
+    mutable std::map<uint160, CAddressTally> mapAddressTally;
+    mutable CReceivedTally tallyGenerated;
+    mutable std::map<std::string, std::map<CScript, int64> > mapTallySent;
+    mutable std::map<std::string, int64> mapTallyFee;
+
+    // Wallet history in time order, for all accounts and per account, also
+    // guarded by cs_mapWallet.  Accounting entries are loaded with the
+    // wallet; transactions join when the tally is built.
+    mutable std::set<CWalletHistoryKey> setHistory;
+    mutable std::map<std::string, std::set<CWalletHistoryKey> > mapAccountHistory;
+    mutable bool fHistoryAccountsStale;
+    std::map<uint64, CAccountingEntry> mapAcentries;
+    std::map<std::string, int64> mapAccountCreditDebit;
+
+    // Result of the last GetBalance, for callers that mustn't wait on
+    // cs_mapWallet, and whether there has been one yet
+    mutable CCriticalSection cs_nLastBalance;
+    mutable int64 nLastBalance;
+    mutable bool fLastBalance;
+
+    void ApplyTally(const CWalletTxTally& tally, int nSign) const;
+    void ApplyHistory(const CWalletHistoryKey& key, const std::vector<std::string>& vAccounts, int nSign) const;
+    void SetTallyAccounts(CWalletTxTally& tally) const;
+    void TallyTransaction(const CWalletTx& wtx) const;
+    void UntallyTransaction(const uint256& hash) const;
+    void UpdateTally() const;
+    void PruneSpendable(const std::vector<uint256>& vSpent) const;
 
 public:
     bool fFileBacked;
@@ -26,14 +262,46 @@ public:
     std::set<int64> setKeyPool;
     CCriticalSection cs_setKeyPool;
 
+    // Set once ReacceptWalletTransactions has brought the spent flags in
+    // line with the block chain, no coins are selected before then
+    bool fSpentChecked;
+
+    // Sweep progress, guarded by cs_mapWallet
+    int nSweepTransactions;
+    int64 nSweepInputs;
+    int64 nSweepValue;
+    int64 nSweepFees;
+    int64 nSweepTime;
+
     CWallet()
     {
         fFileBacked = false;
+        fTallyBuilt = false;
+        fHistoryAccountsStale = false;
+        nLastBalance = 0;
+        fLastBalance = false;
+        fSpentChecked = false;
+        InitSweep();
     }
     CWallet(std::string strWalletFileIn)
     {
         strWalletFile = strWalletFileIn;
         fFileBacked = true;
+        fTallyBuilt = false;
+        fHistoryAccountsStale = false;
+        nLastBalance = 0;
+        fLastBalance = false;
+        fSpentChecked = false;
+        InitSweep();
+    }
+
+    void InitSweep()
+    {
+        nSweepTransactions = 0;
+        nSweepInputs = 0;
+        nSweepValue = 0;
+        nSweepFees = 0;
+        nSweepTime = 0;
     }
 
     mutable CCriticalSection cs_mapWallet;
@@ -57,13 +325,28 @@ public:
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
+    int64 GetBalanceNoWait() const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    int64 GetReceivedByAddress(const uint160& hash160, int nMinDepth);
+    void GetReceivedByAddresses(int nMinDepth, std::map<uint160, std::pair<int64, int> >& mapReceivedRet);
+    int64 GetAccountTxBalance(const std::string& strAccount, int nMinDepth);
+    void UpdatedBlocks(const std::vector<uint256>& vhashBlock);
+    void IndexAccountingEntry(const CAccountingEntry& acentry);
+    int64 GetAccountCreditDebit(const std::string& strAccount) const;
+    std::map<std::string, int64> GetAccountCreditDebits() const;
+    bool GetPrevHistory(const std::string& strAccount, CWalletHistoryKey& key, bool fNewest, const CWalletTx*& pwtxRet, const CAccountingEntry*& pacentryRet) const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool CreatePayoutTransaction(const std::vector<std::pair<CScript, int64> >& vecSend, unsigned int& nPaymentsRet, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
+    void GetSweepCandidates(int64 nMaxCoinValue, std::vector<std::pair<double, std::pair<const CWalletTx*,unsigned int> > >& vCandidatesRet) const;
+    bool CreateSweepTransaction(int64 nMaxCoinValue, bool fAllowFee, CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet);
+    int SweepWallet(int64 nMaxCoinValue, int nMaxTransactions, bool fAllowFee, std::vector<uint256>& vhashRet);
     bool BroadcastTransaction(CWalletTx& wtxNew);
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToBitcoinAddress(std::string strAddress, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
+    int TopUpKeyPool(int64 nTargetSize);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
     void ReturnKey(int64 nIndex);
@@ -230,6 +513,8 @@ public:
     mutable int64 nCreditCached;
     mutable int64 nAvailableCreditCached;
     mutable int64 nChangeCached;
+    mutable CBlockIndex* pindexConfirmedCached;  // tip fConfirmedCached was computed at
+    mutable char fConfirmedCached;
 
     // memory only UI hints
     mutable unsigned int nTimeDisplayed;
@@ -275,6 +560,8 @@ public:
         nCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        pindexConfirmedCached = NULL;
+        fConfirmedCached = false;
         nTimeDisplayed = 0;
         nLinesDisplayed = 0;
         fConfirmedDisplayed = false;
@@ -352,6 +639,7 @@ public:
         fAvailableCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        pindexConfirmedCached = NULL;
     }
 
     void MarkSpent(unsigned int nOut)
@@ -457,6 +745,17 @@ public:
         if (!IsFromMe()) // using wtx's cached debit
             return false;
 
+        // The dependency walk only has to be redone when the tip moves
+        if (pindexConfirmedCached != pindexBest)
+        {
+            fConfirmedCached = IsDependencyConfirmed();
+            pindexConfirmedCached = pindexBest;
+        }
+        return fConfirmedCached;
+    }
+
+    bool IsDependencyConfirmed() const
+    {
         // If no confirmations but it's from us, we can still
         // consider it confirmed if all dependencies are confirmed
         std::map<uint256, const CMerkleTx*> mapPrev;
@@ -567,45 +866,8 @@ public:
 
 
 
-//
-// Internal transfers.
-// Database key is acentry<account><counter>
-//
-class CAccountingEntry
-{
-public:
-    std::string strAccount;
-    int64 nCreditDebit;
-    int64 nTime;
-    std::string strOtherAccount;
-    std::string strComment;
-
-    CAccountingEntry()
-    {
-        SetNull();
-    }
-
-    void SetNull()
-    {
-        nCreditDebit = 0;
-        nTime = 0;
-        strAccount.clear();
-        strOtherAccount.clear();
-        strComment.clear();
-    }
-
-    IMPLEMENT_SERIALIZE
-    (
-        if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        // Note: strAccount is serialized as part of the key, not here.
-        READWRITE(nCreditDebit);
-        READWRITE(nTime);
-        READWRITE(strOtherAccount);
-        READWRITE(strComment);
-    )
-};
-
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
+void ThreadReacceptWalletTransactions(void* parg);
+void ThreadSweepWallet(void* parg);
 
 #endif